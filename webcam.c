@@ -1,5 +1,18 @@
+#define _GNU_SOURCE
 #include "webcam.h"
+#include <stddef.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <linux/perf_event.h>
 
 /**
  * Keeping tabs on opened webcam devices
@@ -10,12 +23,19 @@ static webcam_t *_w[16] = {
     NULL, NULL, NULL, NULL,
     NULL, NULL, NULL, NULL
 };
+static pthread_mutex_t _mtx_w = PTHREAD_MUTEX_INITIALIZER;     // For the budgeted webcams
 
 /**
  * Private sigaction to catch segmentation fault
  */
 static struct sigaction *sa;
 
+/**
+ * Pending trace dump requested by signal, and where to write it
+ */
+static int _trace_signalled = 0;
+static char _trace_path[256];
+
 /**
  * Private function for successfully ioctl-ing the v4l2 device
  */
@@ -30,6 +50,307 @@ static int _ioctl(int fh, int request, void *arg)
     return r;
 }
 
+/**
+ * Private function returning the monotonic clock in nanoseconds
+ */
+static inline uint64_t _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Stage timing
+ *
+ * With -DWEBCAM_STATS every timed stage records its latency in the
+ * webcam's histograms using relaxed atomics, so webcam_stats can take
+ * a snapshot without locking. With -DWEBCAM_TRACE every timed stage is
+ * also recorded as an event in the calling thread's trace ring.
+ * Without either, the macros compile to nothing.
+ */
+#if defined(WEBCAM_STATS) || defined(WEBCAM_TRACE)
+#define STAGE_START(t)            uint64_t t = _now()
+#define STAGE_END(w, s, t, seq)   _stage_end(w, s, t, seq)
+#else
+#define STAGE_START(t)
+#define STAGE_END(w, s, t, seq)
+#endif
+
+#ifdef WEBCAM_TRACE
+#define TRACE_START(t)            uint64_t t = _now()
+#define TRACE_END(n, dev, t, seq) _trace_event(n, dev, seq, t, _now())
+#else
+#define TRACE_START(t)
+#define TRACE_END(n, dev, t, seq)
+#endif
+
+/**
+ * Private function mapping a latency to its histogram bucket
+ */
+static uint16_t _stats_bucket(uint64_t ns)
+{
+    int msb;
+    uint16_t b;
+
+    if (ns < WEBCAM_HIST_SUB) return ns;
+
+    // Octave from the most significant bit, sub-bucket from the bits below
+    msb = 63 - __builtin_clzll(ns);
+    b = (msb - 1) * WEBCAM_HIST_SUB + (ns >> (msb - 2) & (WEBCAM_HIST_SUB - 1));
+
+    return b < WEBCAM_HIST_BUCKETS ? b : WEBCAM_HIST_BUCKETS - 1;
+}
+
+/**
+ * Private function adding a sample to a histogram
+ * Safe to call from several threads at once.
+ */
+static void _stats_record(webcam_histogram_t *h, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[_stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Trace rings
+ *
+ * Every thread that records an event gets its own ring of
+ * WEBCAM_TRACE_EVENTS events, so recording never takes a lock or
+ * shares a cache line with another thread. Rings are linked into
+ * _trace_rings on first use and kept after the thread exits, so
+ * the memory used is bounded by the number of threads.
+ */
+#ifdef WEBCAM_TRACE
+#ifndef WEBCAM_TRACE_EVENTS
+#define WEBCAM_TRACE_EVENTS 4096
+#endif
+
+typedef struct trace_event {
+    const char  *name;
+    uint64_t    ts;
+    uint64_t    dur;
+    uint32_t    seq;
+    uint8_t     dev;
+} trace_event_t;
+
+typedef struct trace_ring {
+    struct trace_ring   *next;
+    pid_t               tid;
+    uint64_t            head;
+    trace_event_t       events[WEBCAM_TRACE_EVENTS];
+} trace_ring_t;
+
+static trace_ring_t *_trace_rings = NULL;
+static __thread trace_ring_t *_trace_ring = NULL;
+
+/**
+ * Private function recording an event in the calling thread's ring
+ */
+static void _trace_event(const char *name, uint8_t dev, uint32_t seq, uint64_t t0, uint64_t t1)
+{
+    trace_ring_t *r = _trace_ring;
+    trace_event_t *e;
+
+    // First event on this thread, so create and publish its ring
+    if (r == NULL) {
+        r = calloc(1, sizeof(trace_ring_t));
+        if (r == NULL) return;
+
+        r->tid = gettid();
+        r->next = __atomic_load_n(&_trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&_trace_rings, &r->next, r, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        _trace_ring = r;
+    }
+
+    e = &r->events[r->head % WEBCAM_TRACE_EVENTS];
+    e->name = name;
+    e->ts = t0;
+    e->dur = t1 - t0;
+    e->seq = seq;
+    e->dev = dev;
+
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+#if defined(WEBCAM_STATS) || defined(WEBCAM_TRACE)
+/**
+ * Private function closing a timed stage that started at t0
+ */
+static inline void _stage_end(webcam_t *w, webcam_stage_t s, uint64_t t0, uint32_t seq)
+{
+    uint64_t t1 = _now();
+
+    (void)seq;      // Only traced
+
+#ifdef WEBCAM_STATS
+    _stats_record(&w->stats.stage[s], t1 - t0);
+#endif
+#ifdef WEBCAM_TRACE
+    _trace_event(webcam_stage_name(s), w->index, seq, t0, t1);
+#endif
+}
+#endif
+
+/**
+ * Hardware counters
+ *
+ * With -DWEBCAM_PERF the streaming thread opens a perf event group
+ * for itself, and the counters are read before and after every RGB
+ * conversion. Counters the kernel or CPU does not provide are left
+ * out; if none can be opened (perf_event_paranoid, containers, VMs)
+ * the conversion simply runs uncounted.
+ */
+#ifdef WEBCAM_PERF
+#define PERF_START(w, c)    uint64_t c[3 + WEBCAM_COUNTERS]; bool c##_ok = _perf_read(w, c)
+#define PERF_END(w, c)      if (c##_ok) _perf_record(w, c)
+
+/**
+ * Private function to open the counter group for the calling thread
+ */
+static void _perf_open(webcam_t *w)
+{
+    static const uint64_t config[WEBCAM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    struct perf_event_attr attr;
+    int i, leader = -1;
+
+    for (i = 0; i < WEBCAM_COUNTERS; i++) {
+        CLEAR(attr);
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config[i];
+        attr.disabled = leader == -1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        w->perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (w->perf_fd[i] == -1) continue;
+
+        if (leader == -1) leader = w->perf_fd[i];
+        w->stats.convert.available |= 1 << i;
+    }
+
+    if (leader == -1) {
+        fprintf(stderr, "%s: hardware counters not available: %d, %s\n",
+                w->name, errno, strerror(errno));
+        return;
+    }
+
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/**
+ * Private function to close the counter group
+ */
+static void _perf_close(webcam_t *w)
+{
+    int i;
+
+    for (i = WEBCAM_COUNTERS - 1; i >= 0; i--) {
+        if (w->perf_fd[i] != -1) close(w->perf_fd[i]);
+        w->perf_fd[i] = -1;
+    }
+}
+
+/**
+ * Private function reading the counter group into values, laid out as
+ * { nr, time_enabled, time_running, counters... }
+ */
+static bool _perf_read(webcam_t *w, uint64_t *values)
+{
+    int i;
+
+    for (i = 0; i < WEBCAM_COUNTERS; i++) {
+        if (w->perf_fd[i] != -1) {
+            return read(w->perf_fd[i], values, (3 + WEBCAM_COUNTERS) * sizeof(uint64_t)) > 0;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Private function adding the counts since before to the webcam's totals
+ * When the group was multiplexed the counts are scaled up to the full
+ * time the conversion took.
+ */
+static void _perf_record(webcam_t *w, uint64_t *before)
+{
+    uint64_t after[3 + WEBCAM_COUNTERS];
+    uint64_t enabled, running;
+    int i, n = 0;
+
+    if (!_perf_read(w, after)) return;
+
+    enabled = after[1] - before[1];
+    running = after[2] - before[2];
+    if (running == 0) return;
+
+    for (i = 0; i < WEBCAM_COUNTERS; i++) {
+        if (w->perf_fd[i] == -1) continue;
+
+        __atomic_fetch_add(&w->stats.convert.value[i],
+                           (after[3 + n] - before[3 + n]) * enabled / running,
+                           __ATOMIC_RELAXED);
+        n++;
+    }
+
+    __atomic_fetch_add(&w->stats.convert.frames, 1, __ATOMIC_RELAXED);
+}
+#else
+#define PERF_START(w, c)
+#define PERF_END(w, c)
+#define _perf_open(w)
+#define _perf_close(w)
+#endif
+
+/**
+ * Static tracepoints
+ *
+ * USDT probes in the "webcam" provider, for use with perf, bpftrace or
+ * SystemTap. Every probe carries the device index (in _w), the V4L2
+ * sequence number, the buffer index and a byte count:
+ *
+ *   dequeue        buffer handed out by the driver, bytes used
+ *   convert_start  about to convert, raw bytes
+ *   convert_end    conversion done, RGB bytes
+ *   publish        frame available to webcam_grab, RGB bytes
+ *   grab           frame copied by webcam_grab, bytes copied
+ *   requeue        buffer handed back to the driver, buffer length
+ *
+ * sys/sdt.h is header-only; a probe is a single nop until a tracer
+ * attaches. When the header is not available the probes compile away.
+ *
+ *   bpftrace -e 'usdt:./test:webcam:publish { @[arg0] = count(); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(WEBCAM_NO_SDT)
+#include <sys/sdt.h>
+#define PROBE(name, dev, seq, index, bytes) \
+    DTRACE_PROBE4(webcam, name, dev, seq, index, bytes)
+#endif
+#endif
+
+#ifndef PROBE
+#define PROBE(name, dev, seq, index, bytes)
+#endif
+
 /**
  * Private function to clamp a double value to the nearest int
  * between 0 and 255
@@ -69,22 +390,48 @@ static void handler(int sig, siginfo_t *si, void *unused)
 }
 
 /**
- * Private function to convert a YUYV buffer to a RGB frame and store it
- * within the given buffer structure
+ * Private function converting the pixel at byte i of a YUYV buffer to
+ * RGB, returning its luma
  *
  * http://linuxtv.org/downloads/v4l-dvb-apis/colorspaces.html
  */
-static void convertToRGB(struct buffer buf, struct buffer *frame)
+static inline uint8_t _convert_pixel(const struct buffer *buf, size_t i, uint8_t *rgb)
 {
-    size_t i;
     uint8_t y, u, v;
 
-    int uOffset = 0;
-    int vOffset = 0;
+    int uOffset = (i % 4 == 0) ? 1 : -1;
+    int vOffset = (i % 4 == 2) ? 1 : -1;
 
     double R, G, B;
     double Y, Pb, Pr;
 
+    y = buf->start[i];
+    u = (i + uOffset > 0 && i + uOffset < buf->length) ? buf->start[i + uOffset] : 0x80;
+    v = (i + vOffset > 0 && i + vOffset < buf->length) ? buf->start[i + vOffset] : 0x80;
+
+    Y =  (255.0 / 219.0) * (y - 0x10);
+    Pb = (255.0 / 224.0) * (u - 0x80);
+    Pr = (255.0 / 224.0) * (v - 0x80);
+
+    R = 1.0 * Y + 0.000 * Pb + 1.402 * Pr;
+    G = 1.0 * Y + 0.344 * Pb - 0.714 * Pr;
+    B = 1.0 * Y + 1.772 * Pb + 0.000 * Pr;
+
+    rgb[0] = clamp(R);
+    rgb[1] = clamp(G);
+    rgb[2] = clamp(B);
+
+    return y;
+}
+
+/**
+ * Private function to convert a YUYV buffer to a RGB frame and store it
+ * within the given buffer structure
+ */
+static void convertToRGB(struct buffer buf, struct buffer *frame)
+{
+    size_t i;
+
     // Initialize frame
     if (frame->start == NULL) {
         frame->length = buf.length / 2 * 3;
@@ -94,24 +441,7 @@ static void convertToRGB(struct buffer buf, struct buffer *frame)
     // Go through the YUYV buffer and calculate RGB pixels
     for (i = 0; i < buf.length; i += 2)
     {
-        uOffset = (i % 4 == 0) ? 1 : -1;
-        vOffset = (i % 4 == 2) ? 1 : -1;
-
-        y = buf.start[i];
-        u = (i + uOffset > 0 && i + uOffset < buf.length) ? buf.start[i + uOffset] : 0x80;
-        v = (i + vOffset > 0 && i + vOffset < buf.length) ? buf.start[i + vOffset] : 0x80;
-
-        Y =  (255.0 / 219.0) * (y - 0x10);
-        Pb = (255.0 / 224.0) * (u - 0x80);
-        Pr = (255.0 / 224.0) * (v - 0x80);
-
-        R = 1.0 * Y + 0.000 * Pb + 1.402 * Pr;
-        G = 1.0 * Y + 0.344 * Pb - 0.714 * Pr;
-        B = 1.0 * Y + 1.772 * Pb + 0.000 * Pr;
-
-        frame->start[i / 2 * 3    ] = clamp(R);
-        frame->start[i / 2 * 3 + 1] = clamp(G);
-        frame->start[i / 2 * 3 + 2] = clamp(B);
+        _convert_pixel(&buf, i, frame->start + i / 2 * 3);
     }
 }
 
@@ -151,138 +481,462 @@ static void equalize(struct buffer *buf)
         value = buf->start[i];
         buf->start[i] = 1.0 * (cdf[value] - cdf_min) / (buf->length / 2 - cdf_min) * (depth - 1);
     }
+
+    free(histogram);
+    free(cdf);
 }
 
 /**
- * Open the webcam on the given device and return a webcam
- * structure.
+ * Delta codec
+ *
+ * Every byte is predicted from the same component to its left, averaged
+ * with the byte above it when there is a row above. The zigzag-coded
+ * residuals of a row are stored in blocks of sixteen: a byte holding
+ * the bit widths of both halves, followed by each half of eight
+ * residuals packed at that width. Rows never share a block, so a row
+ * decodes on its own given the row above.
+ *
+ * http://en.wikipedia.org/wiki/Lossless_JPEG
  */
-struct webcam *webcam_open(const char *dev)
-{
-    struct stat st;
-
-    struct v4l2_capability cap;
-    struct v4l2_format fmt;
-
-    uint16_t min;
 
-    int fd;
-    struct webcam *w;
-
-    // Prepare signal handler if not yet
-    if (sa == NULL) {
-        sa = calloc(1, sizeof(struct sigaction));
-        sa->sa_flags = SA_SIGINFO;
-        sigemptyset(&sa->sa_mask);
-        sa->sa_sigaction = handler;
-        sigaction(SIGSEGV, sa, NULL);
+/**
+ * Private function returning the distance to the left neighbour of the
+ * same component, for even and odd bytes of the given pixel format
+ */
+static void _delta_distances(uint32_t format, uint8_t *d0, uint8_t *d1)
+{
+    if (format == V4L2_PIX_FMT_YUYV) {
+        *d0 = 2;    // Y after Y
+        *d1 = 4;    // U after U, V after V
+    } else {
+        *d0 = *d1 = 3;
     }
+}
 
-    // Check if the device path exists
-    if (-1 == stat(dev, &st)) {
-        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                dev, errno, strerror(errno));
-        return NULL;
-    }
+/**
+ * Private function returning the largest encoding of the given frame
+ */
+static size_t _delta_bound(size_t length, uint32_t stride)
+{
+    size_t rows = (length + stride - 1) / stride;
 
-    // Should be a character device
-    if (!S_ISCHR(st.st_mode)) {
-        fprintf(stderr, "%s is no device\n", dev);
-        return NULL;
-    }
+    return rows * ((stride + 15) / 16 * 17) + 8;
+}
 
-    // Create a file descriptor
-    fd = open(dev, O_RDWR | O_NONBLOCK, 0);
-    if (-1 == fd) {
-        fprintf(stderr, "Cannot open'%s': %d, %s\n",
-                dev, errno, strerror(errno));
-        return NULL;
-    }
+static inline uint8_t _zigzag(uint8_t d)
+{
+    return (uint8_t)(d << 1) ^ (uint8_t)((int8_t)d >> 7);
+}
 
-    // Query the webcam capabilities
-    if (-1 == _ioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s is no V4L2 device\n", dev);
-            return NULL;
-        } else {
-            fprintf(stderr, "%s: could not fetch video capabilities\n", dev);
-            return NULL;
-        }
-    }
+static inline uint8_t _unzigzag(uint8_t r)
+{
+    return (r >> 1) ^ -(r & 1);
+}
 
-    // Needs to be a capturing device
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        fprintf(stderr, "%s is no video capture device\n", dev);
-        return NULL;
-    }
+/**
+ * Private function packing the low w bits of eight bytes into 8 * w bits
+ */
+static inline uint64_t _delta_pack8(uint64_t v, uint8_t w)
+{
+    v = (v & 0x00ff00ff00ff00ffull) | (v & 0xff00ff00ff00ff00ull) >> (8 - w);
+    v = (v & 0x0000ffff0000ffffull) | (v & 0xffff0000ffff0000ull) >> (16 - 2 * w);
+    v = (v & 0x00000000ffffffffull) | (v & 0xffffffff00000000ull) >> (32 - 4 * w);
 
-    // Prepare webcam structure
-    w = calloc(1, sizeof(struct webcam));
-    w->fd = fd;
-    w->name = strdup(dev);
-    w->frame.start = NULL;
-    w->frame.length = 0;
-    pthread_mutex_init(&w->mtx_frame, NULL);
+    return v;
+}
 
-    // Initialize buffers
-    w->nbuffers = 0;
-    w->buffers = NULL;
+/**
+ * Private function spreading 8 * w bits back into eight bytes
+ */
+static inline uint64_t _delta_unpack8(uint64_t v, uint8_t w)
+{
+    uint64_t m;
 
-    // Store webcam in _w
-    int i = 0;
-    for(; i < 16; i++) {
-        if (_w[i] == NULL) {
-            _w[i] = w;
-            break;
-        }
-    }
+    if (w < 8) v &= (1ull << (8 * w)) - 1;
 
-    // Request supported formats
-    struct v4l2_fmtdesc fmtdesc;
-    uint32_t idx = 0;
-    char *pixelformat = calloc(5, sizeof(char));
-    for(;;) {
-        fmtdesc.index = idx;
-        fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    m = (1ull << (4 * w)) - 1;
+    v = (v & m) | (v >> (4 * w) & m) << 32;
+    m = ((1ull << (2 * w)) - 1) * 0x0000000100000001ull;
+    v = (v & m) | (v >> (2 * w) & m) << 16;
+    m = ((1ull << w) - 1) * 0x0001000100010001ull;
+    v = (v & m) | (v >> w & m) << 8;
 
-        if (-1 == _ioctl(w->fd, VIDIOC_ENUM_FMT, &fmtdesc)) break;
+    return v;
+}
 
-        memset(w->formats[idx], 0, 5);
-        memcpy(&w->formats[idx][0], &fmtdesc.pixelformat, 4);
-        fprintf(stderr, "%s: Found format: %s - %s\n", w->name, w->formats[idx], fmtdesc.description);
-        idx++;
-    }
+/**
+ * Private function predicting byte j of row s, with u the row above
+ */
+static inline uint8_t _delta_predict(const uint8_t *s, const uint8_t *u, size_t j, uint8_t d)
+{
+    if (j < d) return u != NULL ? u[j] : 0x80;
 
-    return w;
+    return u != NULL ? (s[j - d] + u[j] + 1) >> 1 : s[j - d];
 }
 
 /**
- * Closes the webcam
+ * Private function encoding a frame, returns the encoded length
  *
- * Also releases the buffers, and frees up memory
+ * dst needs _delta_bound bytes, scratch stride + 16 bytes.
  */
-void webcam_close(webcam_t *w)
+static size_t _delta_encode(const uint8_t *src, size_t length, uint32_t stride, uint32_t format,
+                            uint8_t *dst, uint8_t *scratch)
 {
-    uint16_t i;
+    uint8_t *out = dst;
+    const uint8_t *s, *u;
+    size_t row, n, j;
+    uint8_t d0, d1, w0, w1;
+    uint64_t a, b, t;
 
-    // Clear frame
-    free(w->frame.start);
-    w->frame.length = 0;
+    _delta_distances(format, &d0, &d1);
 
-    // Release memory-mapped buffers
-    for (i = 0; i < w->nbuffers; i++) {
-        munmap(w->buffers[i].start, w->buffers[i].length);
+    for (row = 0; row * stride < length; row++) {
+        s = src + row * stride;
+        u = row > 0 ? s - stride : NULL;
+        n = length - row * stride < stride ? length - row * stride : stride;
+
+        // Residuals of the row; the first pixels and the tail take the slow path
+        for (j = 0; j < n && j < 4; j++) {
+            scratch[j] = _zigzag(s[j] - _delta_predict(s, u, j, j & 1 ? d1 : d0));
+        }
+        if (u != NULL) {
+            for (; j + 1 < n; j += 2) {
+                scratch[j]     = _zigzag(s[j]     - ((s[j - d0]     + u[j]     + 1) >> 1));
+                scratch[j + 1] = _zigzag(s[j + 1] - ((s[j + 1 - d1] + u[j + 1] + 1) >> 1));
+            }
+        } else {
+            for (; j + 1 < n; j += 2) {
+                scratch[j]     = _zigzag(s[j]     - s[j - d0]);
+                scratch[j + 1] = _zigzag(s[j + 1] - s[j + 1 - d1]);
+            }
+        }
+        for (; j < n; j++) {
+            scratch[j] = _zigzag(s[j] - _delta_predict(s, u, j, j & 1 ? d1 : d0));
+        }
+        memset(scratch + n, 0, 16);
+
+        // Pack them in blocks of sixteen
+        for (j = 0; j < n; j += 16) {
+            memcpy(&a, scratch + j, 8);
+            memcpy(&b, scratch + j + 8, 8);
+
+            t = a | a >> 32; t |= t >> 16; t |= t >> 8;
+            w0 = (uint8_t)t ? 32 - __builtin_clz((uint8_t)t) : 0;
+            t = b | b >> 32; t |= t >> 16; t |= t >> 8;
+            w1 = (uint8_t)t ? 32 - __builtin_clz((uint8_t)t) : 0;
+
+            *out++ = w0 | w1 << 4;
+            t = _delta_pack8(a, w0);
+            memcpy(out, &t, 8);
+            out += w0;
+            t = _delta_pack8(b, w1);
+            memcpy(out, &t, 8);
+            out += w1;
+        }
+    }
+
+    return out - dst;
+}
+
+/**
+ * Private function decoding stored bytes into a frame of length bytes
+ *
+ * scratch needs stride + 16 bytes. Returns -1 on corrupt input.
+ */
+static int _delta_decode(const uint8_t *in, size_t stored, size_t length, uint32_t stride,
+                         uint32_t format, uint8_t *dst, uint8_t *scratch)
+{
+    const uint8_t *end = in + stored;
+    uint8_t *s, *u;
+    size_t row, n, j, h;
+    uint8_t d0, d1, w[2];
+    uint64_t v;
+
+    if (stride == 0) return -1;
+
+    _delta_distances(format, &d0, &d1);
+
+    for (row = 0; row * stride < length; row++) {
+        s = dst + row * stride;
+        u = row > 0 ? s - stride : NULL;
+        n = length - row * stride < stride ? length - row * stride : stride;
+
+        // Unpack the residuals of the row
+        for (j = 0; j < n; j += 16) {
+            if (in >= end) return -1;
+            w[0] = *in & 0x0f;
+            w[1] = *in >> 4;
+            in++;
+
+            for (h = 0; h < 2; h++) {
+                if (w[h] > 8 || in + w[h] > end) return -1;
+                v = 0;
+                memcpy(&v, in, end - in < 8 ? end - in : 8);
+                v = _delta_unpack8(v, w[h]);
+                memcpy(scratch + j + h * 8, &v, 8);
+                in += w[h];
+            }
+        }
+
+        // Undo the prediction
+        for (j = 0; j < n && j < 4; j++) {
+            s[j] = _delta_predict(s, u, j, j & 1 ? d1 : d0) + _unzigzag(scratch[j]);
+        }
+        if (u != NULL) {
+            for (; j + 1 < n; j += 2) {
+                s[j]     = ((s[j - d0]     + u[j]     + 1) >> 1) + _unzigzag(scratch[j]);
+                s[j + 1] = ((s[j + 1 - d1] + u[j + 1] + 1) >> 1) + _unzigzag(scratch[j + 1]);
+            }
+        } else {
+            for (; j + 1 < n; j += 2) {
+                s[j]     = s[j - d0]     + _unzigzag(scratch[j]);
+                s[j + 1] = s[j + 1 - d1] + _unzigzag(scratch[j + 1]);
+            }
+        }
+        for (; j < n; j++) {
+            s[j] = _delta_predict(s, u, j, j & 1 ? d1 : d0) + _unzigzag(scratch[j]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Private function preparing a webcam structure and storing it in _w
+ */
+static struct webcam *_webcam_new(const char *dev, int fd)
+{
+    int i;
+    struct webcam *w;
+    pthread_condattr_t attr;
+
+    // Prepare webcam structure
+    w = calloc(1, sizeof(struct webcam));
+    w->fd = fd;
+    w->name = strdup(dev);
+    w->sequence = 0;
+    w->frame.start = NULL;
+    w->frame.length = 0;
+    pthread_mutex_init(&w->mtx_frame, NULL);
+
+    w->sinks = NULL;
+    pthread_mutex_init(&w->mtx_sinks, NULL);
+
+    w->outputs = NULL;
+    pthread_mutex_init(&w->mtx_outputs, NULL);
+
+    sem_init(&w->work, 0, 0);
+    sem_init(&w->job.done, 0, 0);
+    pthread_mutex_init(&w->mtx_job, NULL);
+
+    pthread_mutex_init(&w->mtx_motion, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->moved, &attr);
+    pthread_cond_init(&w->fresh, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (i = 0; i < WEBCAM_COUNTERS; i++) w->perf_fd[i] = -1;
+
+    // Replay in real time, once, unless told otherwise
+    w->replay.realtime = true;
+
+    // Initialize buffers
+    w->nbuffers = 0;
+    w->buffers = NULL;
+
+    // Store webcam in _w
+    pthread_mutex_lock(&_mtx_w);
+    for(i = 0; i < 16; i++) {
+        if (_w[i] == NULL) {
+            _w[i] = w;
+            w->index = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_mtx_w);
+
+    return w;
+}
+
+/**
+ * Open the webcam on the given device and return a webcam
+ * structure.
+ *
+ * When given a recorded archive instead of a device, the archive is
+ * replayed as if it were a webcam.
+ */
+struct webcam *webcam_open(const char *dev)
+{
+    struct stat st;
+
+    struct v4l2_capability cap;
+    struct v4l2_format fmt;
+
+    uint16_t min;
+
+    int fd;
+    struct webcam *w;
+
+    // Prepare signal handler if not yet
+    if (sa == NULL) {
+        sa = calloc(1, sizeof(struct sigaction));
+        sa->sa_flags = SA_SIGINFO;
+        sigemptyset(&sa->sa_mask);
+        sa->sa_sigaction = handler;
+        sigaction(SIGSEGV, sa, NULL);
+    }
+
+    // Check if the device path exists
+    if (-1 == stat(dev, &st)) {
+        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
+                dev, errno, strerror(errno));
+        return NULL;
+    }
+
+    // Recorded archives are replayed as a virtual webcam
+    if (S_ISREG(st.st_mode)) {
+        webcam_archive_t *archive = webcam_archive_open(dev);
+        if (archive == NULL) return NULL;
+
+        w = _webcam_new(dev, -1);
+        w->replay.archive = archive;
+        return w;
+    }
+
+    // Should be a character device
+    if (!S_ISCHR(st.st_mode)) {
+        fprintf(stderr, "%s is no device\n", dev);
+        return NULL;
+    }
+
+    // Create a file descriptor
+    fd = open(dev, O_RDWR | O_NONBLOCK, 0);
+    if (-1 == fd) {
+        fprintf(stderr, "Cannot open'%s': %d, %s\n",
+                dev, errno, strerror(errno));
+        return NULL;
+    }
+
+    // Query the webcam capabilities
+    if (-1 == _ioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s is no V4L2 device\n", dev);
+            return NULL;
+        } else {
+            fprintf(stderr, "%s: could not fetch video capabilities\n", dev);
+            return NULL;
+        }
+    }
+
+    // Needs to be a capturing device
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        fprintf(stderr, "%s is no video capture device\n", dev);
+        return NULL;
+    }
+
+    w = _webcam_new(dev, fd);
+
+    // Request supported formats
+    struct v4l2_fmtdesc fmtdesc;
+    uint32_t idx = 0;
+    char *pixelformat = calloc(5, sizeof(char));
+    for(;;) {
+        fmtdesc.index = idx;
+        fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (-1 == _ioctl(w->fd, VIDIOC_ENUM_FMT, &fmtdesc)) break;
+
+        memset(w->formats[idx], 0, 5);
+        memcpy(&w->formats[idx][0], &fmtdesc.pixelformat, 4);
+        fprintf(stderr, "%s: Found format: %s - %s\n", w->name, w->formats[idx], fmtdesc.description);
+        idx++;
+    }
+
+    return w;
+}
+
+/**
+ * Closes the webcam
+ *
+ * Also releases the buffers, and frees up memory
+ */
+void webcam_close(webcam_t *w)
+{
+    uint16_t i;
+
+    // Clear frame and outputs
+    free(w->frame.start);
+    w->frame.length = 0;
+    while (w->outputs != NULL) webcam_output_remove(w, w->outputs);
+    free(w->pyramid.data.start);
+    free(w->pyramid_next.start);
+
+    // Stop the conversion workers
+    if (w->scheduler != NULL) webcam_scheduler_remove(w->scheduler, w);
+    if (w->workers != NULL) {
+        __atomic_store_n(&w->working, false, __ATOMIC_RELEASE);
+        for (i = 0; i < w->nworkers; i++) sem_post(&w->work);
+        for (i = 0; i < w->nworkers; i++) pthread_join(w->workers[i], NULL);
+        free(w->workers);
+    }
+    free(w->integral.table.start);
+    free(w->background);
+    free(w->averaged);
+    free(w->motion_sums);
+
+    // Release memory-mapped buffers, a replay's buffer points into the archive
+    if (w->replay.archive != NULL) {
+        webcam_archive_close(w->replay.archive);
+        free(w->replay.decoded.start);
+    } else {
+        for (i = 0; i < w->nbuffers; i++) {
+            munmap(w->buffers[i].start, w->buffers[i].length);
+        }
     }
 
     // Free allocated resources
     free(w->buffers);
     free(w->name);
 
+    // No longer keep tabs on it
+    pthread_mutex_lock(&_mtx_w);
+    if (_w[w->index] == w) _w[w->index] = NULL;
+    pthread_mutex_unlock(&_mtx_w);
+
     // Close the webcam file descriptor, and free the memory
-    close(w->fd);
+    if (-1 != w->fd) close(w->fd);
     free(w);
 }
 
+/**
+ * Private function "resizing" a replayed webcam
+ * Archives are replayed at the size they were recorded at, the same
+ * way a driver picks the nearest size it supports.
+ */
+static void _replay_resize(webcam_t *w, uint16_t width, uint16_t height)
+{
+    const webcam_archive_frame_t *h = webcam_archive_frame(w->replay.archive, 0, NULL);
+
+    fprintf(stderr, "%s: requesting image format %ux%u\n", w->name, width, height);
+    if (h == NULL) {
+        fprintf(stderr, "%s has no frames to replay\n", w->name);
+        return;
+    }
+
+    w->width = h->width;
+    w->height = h->height;
+    w->pixelformat = h->format;
+    fprintf(stderr, "%s: set image format to %ux%u using %.4s\n",
+            w->name, w->width, w->height, (char *)&w->pixelformat);
+
+    // A single buffer, pointed at the payload of the frame being replayed
+    if (w->buffers == NULL) {
+        w->nbuffers = 1;
+        w->buffers = calloc(1, sizeof(struct buffer));
+    }
+}
+
 /**
  * Sets the webcam to capture at the given width and height
  */
@@ -292,6 +946,11 @@ void webcam_resize(webcam_t *w, uint16_t width, uint16_t height)
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
 
+    if (w->replay.archive != NULL) {
+        _replay_resize(w, width, height);
+        return;
+    }
+
     // Use YUYV as default for now
     CLEAR(fmt);
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -306,6 +965,7 @@ void webcam_resize(webcam_t *w, uint16_t width, uint16_t height)
     w->width = fmt.fmt.pix.width;
     w->height = fmt.fmt.pix.height;
     w->colorspace = fmt.fmt.pix.colorspace;
+    w->pixelformat = fmt.fmt.pix.pixelformat;
 
     char *pixelformat = calloc(5, sizeof(char));
     memcpy(pixelformat, &fmt.fmt.pix.pixelformat, 4);
@@ -378,75 +1038,1815 @@ void webcam_resize(webcam_t *w, uint16_t width, uint16_t height)
 }
 
 /**
- * Reads a frame from the webcam, converts it into the RGB colorspace
- * and stores it in the webcam structure
+ * Vectors for the portable SIMD of the kernels, which the compiler maps
+ * onto SSE2, NEON or plain registers. Wider lanes are loaded from bytes
+ * little-endian, as on x86 and ARM.
  */
-static void webcam_read(struct webcam *w)
+typedef uint8_t  _v16u8  __attribute__((vector_size(16)));
+typedef uint16_t _v16u16 __attribute__((vector_size(32)));
+typedef uint8_t  _v8u8   __attribute__((vector_size(8)));
+typedef uint16_t _v8u16  __attribute__((vector_size(16)));
+typedef uint32_t _v4u32  __attribute__((vector_size(16)));
+typedef int32_t  _v4i32  __attribute__((vector_size(16)));
+typedef int16_t  _v8i16  __attribute__((vector_size(16)));
+
+/**
+ * Private function clamping a fixed-point result to a byte
+ */
+static inline uint8_t _clamp8(int x)
 {
-    struct v4l2_buffer buf;
+    return x < 0 ? 0 : x > 255 ? 255 : x;
+}
 
-    // Try getting an image from the device
-    for(;;) {
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+/**
+ * Private function converting one pixel to RGB in 16.16 fixed point,
+ * with the same coefficients as convertToRGB()
+ */
+static inline void _yuv_rgb(uint8_t *d, int y, int u, int v)
+{
+    int c = 76310 * (y - 0x10);
 
-        // Dequeue a (filled) buffer from the video device
-        if (-1 == _ioctl(w->fd, VIDIOC_DQBUF, &buf)) {
-            switch(errno) {
-                case EAGAIN:
-                    continue;
+    u -= 0x80;
+    v -= 0x80;
+    d[0] = _clamp8((c + 104597 * v) >> 16);
+    d[1] = _clamp8((c + 25665 * u - 53268 * v) >> 16);
+    d[2] = _clamp8((c + 132202 * u) >> 16);
+}
 
-                case EIO:
-                default:
-                    fprintf(stderr, "%d: Could not read from device %s\n", errno, w->name);
-                    break;
-            }
-        }
+/**
+ * Private function clamping every lane of a fixed-point result to a byte
+ */
+static inline _v4i32 _clamp8v(_v4i32 x)
+{
+    x &= ~(x >> 31);
+    x |= (255 - x) >> 31;
 
-        // Make sure we are not out of bounds
-        assert(buf.index < w->nbuffers);
+    return x & 255;
+}
 
-        // Lock frame mutex, and store RGB
-        pthread_mutex_lock(&w->mtx_frame);
-        convertToRGB(w->buffers[buf.index], &w->frame);
-        pthread_mutex_unlock(&w->mtx_frame);
-        break;
-    }
+/**
+ * Private function storing four pixels converted from their luma term
+ * c and chroma terms r, g and b, step bytes apart
+ */
+static inline void _rgb_store(_v4i32 c, _v4i32 r, _v4i32 g, _v4i32 b, uint8_t *dst, uint32_t step)
+{
+    uint32_t k;
 
-    // Queue buffer back into the video device
-    if (-1 == _ioctl(w->fd, VIDIOC_QBUF, &buf)) {
-        fprintf(stderr, "Error while swapping buffers on %s\n", w->name);
-        return;
+    r = _clamp8v((c + r) >> 16);
+    g = _clamp8v((c + g) >> 16);
+    b = _clamp8v((c + b) >> 16);
+    for (k = 0; k < 4; k++, dst += step) {
+        dst[0] = r[k];
+        dst[1] = g[k];
+        dst[2] = b[k];
     }
 }
 
 /**
- * The loop function for the webcam thread
+ * Private function converting a row of YUYV to RGB, like _yuv_rgb(),
+ * four pairs at a time
  */
-static void *webcam_streaming(void *ptr)
+static void _yuyv_rgb_row(const uint8_t *src, uint8_t *dst, uint32_t width)
 {
-    webcam_t *w = (webcam_t *)ptr;
+    _v4i32 u, v, r, g, b;
+    _v4u32 pairs;
+    uint32_t i;
+
+    for (i = 0; i + 8 <= width; i += 8, src += 16, dst += 24) {
+        memcpy(&pairs, src, sizeof(pairs));
+        u = (_v4i32)((pairs >> 8) & 0xff) - 0x80;
+        v = (_v4i32)(pairs >> 24) - 0x80;
+
+        r = 104597 * v;
+        g = 25665 * u - 53268 * v;
+        b = 132202 * u;
+        _rgb_store(76310 * ((_v4i32)(pairs & 0xff) - 0x10), r, g, b, dst, 6);
+        _rgb_store(76310 * ((_v4i32)((pairs >> 16) & 0xff) - 0x10), r, g, b, dst + 3, 6);
+    }
 
-    while(w->streaming) webcam_read(w);
+    for (; i < width; i += 2, src += 4, dst += 6) {
+        _yuv_rgb(dst, src[0], src[1], src[3]);
+        if (i + 1 < width) _yuv_rgb(dst + 3, src[2], src[1], src[3]);
+    }
 }
 
 /**
- * Tells the webcam to go into streaming mode, or to
- * stop streaming.
- * When going into streaming mode, it also creates
- * a thread running the webcam_streaming function.
- * When exiting the streaming mode, it sets the streaming
- * bit to false, and waits for the thread to finish.
+ * Private function (re)making the scaling maps of an output when the
+ * frame size changed; false when the output does not fit its region
  */
-void webcam_stream(struct webcam *w, bool flag)
+static bool _output_prepare(webcam_output_t *o, uint16_t width, uint16_t height)
 {
-    uint8_t i;
+    uint32_t i, n, rw, rh;
 
-    struct v4l2_buffer buf;
-    enum v4l2_buf_type type;
+    if (o->source_width == width && o->source_height == height) return o->ready;
 
-    if (flag) {
+    free(o->xmap);
+    free(o->ymap);
+    free(o->xscale);
+    free(o->cscale);
+    free(o->sums);
+    o->xmap = o->ymap = o->sums = NULL;
+    o->xscale = o->cscale = NULL;
+    o->source_width = width;
+    o->source_height = height;
+    o->ready = false;
+
+    // Regions start on a whole YUYV pair
+    o->left = o->x & ~1;
+    o->top = o->y;
+    if (o->left >= width || o->top >= height) {
+        fprintf(stderr, "Output region at %u,%u lies outside the %ux%u frame\n", o->x, o->y, width, height);
+        return false;
+    }
+    rw = o->roi_width == 0 || o->left + o->roi_width > width ? width - o->left : o->roi_width;
+    rh = o->roi_height == 0 || o->top + o->roi_height > height ? height - o->top : o->roi_height;
+    if (o->width > rw || o->height > rh || rw > 256u * o->width || rh > 256u * o->height) {
+        fprintf(stderr, "Output of %ux%u cannot be scaled from a %ux%u region\n", o->width, o->height, rw, rh);
+        return false;
+    }
+
+    o->xmap = calloc(o->width + 1, sizeof(uint16_t));
+    o->ymap = calloc(o->height + 1, sizeof(uint16_t));
+    o->xscale = calloc(o->width, sizeof(uint32_t));
+    o->cscale = calloc(o->width, sizeof(uint32_t));
+    o->sums = calloc((rw + 1) & ~1u, 2 * sizeof(uint16_t));
+    if (o->xmap == NULL || o->ymap == NULL || o->xscale == NULL || o->cscale == NULL || o->sums == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    for (i = 0; i <= o->width; i++) o->xmap[i] = i * rw / o->width;
+    for (i = 0; i <= o->height; i++) o->ymap[i] = i * rh / o->height;
+    for (i = 0; i < o->width; i++) {
+        n = o->xmap[i + 1] - o->xmap[i];
+        o->xscale[i] = (65536 + n / 2) / n;
+        n = ((o->xmap[i + 1] - 1) >> 1) - (o->xmap[i] >> 1) + 1;
+        o->cscale[i] = (65536 + n / 2) / n;
+    }
+
+    o->ready = true;
+    return true;
+}
+
+/**
+ * Private function making one row of an output from the rows of the
+ * YUYV buffer it covers
+ *
+ * The rows are summed per column first, then every output column
+ * averages the sums of its columns.
+ */
+static void _output_row(webcam_output_t *o, const uint8_t *src, size_t stride, uint16_t row)
+{
+    uint32_t bpp = o->format == V4L2_PIX_FMT_YUYV ? 2 : 3;
+    uint8_t *dst = o->target != NULL ? o->target + row * o->stride
+                                     : o->frames[o->front ^ 1].start + (size_t)row * o->width * bpp;
+    const uint8_t *line = src + (size_t)(o->top + o->ymap[row]) * stride + o->left * 2;
+    uint32_t rows = o->ymap[row + 1] - o->ymap[row];
+    uint32_t columns = (o->xmap[o->width] + 1) & ~1u;
+    uint16_t *sums = o->sums, width = o->width;
+    const uint16_t *xmap = o->xmap;
+    const uint32_t *xscale = o->xscale, *cscale = o->cscale;
+    _v16u8 bytes;
+    _v16u16 words;
+    uint64_t ys, us, vs, rscale, scale;
+    uint32_t i, x, p, r, y, u = 0, v = 0;
+
+    // Same size as the region, so only a conversion
+    if (width == xmap[width] && rows == 1) {
+        if (bpp == 2) {
+            memcpy(dst, line, (size_t)width * 2);
+            return;
+        }
+        _yuyv_rgb_row(line, dst, width);
+        return;
+    }
+
+    // Sixteen bytes at a time; the last pair of a region rounded up, as its chroma is needed
+    memset(sums, 0, columns * 2 * sizeof(uint16_t));
+    for (r = 0; r < rows; r++, line += stride) {
+        for (i = 0; i + 16 <= columns * 2; i += 16) {
+            memcpy(&bytes, line + i, sizeof(bytes));
+            memcpy(&words, sums + i, sizeof(words));
+            words += __builtin_convertvector(bytes, _v16u16);
+            memcpy(sums + i, &words, sizeof(words));
+        }
+        for (; i < columns * 2; i++) sums[i] += line[i];
+    }
+    rscale = (65536 + rows / 2) / rows;
+
+    // Locals, as the stores through dst could otherwise alias all of o
+    for (i = 0; i < width; i++) {
+        ys = us = vs = 0;
+        for (x = xmap[i]; x < xmap[i + 1]; x++) ys += sums[2 * x];
+        for (p = xmap[i] >> 1; p <= (uint32_t)(xmap[i + 1] - 1) >> 1; p++) {
+            us += sums[4 * p + 1];
+            vs += sums[4 * p + 3];
+        }
+
+        scale = xscale[i] * rscale;
+        y = (ys * scale + (1ull << 31)) >> 32;
+        scale = cscale[i] * rscale;
+        us = (us * scale + (1ull << 31)) >> 32;
+        vs = (vs * scale + (1ull << 31)) >> 32;
+
+        if (bpp == 3) {
+            _yuv_rgb(dst + 3 * i, y, us, vs);
+            continue;
+        }
+
+        // YUYV outputs average the chroma of both pixels of a pair
+        dst[2 * i] = y;
+        if (i % 2 == 0) {
+            u = us;
+            v = vs;
+        } else {
+            dst[2 * i - 1] = (u + us + 1) / 2;
+            dst[2 * i + 1] = (v + vs + 1) / 2;
+        }
+    }
+}
+
+/**
+ * Private function pointing a tile at its place in the back buffer of
+ * its mosaic, which is not swapped until the tile is done. Unless wait,
+ * gives up with false instead of waiting for a pending swap.
+ */
+static bool _mosaic_begin(webcam_output_t *o, bool wait)
+{
+    webcam_mosaic_t *m = o->mosaic;
+
+    pthread_mutex_lock(&m->mtx);
+    if (m->swapping && !wait) {
+        pthread_mutex_unlock(&m->mtx);
+        return false;
+    }
+    while (m->swapping) pthread_cond_wait(&m->idle, &m->mtx);
+    m->writing++;
+    o->stride = (size_t)m->width * 3;
+    o->target = m->buffers[m->front ^ 1].start +
+                ((size_t)(o->tile / m->columns) * m->tile_height * m->width +
+                 (size_t)(o->tile % m->columns) * m->tile_width) * 3;
+    pthread_mutex_unlock(&m->mtx);
+
+    return true;
+}
+
+/**
+ * Private function giving up on a tile begun, as unwritten
+ */
+static void _mosaic_leave(webcam_output_t *o)
+{
+    webcam_mosaic_t *m = o->mosaic;
+
+    pthread_mutex_lock(&m->mtx);
+    if (--m->writing == 0) pthread_cond_broadcast(&m->idle);
+    pthread_mutex_unlock(&m->mtx);
+}
+
+/**
+ * Private function beginning all tiles of the webcam about to be made.
+ * A swap waits for the tiles being written, so only a webcam holding no
+ * tile may wait for one: else a swap pending on another tile of the
+ * webcam, or on a webcam waiting in turn on this one, never comes. When
+ * a tile meets a pending swap, the tiles begun are left and the tile
+ * begins first, waiting.
+ */
+static void _mosaics_begin(struct webcam *w)
+{
+    webcam_output_t *o, *p, *first;
+
+    for (first = w->outputs; first != NULL && (first->mosaic == NULL || first->row != 0); first = first->next);
+    while (first != NULL) {
+        _mosaic_begin(first, true);
+        for (o = w->outputs; o != NULL; o = o->next) {
+            if (o != first && o->mosaic != NULL && o->row == 0 && !_mosaic_begin(o, false)) break;
+        }
+        if (o == NULL) return;
+
+        for (p = w->outputs; p != o; p = p->next) {
+            if (p != first && p->mosaic != NULL && p->row == 0) _mosaic_leave(p);
+        }
+        _mosaic_leave(first);
+        first = o;
+    }
+}
+
+/**
+ * Private function marking a tile as written, letting a pending swap
+ * of its mosaic go ahead once no other tile is being written
+ */
+static void _mosaic_end(webcam_output_t *o, struct v4l2_buffer *buf)
+{
+    webcam_mosaic_t *m = o->mosaic;
+    webcam_mosaic_tile_t *t;
+
+    pthread_mutex_lock(&m->mtx);
+    t = &m->written[m->front ^ 1][o->tile];
+    t->sequence = buf->sequence;
+    t->timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + buf->timestamp.tv_usec * 1000ull;
+    t->arrival = _now();
+    if (--m->writing == 0) pthread_cond_broadcast(&m->idle);
+    pthread_mutex_unlock(&m->mtx);
+}
+
+/**
+ * Private function converting a strip of rows to RGB, the last one up
+ * to the end of the buffer like convertToRGB()
+ */
+static void _convert_rows(struct webcam *w, const buffer_t *raw, uint16_t row0, uint16_t row1)
+{
+    size_t i = (size_t)row0 * w->width * 2;
+    size_t end = row1 < w->height ? (size_t)row1 * w->width * 2 : raw->length;
+    uint8_t *rgb = w->frame.start + i / 2 * 3;
+
+    for (; i < end; i += 2, rgb += 3) _convert_pixel(raw, i, rgb);
+}
+
+/**
+ * Private function telling whether an output is left out when only the
+ * small ones are made, those of at most a quarter of the frame
+ */
+static bool _output_large(const struct webcam *w, const webcam_output_t *o)
+{
+    return (size_t)o->width * o->height * 4 > (size_t)w->width * w->height;
+}
+
+/**
+ * Private function locking the outputs of the webcam and preparing them
+ * for a YUYV buffer, or only the small ones; false, with nothing
+ * locked, when there are none
+ */
+static bool _outputs_begin(struct webcam *w, const buffer_t *raw, bool small)
+{
+    webcam_output_t *o;
+
+    pthread_mutex_lock(&w->mtx_outputs);
+    if (w->outputs == NULL || w->pixelformat != V4L2_PIX_FMT_YUYV ||
+        raw->length < (size_t)w->width * 2 * w->height) {
+        pthread_mutex_unlock(&w->mtx_outputs);
+        return false;
+    }
+
+    for (o = w->outputs; o != NULL; o = o->next) {
+        o->row = _output_prepare(o, w->width, w->height) && !(small && _output_large(w, o)) ? 0 : o->height;
+    }
+    _mosaics_begin(w);
+
+    return true;
+}
+
+/**
+ * Private function making the outputs band by band, and with frame the
+ * webcam's RGB frame along with them. A full-size RGB output of the
+ * whole frame is copied into it; without one the frame is converted
+ * like convertToRGB().
+ */
+static void _outputs_bands(struct webcam *w, const buffer_t *raw, struct v4l2_buffer *buf, bool frame)
+{
+    size_t stride = (size_t)w->width * 2, line = (size_t)w->width * 3;
+    webcam_output_t *o, *full = NULL;
+    uint32_t band, end;
+
+    (void)buf;      // Only timed
+    for (o = w->outputs; frame && o != NULL; o = o->next) {
+        if (o->ready && o->mosaic == NULL && o->format == V4L2_PIX_FMT_RGB24 &&
+            o->width == w->width && o->height == w->height) {
+            full = o;
+        }
+    }
+
+    // Every band of rows is read from memory once, while it is made into all outputs
+    STAGE_START(t_outputs);
+    for (band = 0; band < w->height; band = end) {
+        end = band + WEBCAM_OUTPUT_BAND < w->height ? band + WEBCAM_OUTPUT_BAND : w->height;
+        for (o = w->outputs; o != NULL; o = o->next) {
+            while (o->row < o->height && o->top + o->ymap[o->row] < end) {
+                _output_row(o, raw->start, stride, o->row);
+                o->row++;
+            }
+        }
+        if (full != NULL) {
+            memcpy(w->frame.start + band * line, full->frames[full->front ^ 1].start + band * line,
+                   (end - band) * line);
+        } else if (frame) {
+            _convert_rows(w, raw, band, end);
+        }
+    }
+    STAGE_END(w, WEBCAM_STAGE_OUTPUTS, t_outputs, buf->sequence);
+}
+
+/**
+ * Private function publishing the outputs made, or only the small ones,
+ * handing them to their sinks, and unlocking them
+ */
+static void _outputs_end(struct webcam *w, struct v4l2_buffer *buf, bool small)
+{
+    webcam_output_t *o;
+    webcam_sink_t *s;
+    webcam_frame_t f;
+
+    for (o = w->outputs; o != NULL; o = o->next) {
+        if (!o->ready || (small && _output_large(w, o))) continue;
+
+        // Tiles are published by their mosaic
+        if (o->mosaic != NULL) {
+            _mosaic_end(o, buf);
+            continue;
+        }
+
+        pthread_mutex_lock(&o->mtx_frame);
+        o->front ^= 1;
+        o->sequence = buf->sequence;
+        o->timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + buf->timestamp.tv_usec * 1000ull;
+        pthread_mutex_unlock(&o->mtx_frame);
+
+        if (o->sinks == NULL) continue;
+
+        CLEAR(f);
+        if (o->format == V4L2_PIX_FMT_YUYV) f.raw = o->frames[o->front];
+        else f.rgb = o->frames[o->front];
+        f.sequence = o->sequence;
+        f.timestamp = o->timestamp;
+        f.width = o->width;
+        f.height = o->height;
+
+        // The front buffer is not written again until the next frame
+        for (s = o->sinks; s != NULL; s = s->next) s->push(s, &f);
+    }
+    pthread_mutex_unlock(&w->mtx_outputs);
+}
+
+/**
+ * Private function giving up on outputs begun but not made, publishing
+ * nothing: tiles are released as unwritten, and the outputs unlocked
+ */
+static void _outputs_abort(struct webcam *w)
+{
+    webcam_output_t *o;
+
+    for (o = w->outputs; o != NULL; o = o->next) {
+        if (o->mosaic != NULL && o->row == 0) _mosaic_leave(o);
+    }
+    pthread_mutex_unlock(&w->mtx_outputs);
+}
+
+/**
+ * Private function making all outputs of the webcam from a YUYV buffer,
+ * or only the small ones, publishing them, and handing them to their
+ * sinks
+ */
+static void _outputs_make(struct webcam *w, const buffer_t *raw, struct v4l2_buffer *buf, bool small)
+{
+    if (!_outputs_begin(w, raw, small)) return;
+
+    _outputs_bands(w, raw, buf, false);
+    _outputs_end(w, buf, small);
+}
+
+/**
+ * Private function taking the luma of a row of YUYV, eight pixels at
+ * a time
+ */
+static void _luma_row(const uint8_t *src, uint8_t *dst, uint32_t width)
+{
+    _v8u16 words;
+    _v8u8 luma;
+    uint32_t i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        memcpy(&words, src + 2 * i, sizeof(words));
+        luma = __builtin_convertvector(words & 0xff, _v8u8);
+        memcpy(dst + i, &luma, sizeof(luma));
+    }
+    for (; i < width; i++) dst[i] = src[2 * i];
+}
+
+/**
+ * Private function averaging 2x2 blocks of two luma rows into a row of
+ * width pixels, eight at a time
+ */
+static void _luma_reduce(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint32_t width)
+{
+    _v8u16 top, bottom;
+    _v8u8 luma;
+    uint32_t i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        memcpy(&top, a + 2 * i, sizeof(top));
+        memcpy(&bottom, b + 2 * i, sizeof(bottom));
+        top = ((top & 0xff) + (top >> 8) + (bottom & 0xff) + (bottom >> 8) + 2) >> 2;
+        luma = __builtin_convertvector(top, _v8u8);
+        memcpy(dst + i, &luma, sizeof(luma));
+    }
+    for (; i < width; i++) {
+        dst[i] = (a[2 * i] + a[2 * i + 1] + b[2 * i] + b[2 * i + 1] + 2) >> 2;
+    }
+}
+
+/**
+ * Private function converting 2x2 blocks of two YUYV rows, a pair on
+ * each, into a row of width RGB pixels, four at a time
+ */
+static void _yuyv_rgb_reduce(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint32_t width)
+{
+    _v4u32 top, bottom;
+    _v4i32 y, u, v;
+    uint32_t i;
+
+    for (i = 0; i + 4 <= width; i += 4, a += 16, b += 16, dst += 12) {
+        memcpy(&top, a, sizeof(top));
+        memcpy(&bottom, b, sizeof(bottom));
+        y = (_v4i32)(((top & 0xff) + ((top >> 16) & 0xff) + (bottom & 0xff) + ((bottom >> 16) & 0xff) + 2) >> 2);
+        u = (_v4i32)((((top >> 8) & 0xff) + ((bottom >> 8) & 0xff) + 1) >> 1) - 0x80;
+        v = (_v4i32)(((top >> 24) + (bottom >> 24) + 1) >> 1) - 0x80;
+        _rgb_store(76310 * (y - 0x10), 104597 * v, 25665 * u - 53268 * v, 132202 * u, dst, 3);
+    }
+    for (; i < width; i++, a += 4, b += 4, dst += 3) {
+        _yuv_rgb(dst, (a[0] + a[2] + b[0] + b[2] + 2) >> 2, (a[1] + b[1] + 1) >> 1, (a[3] + b[3] + 1) >> 1);
+    }
+}
+
+/**
+ * Private function averaging 2x2 blocks of two RGB rows into a row of
+ * width pixels
+ */
+static void _rgb_reduce(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint32_t width)
+{
+    uint32_t i, c;
+
+    for (i = 0; i < width; i++, a += 6, b += 6, dst += 3) {
+        for (c = 0; c < 3; c++) dst[c] = (a[c] + a[c + 3] + b[c] + b[c + 3] + 2) >> 2;
+    }
+}
+
+/**
+ * Private function telling how many levels a pyramid of the given
+ * frame size has
+ */
+static uint8_t _pyramid_depth(uint16_t width, uint16_t height, uint8_t levels)
+{
+    uint8_t i;
+
+    for (i = 1; i < levels && i < WEBCAM_PYRAMID_LEVELS && width >= 2 && height >= 2; i++) {
+        width /= 2;
+        height /= 2;
+    }
+
+    return levels == 0 ? 0 : i;
+}
+
+/**
+ * Private function laying out the pyramid for the webcam's frame size,
+ * and (re)allocating both of its buffers. Called with mtx_frame held.
+ */
+static bool _pyramid_layout(struct webcam *w, uint8_t levels, bool rgb)
+{
+    webcam_pyramid_t *p = &w->pyramid;
+    size_t length = 0;
+    uint8_t i;
+
+    free(p->data.start);
+    free(w->pyramid_next.start);
+    CLEAR(*p);
+    CLEAR(w->pyramid_next);
+
+    p->rgb = rgb;
+    p->levels = _pyramid_depth(w->width, w->height, levels);
+    for (i = 0; i < p->levels; i++) {
+        p->level[i].width = i == 0 ? w->width : p->level[i - 1].width / 2;
+        p->level[i].height = i == 0 ? w->height : p->level[i - 1].height / 2;
+        p->level[i].luma = length;
+        length += (size_t)p->level[i].width * p->level[i].height;
+    }
+
+    // RGB images after all luma planes, so the planes stay close together
+    for (i = 1; rgb && i < p->levels; i++) {
+        p->level[i].rgb = length;
+        length += (size_t)p->level[i].width * p->level[i].height * 3;
+    }
+
+    p->data.start = calloc(length, sizeof(char));
+    w->pyramid_next.start = calloc(length, sizeof(char));
+    if (p->data.start == NULL || w->pyramid_next.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        free(p->data.start);
+        free(w->pyramid_next.start);
+        CLEAR(*p);
+        CLEAR(w->pyramid_next);
+        return false;
+    }
+    p->data.length = w->pyramid_next.length = length;
+
+    return true;
+}
+
+/**
+ * Private function making a row of a pyramid level from the two rows
+ * of the level above it that were just made, and so on down while
+ * those are in cache
+ */
+static void _pyramid_cascade(const webcam_pyramid_t *p, uint8_t *data, uint8_t level, uint16_t row)
+{
+    const webcam_pyramid_level_t *above, *l;
+
+    for (; level + 1 < p->levels && row % 2 == 1; level++, row /= 2) {
+        above = &p->level[level];
+        l = &p->level[level + 1];
+        if (row / 2 >= l->height) return;
+
+        _luma_reduce(data + above->luma + (size_t)(row - 1) * above->width,
+                     data + above->luma + (size_t)row * above->width,
+                     data + l->luma + (size_t)(row / 2) * l->width, l->width);
+        if (p->rgb) {
+            _rgb_reduce(data + above->rgb + (size_t)(row - 1) * above->width * 3,
+                        data + above->rgb + (size_t)row * above->width * 3,
+                        data + l->rgb + (size_t)(row / 2) * l->width * 3, l->width);
+        }
+    }
+}
+
+/**
+ * Private function making the webcam's image pyramid from a YUYV buffer
+ *
+ * The source is read once, two rows at a time. Every pair of rows makes
+ * two rows of level 0 and one of level 1, and any deeper rows that
+ * completes, so all levels are made while their inputs are in cache.
+ */
+static void _pyramid_make(struct webcam *w, const buffer_t *raw, struct v4l2_buffer *buf)
+{
+    webcam_pyramid_t *p = &w->pyramid;
+    uint8_t levels = __atomic_load_n(&w->pyramid_levels, __ATOMIC_ACQUIRE);
+    bool rgb = __atomic_load_n(&w->pyramid_rgb, __ATOMIC_ACQUIRE);
+    size_t stride = (size_t)w->width * 2;
+    const webcam_pyramid_level_t *l0 = &p->level[0], *l1 = &p->level[1];
+    uint8_t *data, *swap;
+    uint16_t row;
+
+    if (levels == 0 && p->levels == 0) return;
+    if (w->pixelformat != V4L2_PIX_FMT_YUYV || raw->length < stride * w->height) return;
+
+    // Only the capture thread allocates, so no grab sees a buffer being freed
+    if (p->levels != _pyramid_depth(w->width, w->height, levels) || p->rgb != rgb ||
+        l0->width != w->width || l0->height != w->height) {
+        pthread_mutex_lock(&w->mtx_frame);
+        if (levels == 0 || !_pyramid_layout(w, levels, rgb)) {
+            free(p->data.start);
+            free(w->pyramid_next.start);
+            CLEAR(*p);
+            CLEAR(w->pyramid_next);
+        }
+        pthread_mutex_unlock(&w->mtx_frame);
+        if (p->levels == 0) return;
+    }
+
+    STAGE_START(t_pyramid);
+    data = w->pyramid_next.start;
+    for (row = 0; row + 1 < l0->height; row += 2) {
+        _luma_row(raw->start + row * stride, data + l0->luma + (size_t)row * l0->width, l0->width);
+        _luma_row(raw->start + (row + 1) * stride, data + l0->luma + (size_t)(row + 1) * l0->width, l0->width);
+        if (p->levels < 2) continue;
+
+        _luma_reduce(data + l0->luma + (size_t)row * l0->width, data + l0->luma + (size_t)(row + 1) * l0->width,
+                     data + l1->luma + (size_t)(row / 2) * l1->width, l1->width);
+        if (p->rgb) {
+            _yuyv_rgb_reduce(raw->start + row * stride, raw->start + (row + 1) * stride,
+                             data + l1->rgb + (size_t)(row / 2) * l1->width * 3, l1->width);
+        }
+        _pyramid_cascade(p, data, 1, row / 2);
+    }
+    if (row < l0->height) {
+        _luma_row(raw->start + row * stride, data + l0->luma + (size_t)row * l0->width, l0->width);
+    }
+    STAGE_END(w, WEBCAM_STAGE_PYRAMID, t_pyramid, buf->sequence);
+
+    pthread_mutex_lock(&w->mtx_frame);
+    swap = p->data.start;
+    p->data.start = w->pyramid_next.start;
+    w->pyramid_next.start = swap;
+    p->sequence = buf->sequence;
+    pthread_mutex_unlock(&w->mtx_frame);
+}
+
+/**
+ * Private function converting a block of rows to RGB, and summing their
+ * luma into the integral image as if there were no rows above them
+ */
+static void _convert_block(struct webcam *w, const buffer_t *raw, uint16_t row0, uint16_t row1)
+{
+    uint32_t stride = w->width + 1, sum, x;
+    uint32_t *t = (uint32_t *)w->integral.table.start + (size_t)(row0 + 1) * stride;
+    size_t i = (size_t)row0 * w->width * 2;
+    uint8_t *rgb = w->frame.start + i / 2 * 3;
+    uint16_t y;
+
+    for (y = row0; y < row1; y++, t += stride) {
+        t[0] = 0;
+        for (x = 1, sum = 0; x < stride; x++, i += 2, rgb += 3) {
+            sum += _convert_pixel(raw, i, rgb);
+            t[x] = sum;
+        }
+
+        // Then the row above, while both are in cache
+        if (y > row0) {
+            for (x = 1; x < stride; x++) t[x] += (t - stride)[x];
+        }
+    }
+}
+
+/**
+ * Private function adding the sums of all rows above a block to all
+ * but its last row, which was carried down already
+ */
+static void _convert_fixup(struct webcam *w, uint16_t row0, uint16_t row1)
+{
+    uint32_t stride = w->width + 1, x;
+    const uint32_t *above = (uint32_t *)w->integral.table.start + (size_t)row0 * stride;
+    uint32_t *t = (uint32_t *)above + stride;
+    uint16_t y;
+
+    for (y = row0; y + 1 < row1; y++, t += stride) {
+        for (x = 1; x < stride; x++) t[x] += above[x];
+    }
+}
+
+/**
+ * Private function claiming a block of the current conversion pass;
+ * -1 when all blocks have been claimed
+ */
+static int32_t _convert_claim(struct webcam *w)
+{
+    webcam_convert_job_t *job = &w->job;
+    int32_t block = -1;
+
+    pthread_mutex_lock(&w->mtx_job);
+    if (job->next < job->blocks) {
+        block = job->next;
+        __atomic_store_n(&job->next, block + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&w->mtx_job);
+
+    return block;
+}
+
+/**
+ * Private function doing a claimed block of the current conversion pass
+ */
+static void _convert_do(struct webcam *w, uint16_t block)
+{
+    webcam_convert_job_t *job = &w->job;
+    uint16_t row0, row1;
+
+    row0 = block * job->rows;
+    row1 = row0 + job->rows < w->height ? row0 + job->rows : w->height;
+    if (job->pass == 0) _convert_block(w, &job->raw, row0, row1);
+    else if (job->pass == 2) _convert_rows(w, &job->raw, row0, row1);
+    else if (block > 0) _convert_fixup(w, row0, row1);
+
+    if (__atomic_add_fetch(&job->finished, 1, __ATOMIC_ACQ_REL) == job->blocks) {
+        sem_post(&job->done);
+    }
+}
+
+/**
+ * Private function claiming and doing a block of the current conversion
+ * pass; false when all blocks have been claimed
+ */
+static bool _convert_work(struct webcam *w)
+{
+    int32_t block = _convert_claim(w);
+
+    if (block < 0) return false;
+    _convert_do(w, block);
+
+    return true;
+}
+
+/**
+ * The loop function for the webcam's conversion workers
+ */
+static void *webcam_converting(void *ptr)
+{
+    webcam_t *w = (webcam_t *)ptr;
+
+    for (;;) {
+        while (-1 == sem_wait(&w->work) && EINTR == errno);
+        if (!__atomic_load_n(&w->working, __ATOMIC_ACQUIRE)) break;
+
+        while (_convert_work(w));
+    }
+
+    return NULL;
+}
+
+/**
+ * Private function claiming a block of the scheduler's member with the
+ * earliest deadline, preferring the member after the last one served
+ * when deadlines are equal; NULL when no member has blocks to claim.
+ * While the block is not done, its webcam cannot leave the scheduler.
+ */
+static struct webcam *_scheduler_claim(webcam_scheduler_t *s, uint16_t *block)
+{
+    struct webcam *w, *best;
+    uint64_t deadline = 0;
+    int32_t claimed = -1;
+    uint8_t i, n, first, after = 0;
+
+    // The webcams' jobs are only peeked at here, _convert_claim() decides
+    pthread_mutex_lock(&s->mtx);
+    do {
+        best = NULL;
+        first = s->next;
+        for (i = 0; i < s->count; i++) {
+            n = (first + i) % s->count;
+            w = s->members[n];
+            if (__atomic_load_n(&w->job.next, __ATOMIC_ACQUIRE) >= __atomic_load_n(&w->job.blocks, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if (best == NULL || __atomic_load_n(&w->job.deadline, __ATOMIC_RELAXED) < deadline) {
+                best = w;
+                deadline = __atomic_load_n(&w->job.deadline, __ATOMIC_RELAXED);
+                after = (n + 1) % s->count;
+            }
+        }
+        if (best != NULL) s->next = after;
+    } while (best != NULL && (claimed = _convert_claim(best)) < 0);
+    pthread_mutex_unlock(&s->mtx);
+
+    if (best != NULL) *block = claimed;
+
+    return best;
+}
+
+/**
+ * The loop function for the scheduler's workers
+ */
+static void *scheduler_working(void *ptr)
+{
+    webcam_scheduler_t *s = (webcam_scheduler_t *)ptr;
+    struct webcam *w;
+    uint64_t seen = 0;
+    uint16_t block;
+
+    for (;;) {
+        pthread_mutex_lock(&s->mtx);
+        while (s->running && s->posted == seen) pthread_cond_wait(&s->work, &s->mtx);
+        if (!s->running) {
+            pthread_mutex_unlock(&s->mtx);
+            break;
+        }
+        seen = s->posted;
+        pthread_mutex_unlock(&s->mtx);
+
+        // Counted before the block is done, after which the webcam may go
+        while ((w = _scheduler_claim(s, &block)) != NULL) {
+            __atomic_fetch_add(&w->stats.stolen, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&s->strips, 1, __ATOMIC_RELAXED);
+            _convert_do(w, block);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Private function setting up the next conversion job, with nothing to
+ * claim until its first pass starts
+ */
+static void _convert_job(struct webcam *w, const buffer_t *raw, uint16_t rows)
+{
+    webcam_convert_job_t *job = &w->job;
+
+    pthread_mutex_lock(&w->mtx_job);
+    job->raw = *raw;
+    job->rows = rows < 1 ? 1 : rows;
+    __atomic_store_n(&job->next, UINT16_MAX, __ATOMIC_RELEASE);
+    __atomic_store_n(&job->blocks, (w->height + job->rows - 1) / job->rows, __ATOMIC_RELEASE);
+    __atomic_store_n(&job->deadline, _now() + w->deadline, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->mtx_job);
+
+    if (w->scheduler != NULL) __atomic_fetch_add(&w->stats.scheduled, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Private function counting a scheduled frame converted after its
+ * deadline
+ */
+static void _convert_late(struct webcam *w)
+{
+    if (w->scheduler != NULL && _now() > w->job.deadline) {
+        __atomic_fetch_add(&w->stats.late, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Private function running one pass of the block conversion on the
+ * capture thread and the workers, the scheduler's if it has one
+ */
+static void _convert_pass(struct webcam *w, uint8_t pass)
+{
+    webcam_convert_job_t *job = &w->job;
+    webcam_scheduler_t *s = w->scheduler;
+    uint16_t i;
+
+    pthread_mutex_lock(&w->mtx_job);
+    job->pass = pass;
+    job->finished = 0;
+    __atomic_store_n(&job->next, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->mtx_job);
+
+    if (s != NULL && job->blocks > 1) {
+        pthread_mutex_lock(&s->mtx);
+        s->posted++;
+        pthread_cond_broadcast(&s->work);
+        pthread_mutex_unlock(&s->mtx);
+    } else if (s == NULL) {
+        for (i = 0; i < w->nworkers && i + 1 < job->blocks; i++) sem_post(&w->work);
+    }
+    while (_convert_work(w));
+    while (-1 == sem_wait(&job->done) && EINTR == errno);
+}
+
+/**
+ * Private function converting a YUYV buffer to RGB like convertToRGB(),
+ * in strips shared with the scheduler's workers. Called with mtx_frame
+ * held.
+ */
+static void _convert_scheduled(struct webcam *w, const buffer_t *raw)
+{
+    if (w->frame.start == NULL) {
+        w->frame.length = raw->length / 2 * 3;
+        w->frame.start = calloc(w->frame.length, sizeof(char));
+    }
+    if (w->frame.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    _convert_job(w, raw, WEBCAM_STRIP_ROWS);
+    _convert_pass(w, 2);
+    _convert_late(w);
+}
+
+/**
+ * Private function converting a YUYV buffer to RGB like convertToRGB(),
+ * while making the integral image of its luma. Called with mtx_frame
+ * held.
+ */
+static void _convert_integral(struct webcam *w, const buffer_t *raw)
+{
+    webcam_integral_t *t = &w->integral;
+    webcam_convert_job_t *job = &w->job;
+    size_t length = (size_t)(w->width + 1) * (w->height + 1) * sizeof(uint32_t);
+    uint32_t *above, *bottom, x;
+    uint16_t i;
+
+    if (raw->length < (size_t)w->width * w->height * 2) {
+        convertToRGB(*raw, &w->frame);
+        return;
+    }
+
+    if (w->frame.start == NULL) {
+        w->frame.length = raw->length / 2 * 3;
+        w->frame.start = calloc(w->frame.length, sizeof(char));
+    }
+    if (t->table.length != length) {
+        free(t->table.start);
+        t->table.start = calloc(length, sizeof(char));
+        t->table.length = t->table.start != NULL ? length : 0;
+        t->width = w->width;
+        t->height = w->height;
+    }
+    if (w->frame.start == NULL || t->table.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    // About four blocks per thread, and no fix-up without workers
+    if (w->scheduler != NULL) {
+        _convert_job(w, raw, WEBCAM_STRIP_ROWS);
+    } else {
+        _convert_job(w, raw, w->nworkers == 0 ? w->height :
+                             (w->height + 4 * (w->nworkers + 1) - 1) / (4 * (w->nworkers + 1)));
+    }
+    _convert_pass(w, 0);
+
+    // Carry the bottom row of every block down into the next one's
+    for (i = 1; i < job->blocks; i++) {
+        above = (uint32_t *)t->table.start + (size_t)i * job->rows * (w->width + 1);
+        bottom = above + (size_t)((i + 1) * job->rows < w->height ? job->rows : w->height - i * job->rows) *
+                         (w->width + 1);
+        for (x = 1; x <= w->width; x++) bottom[x] += above[x];
+    }
+
+    if (job->blocks > 1) _convert_pass(w, 1);
+    _convert_late(w);
+}
+
+/**
+ * Private function averaging four rows of YUYV luma over 4x4 pixels
+ */
+static void _motion_average(const uint8_t *src, size_t stride, uint8_t *dst, uint16_t width)
+{
+    _v8u16 a, b, c, d, s;
+    uint16_t x, i, sum;
+
+    // Two averaged pixels per 16 bytes of every row
+    for (x = 0; x + 2 <= width; x += 2) {
+        memcpy(&a, src + 8 * x, 16);
+        memcpy(&b, src + stride + 8 * x, 16);
+        memcpy(&c, src + 2 * stride + 8 * x, 16);
+        memcpy(&d, src + 3 * stride + 8 * x, 16);
+        s = (a & 0xff) + (b & 0xff) + (c & 0xff) + (d & 0xff);
+        dst[x] = (s[0] + s[1] + s[2] + s[3] + 8) >> 4;
+        dst[x + 1] = (s[4] + s[5] + s[6] + s[7] + 8) >> 4;
+    }
+    if (x < width) {
+        for (sum = 8, i = 0; i < 8; i += 2) {
+            sum += src[8 * x + i] + src[stride + 8 * x + i] + src[2 * stride + 8 * x + i] + src[3 * stride + 8 * x + i];
+        }
+        dst[x] = sum >> 4;
+    }
+}
+
+/**
+ * Private function comparing a row of averaged luma with the background,
+ * adding the absolute differences up per block and letting the
+ * background follow the frame by 1/32 of the difference
+ */
+static void _motion_row(const uint8_t *cur, uint16_t *background, uint32_t *sums, uint16_t width, uint16_t block)
+{
+    _v8u8 c8;
+    _v8i16 c, b, d, m;
+    uint16_t x, i;
+    int16_t e;
+
+    // Blocks are a multiple of 8 wide, so vectors never straddle two
+    for (x = 0; x + 8 <= width; x += 8) {
+        memcpy(&c8, cur + x, 8);
+        memcpy(&b, background + x, 16);
+        c = __builtin_convertvector(c8, _v8i16) << 4;
+        d = c - b;
+        b += d >> 5;
+        memcpy(background + x, &b, 16);
+
+        m = d >> 15;
+        d = (d ^ m) - m;
+        sums[x / block] += (uint32_t)(uint16_t)d[0] + (uint16_t)d[1] + (uint16_t)d[2] + (uint16_t)d[3] +
+                           (uint16_t)d[4] + (uint16_t)d[5] + (uint16_t)d[6] + (uint16_t)d[7];
+    }
+    for (i = x; i < width; i++) {
+        e = (int16_t)(cur[i] << 4) - (int16_t)background[i];
+        background[i] += e >> 5;
+        sums[i / block] += e < 0 ? -e : e;
+    }
+}
+
+/**
+ * Private function detecting motion in a YUYV buffer
+ *
+ * The luma is averaged down first, so the comparison touches 1/32 of
+ * the bytes of the frame. The first frame after a (re)start only
+ * becomes the background.
+ */
+static void _motion_detect(struct webcam *w, const buffer_t *raw, struct v4l2_buffer *buf)
+{
+    uint8_t threshold = __atomic_load_n(&w->motion_threshold, __ATOMIC_ACQUIRE);
+    size_t stride = (size_t)w->width * 2;
+    uint16_t width = w->width / WEBCAM_MOTION_SCALE, height = w->height / WEBCAM_MOTION_SCALE;
+    uint16_t block, columns, rows, y, by, x, bh;
+    webcam_motion_t m;
+    size_t i;
+
+    if (threshold == 0 && w->background == NULL) return;
+    if (w->pixelformat != V4L2_PIX_FMT_YUYV || raw->length < stride * w->height) return;
+
+    // Only the capture thread allocates the planes
+    if (threshold == 0 || width != w->motion_width || height != w->motion_height) {
+        free(w->background);
+        free(w->averaged);
+        free(w->motion_sums);
+        w->background = NULL;
+        w->averaged = NULL;
+        w->motion_sums = NULL;
+        w->motion_width = w->motion_height = 0;
+        w->motion_frames = 0;
+        pthread_mutex_lock(&w->mtx_motion);
+        CLEAR(w->motion);
+        pthread_mutex_unlock(&w->mtx_motion);
+        if (threshold == 0 || width == 0 || height == 0) return;
+
+        w->background = calloc((size_t)width * height, sizeof(uint16_t));
+        w->averaged = calloc((size_t)width * height, sizeof(uint8_t));
+        w->motion_sums = calloc(width, sizeof(uint32_t));
+        if (w->background == NULL || w->averaged == NULL || w->motion_sums == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            free(w->background);
+            free(w->averaged);
+            free(w->motion_sums);
+            w->background = NULL;
+            w->averaged = NULL;
+            w->motion_sums = NULL;
+            return;
+        }
+        w->motion_width = width;
+        w->motion_height = height;
+    }
+
+    STAGE_START(t_motion);
+    for (block = 8; ; block *= 2) {
+        columns = (width + block - 1) / block;
+        rows = (height + block - 1) / block;
+        if ((uint32_t)columns * rows <= WEBCAM_MOTION_BLOCKS) break;
+    }
+
+    for (y = 0; y < height; y++) {
+        _motion_average(raw->start + (size_t)y * WEBCAM_MOTION_SCALE * stride, stride,
+                        w->averaged + (size_t)y * width, width);
+    }
+
+    CLEAR(m);
+    m.sequence = buf->sequence;
+    m.timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + buf->timestamp.tv_usec * 1000ull;
+    m.block = block * WEBCAM_MOTION_SCALE;
+    m.columns = columns;
+    m.rows = rows;
+
+    if (w->motion_frames++ == 0) {
+        for (i = 0; i < (size_t)width * height; i++) w->background[i] = w->averaged[i] << 4;
+    } else {
+        for (by = 0; by < rows; by++) {
+            memset(w->motion_sums, 0, columns * sizeof(uint32_t));
+            bh = by + 1 < rows ? block : height - by * block;
+            for (y = by * block; y < by * block + bh; y++) {
+                _motion_row(w->averaged + (size_t)y * width, w->background + (size_t)y * width,
+                            w->motion_sums, width, block);
+            }
+
+            // Moving when the mean difference, still 12.4 fixed point, is over the threshold
+            for (x = 0; x < columns; x++) {
+                if (w->motion_sums[x] > ((uint32_t)threshold << 4) * bh *
+                                        (x + 1 < columns ? block : width - x * block)) {
+                    i = (size_t)by * columns + x;
+                    m.mask[i / 64] |= 1ull << (i % 64);
+                    m.moving++;
+                }
+            }
+        }
+        m.score = (float)m.moving / ((uint32_t)columns * rows);
+    }
+    STAGE_END(w, WEBCAM_STAGE_MOTION, t_motion, buf->sequence);
+
+    pthread_mutex_lock(&w->mtx_motion);
+    w->motion = m;
+    if (m.moving > 0) {
+        w->motion_events++;
+        pthread_cond_broadcast(&w->moved);
+    }
+    pthread_mutex_unlock(&w->mtx_motion);
+}
+
+/**
+ * Private function summing the two luma values of four YUYV words
+ */
+static inline _v4i32 _sharpness_load(const uint8_t *src)
+{
+    _v4u32 words;
+
+    memcpy(&words, src, sizeof(words));
+
+    return (_v4i32)((words & 0xff) + ((words >> 16) & 0xff));
+}
+
+/**
+ * Private function measuring the sharpness of a YUYV buffer, the
+ * variance of the Laplacian of its decimated luma grid
+ */
+static float _sharpness_measure(struct webcam *w, const buffer_t *raw, struct v4l2_buffer *buf)
+{
+    size_t stride = (size_t)w->width * 2;
+    uint32_t words = w->width / 2, j;
+    const uint8_t *above, *row, *below;
+    _v4i32 lap, sum;
+    _v4u32 squares;
+    uint64_t n = 0, sq = 0;
+    int64_t total = 0;
+    uint16_t y;
+    int32_t l;
+    double mean;
+
+    (void)buf;      // Only timed
+    if (w->pixelformat != V4L2_PIX_FMT_YUYV || words < 10 || raw->length < stride * w->height) return -1;
+
+    STAGE_START(t_sharpness);
+    // Grid rows are every other source row, so neighbours are two rows away
+    for (y = 2; y + 2 < w->height; y += 2 * WEBCAM_SHARPNESS_STEP) {
+        above = raw->start + (size_t)(y - 2) * stride;
+        row = raw->start + (size_t)y * stride;
+        below = raw->start + (size_t)(y + 2) * stride;
+
+        sum = (_v4i32){ 0 };
+        squares = (_v4u32){ 0 };
+        for (j = 1; j + 5 <= words; j += 4) {
+            lap = 4 * _sharpness_load(row + 4 * j) - _sharpness_load(row + 4 * (j - 1)) -
+                  _sharpness_load(row + 4 * (j + 1)) - _sharpness_load(above + 4 * j) -
+                  _sharpness_load(below + 4 * j);
+            sum += lap;
+            squares += (_v4u32)(lap * lap);
+        }
+        for (l = 0; l < 4; l++) {
+            total += sum[l];
+            sq += squares[l];
+        }
+        for (; j + 1 < words; j++) {
+            l = 4 * (row[4 * j] + row[4 * j + 2]) - row[4 * j - 4] - row[4 * j - 2] - row[4 * j + 4] -
+                row[4 * j + 6] - above[4 * j] - above[4 * j + 2] - below[4 * j] - below[4 * j + 2];
+            total += l;
+            sq += (uint64_t)(l * l);
+        }
+        n += words - 2;
+    }
+    STAGE_END(w, WEBCAM_STAGE_SHARPNESS, t_sharpness, buf->sequence);
+
+    if (n == 0) return -1;
+
+    // Grid points are sums of two luma values, so scale down by four
+    mean = (double)total / n;
+    return (float)(((double)sq / n - mean * mean) / 4);
+}
+
+/**
+ * Private function sampling the luma of a YUYV buffer, and telling
+ * whether it changed since the last frame that did
+ *
+ * A sample is the sum of 16 luma values, all in the same cache line or
+ * two, so about 1/16 of the lines of a 1080p frame are read.
+ */
+static bool _dedup_changed(struct webcam *w, const buffer_t *raw)
+{
+    uint16_t samples[WEBCAM_DEDUP_POINTS], limit, px, py, i, diff;
+    size_t stride = (size_t)w->width * 2;
+    uint64_t start = _now();
+    const uint8_t *row;
+    bool changed;
+    _v16u16 a;
+
+    if (w->pixelformat != V4L2_PIX_FMT_YUYV || w->width < 16 || w->height < WEBCAM_DEDUP_GRID ||
+        raw->length < stride * w->height) {
+        return true;
+    }
+
+    for (py = 0; py < WEBCAM_DEDUP_GRID; py++) {
+        row = raw->start + ((size_t)py * w->height / WEBCAM_DEDUP_GRID + w->height / (2 * WEBCAM_DEDUP_GRID)) * stride;
+        for (px = 0; px < WEBCAM_DEDUP_GRID; px++) {
+            // Start on an even pixel, so the luma is in the low byte of every lane
+            memcpy(&a, row + (((uint32_t)px * (w->width - 16) / (WEBCAM_DEDUP_GRID - 1)) & ~1u) * 2, 32);
+            a &= 0xff;
+            samples[py * WEBCAM_DEDUP_GRID + px] = a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7] +
+                                                   a[8] + a[9] + a[10] + a[11] + a[12] + a[13] + a[14] + a[15];
+        }
+    }
+
+    limit = (uint16_t)__atomic_load_n(&w->dedup_tolerance, __ATOMIC_ACQUIRE) * 16;
+    changed = w->dedup_width != w->width || w->dedup_height != w->height;
+    for (i = 0; i < WEBCAM_DEDUP_POINTS; i++) {
+        diff = samples[i] > w->dedup_samples[i] ? samples[i] - w->dedup_samples[i] : w->dedup_samples[i] - samples[i];
+        changed |= diff > limit;
+    }
+
+    // Compare with the last converted frame, so slow changes add up
+    if (changed) {
+        memcpy(w->dedup_samples, samples, sizeof(samples));
+        w->dedup_width = w->width;
+        w->dedup_height = w->height;
+    }
+
+    __atomic_fetch_add(&w->stats.checked, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->stats.check_ns, _now() - start, __ATOMIC_RELAXED);
+    if (!changed) __atomic_fetch_add(&w->stats.duplicates, 1, __ATOMIC_RELAXED);
+
+    return changed;
+}
+
+/**
+ * Private function deciding whether the webcam is on standby, as it has
+ * no sinks, outputs or motion detection and was not grabbed from for
+ * its idle period, and whether it skips the frame
+ */
+static bool _standby(struct webcam *w)
+{
+    uint64_t idle = __atomic_load_n(&w->standby_idle, __ATOMIC_ACQUIRE);
+    uint64_t demanded = __atomic_load_n(&w->demanded, __ATOMIC_ACQUIRE), now = _now();
+    bool standby = idle != 0 && w->sinks == NULL && w->outputs == NULL && w->motion_threshold == 0 &&
+                   now > demanded && now - demanded >= idle;
+
+    if (standby != w->standby) __atomic_store_n(&w->standby, standby, __ATOMIC_RELEASE);
+    if (!standby) {
+        w->standby_frames = 0;
+        return false;
+    }
+
+    return w->standby_every == 0 || w->standby_frames++ % w->standby_every != 0;
+}
+
+/**
+ * Private function deciding whether a degraded webcam sheds the frame
+ * altogether
+ */
+static bool _degrade_sheds(struct webcam *w, uint8_t level)
+{
+    uint32_t n;
+
+    if (level == WEBCAM_DEGRADE_NONE) return false;
+    if (level == WEBCAM_DEGRADE_SKIP) return true;
+
+    n = w->degrade_frames++;
+    return n % (level == WEBCAM_DEGRADE_HALF ? 2 : 4) != 0;
+}
+
+/**
+ * Private function handing a freshly published frame to the sinks
+ */
+static void _sinks_push(struct webcam *w, struct v4l2_buffer *buf, bool duplicate, bool shed)
+{
+    webcam_sink_t *s;
+    webcam_frame_t f;
+
+    if (w->sinks == NULL) return;
+
+    f.raw.start = w->buffers[buf->index].start;
+    f.raw.length = buf->bytesused ? buf->bytesused : w->buffers[buf->index].length;
+    f.rgb = w->frame;
+    f.sequence = buf->sequence;
+    f.timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + buf->timestamp.tv_usec * 1000ull;
+    f.width = w->width;
+    f.height = w->height;
+    f.pyramid = w->pyramid.levels > 0 ? &w->pyramid : NULL;
+    f.integral = w->integral.table.start != NULL ? &w->integral : NULL;
+    // A duplicate moved nothing, and must not hold a recorder's post-roll open
+    f.motion = w->background != NULL && !duplicate ? &w->motion : NULL;
+    f.duplicate = duplicate;
+    f.shed = shed;
+    if (shed) {
+        // Nothing was made of a shed frame, so hand no stale results either
+        CLEAR(f.rgb);
+        f.pyramid = NULL;
+        f.integral = NULL;
+        f.motion = NULL;
+    }
+    f.sharpness = w->sharpness;
+
+    // Only the capture thread writes w->frame, the pyramid, the integral image and the motion, so no need for a lock
+    pthread_mutex_lock(&w->mtx_sinks);
+    for (s = w->sinks; s != NULL; s = s->next) s->push(s, &f);
+    pthread_mutex_unlock(&w->mtx_sinks);
+}
+
+/**
+ * Private function growing the RGB frame to fit the conversion of raw,
+ * as replayed frames need not all be as large as the first. Called with
+ * mtx_frame held. Returns -1 when out of memory.
+ */
+static int _frame_fit(struct webcam *w, const buffer_t *raw)
+{
+    size_t length = w->pixelformat == V4L2_PIX_FMT_RGB24 ? raw->length : raw->length / 2 * 3;
+    uint8_t *start;
+
+    if (w->frame.start == NULL || w->frame.length >= length) return 0;
+
+    start = realloc(w->frame.start, length);
+    if (start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    w->frame.start = start;
+    w->frame.length = length;
+
+    return 0;
+}
+
+/**
+ * Private function waking the grabs waiting for the webcam to resume,
+ * for a frame that is not converted
+ */
+static void _resume(struct webcam *w)
+{
+    if (__atomic_load_n(&w->resuming, __ATOMIC_ACQUIRE) == 0) return;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    w->processed++;
+    pthread_cond_broadcast(&w->fresh);
+    pthread_mutex_unlock(&w->mtx_frame);
+}
+
+/**
+ * Private function converting the dequeued buffer into the RGB frame,
+ * and handing it to the sinks; false when it was skipped on standby
+ */
+static bool _publish_frame(struct webcam *w, struct v4l2_buffer *buf)
+{
+    buffer_t *raw = &w->buffers[buf->index];
+    bool dedup = __atomic_load_n(&w->dedup, __ATOMIC_ACQUIRE);
+    uint8_t level = __atomic_load_n(&w->degradation, __ATOMIC_ACQUIRE);
+    uint64_t t_dedup;
+    bool fused;
+
+    // Nobody wants the frames, so convert none or only a few of them
+    if (_standby(w)) {
+        __atomic_fetch_add(&w->stats.idle, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    // Shed frames skip everything but the sinks, or all but the small outputs
+    if (_degrade_sheds(w, level)) {
+        __atomic_fetch_add(&w->stats.shed, 1, __ATOMIC_RELAXED);
+        w->sharpness = -1;
+        _resume(w);
+        _sinks_push(w, buf, false, true);
+        return true;
+    } else if (level == WEBCAM_DEGRADE_OUTPUTS) {
+        __atomic_fetch_add(&w->stats.shed, 1, __ATOMIC_RELAXED);
+        w->sharpness = -1;
+        _resume(w);
+        _outputs_make(w, raw, buf, true);
+        _sinks_push(w, buf, false, true);
+        return true;
+    }
+
+    // Measured before converting, so sinks can skip blurry frames early
+    w->sharpness = __atomic_load_n(&w->sharpness_on, __ATOMIC_ACQUIRE) ? _sharpness_measure(w, raw, buf) : -1;
+
+    // Unchanged frames skip everything but the sinks
+    if (!dedup) {
+        w->dedup_width = 0;
+    } else if (!_dedup_changed(w, raw)) {
+        _resume(w);
+        _sinks_push(w, buf, true, false);
+        return true;
+    }
+    t_dedup = _now();
+
+    // With outputs, the frame is made in the same pass over the buffer as they are
+    fused = !w->integral_on && w->scheduler == NULL && _outputs_begin(w, raw, false);
+
+    // Lock frame mutex, and store RGB
+    STAGE_START(t_lock);
+    pthread_mutex_lock(&w->mtx_frame);
+    STAGE_END(w, WEBCAM_STAGE_LOCK, t_lock, buf->sequence);
+    if (-1 == _frame_fit(w, raw)) {
+        pthread_mutex_unlock(&w->mtx_frame);
+        if (fused) _outputs_abort(w);
+        return true;
+    }
+
+    STAGE_START(t_convert);
+    PROBE(convert_start, w->index, buf->sequence, buf->index, raw->length);
+    PERF_START(w, counters);
+    if (w->pixelformat == V4L2_PIX_FMT_RGB24) {
+        // Replayed RGB recordings need no conversion
+        if (w->frame.start == NULL) {
+            w->frame.length = raw->length;
+            w->frame.start = calloc(w->frame.length, sizeof(char));
+        }
+        memcpy(w->frame.start, raw->start, raw->length < w->frame.length ? raw->length : w->frame.length);
+    } else if (fused) {
+        if (w->frame.start == NULL) {
+            w->frame.length = raw->length / 2 * 3;
+            w->frame.start = calloc(w->frame.length, sizeof(char));
+        }
+        _outputs_bands(w, raw, buf, w->frame.start != NULL);
+    } else if (w->integral_on) {
+        _convert_integral(w, raw);
+        w->integral.sequence = buf->sequence;
+    } else if (w->scheduler != NULL && raw->length >= (size_t)w->width * w->height * 2) {
+        _convert_scheduled(w, raw);
+    } else {
+        convertToRGB(*raw, &w->frame);
+    }
+
+    // Turned off, so no sink is using the table any more
+    if (!w->integral_on && w->integral.table.start != NULL) {
+        free(w->integral.table.start);
+        CLEAR(w->integral);
+    }
+    PERF_END(w, counters);
+    PROBE(convert_end, w->index, buf->sequence, buf->index, w->frame.length);
+    STAGE_END(w, WEBCAM_STAGE_CONVERT, t_convert, buf->sequence);
+    w->sequence = buf->sequence;
+    w->frame_sharpness = w->sharpness;
+    w->published++;
+    w->processed++;
+    pthread_cond_broadcast(&w->fresh);
+    pthread_mutex_unlock(&w->mtx_frame);
+    if (dedup) __atomic_fetch_add(&w->stats.convert_ns, _now() - t_dedup, __ATOMIC_RELAXED);
+    PROBE(publish, w->index, buf->sequence, buf->index, w->frame.length);
+
+    _pyramid_make(w, raw, buf);
+    if (fused) _outputs_end(w, buf, false);
+    else _outputs_make(w, raw, buf, false);
+    _motion_detect(w, raw, buf);
+
+    // Hand the frame to the sinks while the raw buffer is still ours
+    _sinks_push(w, buf, false, false);
+
+    return true;
+}
+
+/**
+ * Private function checking a budgeted webcam's frame latency, and
+ * degrading a less important webcam when it was missed, or restoring
+ * the most important degraded one after a calm period
+ */
+static void _degrade_update(struct webcam *w, uint64_t latency)
+{
+    static uint64_t changed, tight;
+    struct webcam *v, *pick = NULL;
+    uint64_t now = _now();
+    bool missed = latency > w->budget;
+    uint8_t i, level;
+
+    _stats_record(&w->stats.latency, latency);
+    if (missed) __atomic_fetch_add(&w->stats.missed, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&_mtx_w);
+    if (latency > w->budget / 4 * 3) tight = now;
+
+    if (missed && now - changed >= WEBCAM_DEGRADE_SETTLE_MS * 1000000ull) {
+        for (i = 0; i < 16; i++) {
+            v = _w[i];
+            if (v == NULL || v->priority >= w->priority || v->degradation == WEBCAM_DEGRADE_SKIP) continue;
+            if (pick == NULL || v->priority < pick->priority ||
+                (v->priority == pick->priority && v->degradation < pick->degradation)) {
+                pick = v;
+            }
+        }
+    } else if (!missed && now - tight >= WEBCAM_DEGRADE_RECOVER_MS * 1000000ull &&
+               now - changed >= WEBCAM_DEGRADE_RECOVER_MS * 1000000ull) {
+        for (i = 0; i < 16; i++) {
+            v = _w[i];
+            if (v == NULL || v->degradation == WEBCAM_DEGRADE_NONE) continue;
+            if (pick == NULL || v->priority > pick->priority ||
+                (v->priority == pick->priority && v->degradation > pick->degradation)) {
+                pick = v;
+            }
+        }
+    }
+
+    if (pick != NULL) {
+        level = pick->degradation + (missed ? 1 : -1);
+        __atomic_store_n(&pick->degradation, level, __ATOMIC_RELEASE);
+        changed = now;
+    }
+    pthread_mutex_unlock(&_mtx_w);
+}
+
+/**
+ * Private function publishing a dequeued frame, and keeping its
+ * latency within the webcam's budget, if it has one; false when it was
+ * skipped on standby
+ */
+static bool _publish(struct webcam *w, struct v4l2_buffer *buf)
+{
+    uint64_t start = _now(), end;
+    bool published;
+
+    // Monotonic driver timestamps include the time spent in the queue
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+        (buf->timestamp.tv_sec || buf->timestamp.tv_usec)) {
+        end = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + buf->timestamp.tv_usec * 1000ull;
+        if (end < start) start = end;
+    }
+
+    published = _publish_frame(w, buf);
+    end = _now();
+    if (__atomic_load_n(&w->budget, __ATOMIC_ACQUIRE) != 0) _degrade_update(w, end - start);
+
+    return published;
+}
+
+/**
+ * Private function replaying the next frame of the archive
+ *
+ * In real time mode the frame is held back until as much time has
+ * passed since the start as between the recorded timestamps. The
+ * payload is used in place in the mapped archive.
+ */
+static void _replay_read(struct webcam *w)
+{
+    webcam_replay_t *r = &w->replay;
+    const webcam_archive_frame_t *h, *first;
+    struct v4l2_buffer buf;
+    struct timespec ts;
+    uint64_t due;
+
+    // At the end, either start over or idle
+    if (r->next >= r->archive->count) {
+        if (!r->loop || r->archive->count == 0) {
+            usleep(10000);
+            return;
+        }
+
+        // Timestamps going backwards count as no time at all
+        first = webcam_archive_frame(r->archive, 0, NULL);
+        h = webcam_archive_frame(r->archive, r->archive->count - 1, NULL);
+        if (first != NULL && h != NULL && h->timestamp > first->timestamp) {
+            r->offset += h->timestamp - first->timestamp +
+                         (h->timestamp - first->timestamp) / (r->archive->count > 1 ? r->archive->count - 1 : 1);
+        }
+        r->next = 0;
+        r->start = 0;
+    }
+
+    STAGE_START(t_dqbuf);
+    h = webcam_archive_frame(r->archive, r->next, &w->buffers[0]);
+    if (h == NULL) {
+        fprintf(stderr, "%s: frame %llu is outside the archive\n", w->name, (unsigned long long)r->next);
+        __atomic_store_n(&r->next, r->next + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Compressed frames are decoded, the others used in place
+    if (h->codec != WEBCAM_CODEC_NONE) {
+        if (r->decoded.length < h->length) {
+            free(r->decoded.start);
+            CLEAR(r->decoded);
+        }
+        if (-1 == webcam_archive_decode(r->archive, r->next, &r->decoded)) {
+            fprintf(stderr, "%s: could not decode frame %llu\n", w->name, (unsigned long long)r->next);
+            __atomic_store_n(&r->next, r->next + 1, __ATOMIC_RELEASE);
+            return;
+        }
+        w->buffers[0].start = r->decoded.start;
+        w->buffers[0].length = h->length;
+    }
+
+    if (r->start == 0) {
+        r->start = _now();
+        r->base = h->timestamp;
+    }
+
+    if (r->realtime) {
+        due = r->start + (h->timestamp > r->base ? h->timestamp - r->base : 0);
+        ts.tv_sec = due / 1000000000ull;
+        ts.tv_nsec = due % 1000000000ull;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+    }
+
+    CLEAR(buf);
+    buf.index = 0;
+    buf.sequence = r->frames++;
+    buf.bytesused = h->length;
+    buf.timestamp.tv_sec = (h->timestamp + r->offset) / 1000000000ull;
+    buf.timestamp.tv_usec = (h->timestamp + r->offset) % 1000000000ull / 1000;
+    STAGE_END(w, WEBCAM_STAGE_DQBUF, t_dqbuf, buf.sequence);
+    PROBE(dequeue, w->index, buf.sequence, buf.index, buf.bytesused);
+
+    _publish(w, &buf);
+    __atomic_store_n(&r->next, r->next + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Private function queueing a buffer back into the video device
+ */
+static void _requeue(struct webcam *w, struct v4l2_buffer *buf)
+{
+    // Synthetic webcams, as in the benches, have no device
+    if (w->fd == -1) return;
+
+    STAGE_START(t_qbuf);
+    if (-1 == _ioctl(w->fd, VIDIOC_QBUF, buf)) {
+        fprintf(stderr, "Error while swapping buffers on %s\n", w->name);
+        return;
+    }
+    STAGE_END(w, WEBCAM_STAGE_QBUF, t_qbuf, buf->sequence);
+    PROBE(requeue, w->index, buf->sequence, buf->index, buf->length);
+}
+
+/**
+ * Private function keeping a frame skipped on standby dequeued until the
+ * next one, for a resuming grab to convert, and queueing back the one
+ * kept before. True when buf was kept, so it is not queued back yet.
+ */
+static bool _keep(struct webcam *w, struct v4l2_buffer *buf, bool skipped)
+{
+    if (!skipped && !__atomic_load_n(&w->kept, __ATOMIC_ACQUIRE)) return false;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    if (w->kept) _requeue(w, &w->kept_buf);
+    w->kept_buf = *buf;
+    __atomic_store_n(&w->kept, skipped, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->mtx_frame);
+
+    return skipped;
+}
+
+/**
+ * Reads a frame from the webcam, converts it into the RGB colorspace
+ * and stores it in the webcam structure
+ */
+static void webcam_read(struct webcam *w)
+{
+    struct v4l2_buffer buf;
+    bool skipped = false;
+
+    if (w->replay.archive != NULL) {
+        _replay_read(w);
+        return;
+    }
+
+    STAGE_START(t_dqbuf);
+
+    // Try getting an image from the device
+    for(;;) {
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        // Dequeue a (filled) buffer from the video device
+        if (-1 == _ioctl(w->fd, VIDIOC_DQBUF, &buf)) {
+            switch(errno) {
+                case EAGAIN:
+                    continue;
+
+                case EIO:
+                default:
+                    fprintf(stderr, "%d: Could not read from device %s\n", errno, w->name);
+                    break;
+            }
+        }
+
+        // Make sure we are not out of bounds
+        assert(buf.index < w->nbuffers);
+        STAGE_END(w, WEBCAM_STAGE_DQBUF, t_dqbuf, buf.sequence);
+        PROBE(dequeue, w->index, buf.sequence, buf.index, buf.bytesused);
+
+        skipped = !_publish(w, &buf);
+        break;
+    }
+
+    if (_keep(w, &buf, skipped)) return;
+
+    // Queue buffer back into the video device
+    _requeue(w, &buf);
+}
+
+/**
+ * The loop function for the webcam thread
+ */
+static void *webcam_streaming(void *ptr)
+{
+    webcam_t *w = (webcam_t *)ptr;
+
+    _perf_open(w);
+
+    while(w->streaming) {
+        webcam_read(w);
+
+#ifdef WEBCAM_TRACE
+        // A dump was requested by signal, the first thread to see it writes it
+        if (_trace_signalled && __atomic_exchange_n(&_trace_signalled, 0, __ATOMIC_ACQ_REL)) {
+            webcam_trace_save(_trace_path);
+        }
+#endif
+    }
+
+    _perf_close(w);
+}
+
+/**
+ * Tells the webcam to go into streaming mode, or to
+ * stop streaming.
+ * When going into streaming mode, it also creates
+ * a thread running the webcam_streaming function.
+ * When exiting the streaming mode, it sets the streaming
+ * bit to false, and waits for the thread to finish.
+ */
+void webcam_stream(struct webcam *w, bool flag)
+{
+    uint8_t i;
+
+    struct v4l2_buffer buf;
+    enum v4l2_buf_type type;
+
+    // A replay has no device to start or stop, only the thread
+    if (w->replay.archive != NULL) {
+        if (flag) {
+            w->replay.next = 0;
+            w->replay.start = 0;
+            w->replay.offset = 0;
+            w->demanded = _now();
+            w->streaming = true;
+            pthread_create(&w->thread, NULL, webcam_streaming, (void *)w);
+        } else {
+            w->streaming = false;
+            pthread_join(w->thread, NULL);
+            w->standby = false;
+        }
+        return;
+    }
+
+    TRACE_START(t_stream);
+
+    if (flag) {
         // Clear buffers
         for (i = 0; i < w->nbuffers; i++) {
             CLEAR(buf);
@@ -454,95 +2854,6714 @@ void webcam_stream(struct webcam *w, bool flag)
             buf.memory = V4L2_MEMORY_MMAP;
             buf.index = i;
 
-            if (-1 == _ioctl(w->fd, VIDIOC_QBUF, &buf)) {
-                fprintf(stderr, "Error clearing buffers on %s\n", w->name);
-                return;
+            if (-1 == _ioctl(w->fd, VIDIOC_QBUF, &buf)) {
+                fprintf(stderr, "Error clearing buffers on %s\n", w->name);
+                return;
+            }
+        }
+
+        // Turn on streaming
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (-1 == _ioctl(w->fd, VIDIOC_STREAMON, &type)) {
+            fprintf(stderr, "Could not turn on streaming on %s\n", w->name);
+            return;
+        }
+
+        // Set streaming to true and start thread
+        w->demanded = _now();
+        w->streaming = true;
+        pthread_create(&w->thread, NULL, webcam_streaming, (void *)w);
+        TRACE_END("stream_on", w->index, t_stream, 0);
+    } else {
+        // Set streaming to false and wait for thread to finish
+        w->streaming = false;
+        pthread_join(w->thread, NULL);
+        w->standby = false;
+        w->kept = false;
+
+        // Turn off streaming
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (-1 == _ioctl(w->fd, VIDIOC_STREAMOFF, &type)) {
+            fprintf(stderr, "Could not turn streaming off on %s\n", w->name);
+            return;
+        }
+        TRACE_END("stream_off", w->index, t_stream, w->sequence);
+    }
+}
+
+/**
+ * Private function turning a timeout in milliseconds into a deadline
+ * on the given clock
+ */
+static void _deadline(struct timespec *deadline, clockid_t clock, uint32_t timeout)
+{
+    clock_gettime(clock, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000l;
+    if (deadline->tv_nsec >= 1000000000l) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000l;
+    }
+}
+
+/**
+ * Private function converting the frame kept dequeued on standby, for a
+ * grab resuming the webcam, and queueing it back. Frames are converted
+ * like convertToRGB(), so not when the webcam makes a pyramid or an
+ * integral image along with them. Called with mtx_frame held.
+ */
+static bool _convert_kept(webcam_t *w)
+{
+    struct v4l2_buffer *buf = &w->kept_buf;
+    buffer_t *raw;
+
+    if (!w->kept || w->pixelformat != V4L2_PIX_FMT_YUYV || w->integral_on ||
+        __atomic_load_n(&w->pyramid_levels, __ATOMIC_ACQUIRE) != 0) {
+        return false;
+    }
+
+    raw = &w->buffers[buf->index];
+    if (-1 == _frame_fit(w, raw)) return false;
+
+    STAGE_START(t_convert);
+    convertToRGB(*raw, &w->frame);
+    STAGE_END(w, WEBCAM_STAGE_CONVERT, t_convert, buf->sequence);
+    w->sequence = buf->sequence;
+    w->frame_sharpness = __atomic_load_n(&w->sharpness_on, __ATOMIC_ACQUIRE) ? _sharpness_measure(w, raw, buf) : -1;
+    w->published++;
+    w->processed++;
+    pthread_cond_broadcast(&w->fresh);
+
+    _requeue(w, buf);
+    __atomic_store_n(&w->kept, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->standby, false, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/**
+ * Private function noting that the webcam's frames are wanted. When it
+ * was on standby and wait is set, converts the frame skipped last, or
+ * else waits up to a second for the next frame to be processed:
+ * converted again, or found unchanged or shed. Called with mtx_frame
+ * held.
+ */
+static void _demand(webcam_t *w, bool wait)
+{
+    struct timespec deadline;
+    uint64_t processed = w->processed;
+    int rc = 0;
+
+    __atomic_store_n(&w->demanded, _now(), __ATOMIC_RELEASE);
+    if (!wait || !__atomic_load_n(&w->standby, __ATOMIC_ACQUIRE)) return;
+
+    __atomic_fetch_add(&w->stats.resumed, 1, __ATOMIC_RELAXED);
+    if (_convert_kept(w)) return;
+
+    __atomic_fetch_add(&w->resuming, 1, __ATOMIC_RELEASE);
+    _deadline(&deadline, CLOCK_MONOTONIC, 1000);
+    while (w->processed == processed && w->streaming && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&w->fresh, &w->mtx_frame, &deadline);
+    }
+    __atomic_fetch_sub(&w->resuming, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Private function copying the frame, called with mtx_frame held
+ */
+static void _grab(webcam_t *w, buffer_t *frame)
+{
+    // Only copy frame if there is something in the webcam's frame buffer
+    if (w->frame.length > 0) {
+        // Initialize frame
+        if ((*frame).start == NULL) {
+            (*frame).start = calloc(w->frame.length, sizeof(char));
+            (*frame).length = w->frame.length;
+        }
+
+        STAGE_START(t_grab);
+        memcpy((*frame).start, w->frame.start, w->frame.length);
+        STAGE_END(w, WEBCAM_STAGE_GRAB, t_grab, w->sequence);
+        PROBE(grab, w->index, w->sequence, 0, w->frame.length);
+    }
+}
+
+void webcam_grab(webcam_t *w, buffer_t *frame)
+{
+    // Locks the frame mutex so the grabber can copy
+    // the frame in its own return buffer.
+    pthread_mutex_lock(&w->mtx_frame);
+    _demand(w, true);
+    _grab(w, frame);
+    pthread_mutex_unlock(&w->mtx_frame);
+}
+
+/**
+ * Waits up to timeout milliseconds for a frame newer than the one
+ * *published counts up to, and copies it like webcam_grab() does
+ *
+ * *published is updated to the copied frame; start from 0. Duplicate
+ * frames do not count, see webcam_dedup(). False on timeout.
+ */
+bool webcam_wait_frame(webcam_t *w, buffer_t *frame, uint64_t *published, uint32_t timeout)
+{
+    struct timespec deadline;
+    bool fresh;
+    int rc = 0;
+
+    _deadline(&deadline, CLOCK_MONOTONIC, timeout);
+
+    pthread_mutex_lock(&w->mtx_frame);
+    _demand(w, false);
+    while (w->published == *published && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&w->fresh, &w->mtx_frame, &deadline);
+    }
+    fresh = w->published != *published;
+    if (fresh) {
+        _grab(w, frame);
+        *published = w->published;
+    }
+    pthread_mutex_unlock(&w->mtx_frame);
+
+    return fresh;
+}
+
+/**
+ * Puts the streaming webcam on standby once it has had no sinks,
+ * outputs or motion detection and was not grabbed from for idle
+ * milliseconds, 0 for never. On standby it converts only every
+ * every-th frame, or none for 0. The next grab resumes it, converting
+ * the frame skipped last, which stays dequeued until the next one. With
+ * a pyramid or an integral image it waits instead for the next frame to
+ * be converted, found unchanged or shed: up to a frame period plus a
+ * conversion.
+ */
+void webcam_standby(webcam_t *w, uint32_t idle, uint8_t every)
+{
+    pthread_mutex_lock(&w->mtx_frame);
+    __atomic_store_n(&w->demanded, _now(), __ATOMIC_RELEASE);
+    w->standby_every = every;
+    __atomic_store_n(&w->standby_idle, (uint64_t)idle * 1000000, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->mtx_frame);
+}
+
+/**
+ * Gives the webcam a priority, higher for more important webcams, and a
+ * latency budget in microseconds, 0 for none. Webcams missing their
+ * budget degrade those of a lower priority; with no budgets left, all
+ * webcams are restored.
+ */
+void webcam_budget(webcam_t *w, uint8_t priority, uint32_t budget)
+{
+    bool budgeted = budget != 0;
+    uint8_t i;
+
+    pthread_mutex_lock(&_mtx_w);
+    w->priority = priority;
+    __atomic_store_n(&w->budget, (uint64_t)budget * 1000, __ATOMIC_RELEASE);
+    for (i = 0; i < 16; i++) budgeted |= _w[i] != NULL && __atomic_load_n(&_w[i]->budget, __ATOMIC_ACQUIRE) != 0;
+    for (i = 0; i < 16 && !budgeted; i++) {
+        if (_w[i] != NULL) __atomic_store_n(&_w[i]->degradation, WEBCAM_DEGRADE_NONE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_mtx_w);
+}
+
+/**
+ * Makes the webcam measure the sharpness of every frame, before it is
+ * converted; sinks find it in the frame
+ */
+void webcam_sharpness(webcam_t *w, bool on)
+{
+    __atomic_store_n(&w->sharpness_on, on, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the sharpness of the frame webcam_grab() would copy, so
+ * blurry frames need not be copied; negative when not measured
+ */
+float webcam_grab_sharpness(webcam_t *w)
+{
+    float sharpness;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    _demand(w, true);
+    sharpness = w->frame_sharpness;
+    pthread_mutex_unlock(&w->mtx_frame);
+
+    return sharpness;
+}
+
+/**
+ * Makes the webcam skip the conversion of frames that did not change,
+ * by no more than tolerance per pixel, since the last converted one;
+ * these reach the sinks marked as duplicates. See webcam_stats() for
+ * how many were skipped.
+ */
+void webcam_dedup(webcam_t *w, bool on, uint8_t tolerance)
+{
+    __atomic_store_n(&w->dedup_tolerance, tolerance, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->dedup, on, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds a sink to the webcam, which from the next frame on gets
+ * every captured frame
+ */
+void webcam_sink_add(webcam_t *w, webcam_sink_t *s)
+{
+    pthread_mutex_lock(&w->mtx_sinks);
+    s->next = w->sinks;
+    w->sinks = s;
+    pthread_mutex_unlock(&w->mtx_sinks);
+}
+
+/**
+ * Removes a sink from the webcam
+ * Once this returns, the sink is no longer called.
+ */
+void webcam_sink_remove(webcam_t *w, webcam_sink_t *s)
+{
+    webcam_sink_t **p;
+
+    pthread_mutex_lock(&w->mtx_sinks);
+    for (p = &w->sinks; *p != NULL; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->mtx_sinks);
+}
+
+/**
+ * Private function adding an output to the webcam, either with frames
+ * of its own or as a tile of a mosaic
+ */
+static webcam_output_t *_output_add(webcam_t *w, uint32_t format, uint16_t width, uint16_t height,
+                                    uint16_t x, uint16_t y, uint16_t roi_width, uint16_t roi_height,
+                                    webcam_mosaic_t *mosaic, uint8_t tile)
+{
+    webcam_output_t *o;
+    size_t length;
+
+    if (format == V4L2_PIX_FMT_YUYV) width &= ~1;
+    if ((format != V4L2_PIX_FMT_YUYV && format != V4L2_PIX_FMT_RGB24) || width == 0 || height == 0) {
+        fprintf(stderr, "Unsupported output %.4s at %ux%u\n", (char *)&format, width, height);
+        return NULL;
+    }
+
+    o = calloc(1, sizeof(webcam_output_t));
+    if (o == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    o->webcam = w;
+    o->format = format;
+    o->width = width;
+    o->height = height;
+    o->x = x;
+    o->y = y;
+    o->roi_width = roi_width;
+    o->roi_height = roi_height;
+    o->mosaic = mosaic;
+    o->tile = tile;
+
+    // Tiles are written into the mosaic
+    length = mosaic != NULL ? 0 : (size_t)width * height * (format == V4L2_PIX_FMT_YUYV ? 2 : 3);
+    o->frames[0].start = calloc(length, sizeof(char));
+    o->frames[1].start = calloc(length, sizeof(char));
+    if (length > 0 && (o->frames[0].start == NULL || o->frames[1].start == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        free(o->frames[0].start);
+        free(o->frames[1].start);
+        free(o);
+        return NULL;
+    }
+    o->frames[0].length = o->frames[1].length = length;
+    pthread_mutex_init(&o->mtx_frame, NULL);
+
+    pthread_mutex_lock(&w->mtx_outputs);
+    o->next = w->outputs;
+    w->outputs = o;
+    pthread_mutex_unlock(&w->mtx_outputs);
+
+    return o;
+}
+
+/**
+ * Adds an output of the given format and size to the webcam, scaled
+ * from the region at x, y of roi_width by roi_height, where 0 stands
+ * for the rest of the frame. YUYV outputs have an even width.
+ *
+ * The webcam's frame is then made in the same pass as its outputs, and
+ * is a copy of a full-size RGB output of the whole frame if there is one.
+ */
+webcam_output_t *webcam_output_add(webcam_t *w, uint32_t format, uint16_t width, uint16_t height,
+                                   uint16_t x, uint16_t y, uint16_t roi_width, uint16_t roi_height)
+{
+    return _output_add(w, format, width, height, x, y, roi_width, roi_height, NULL, 0);
+}
+
+/**
+ * Removes an output from the webcam and frees it
+ */
+void webcam_output_remove(webcam_t *w, webcam_output_t *o)
+{
+    webcam_output_t **p;
+
+    pthread_mutex_lock(&w->mtx_outputs);
+    for (p = &w->outputs; *p != NULL; p = &(*p)->next) {
+        if (*p == o) {
+            *p = o->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->mtx_outputs);
+
+    // The tile keeps its last frame, but no longer has a webcam
+    if (o->mosaic != NULL) {
+        pthread_mutex_lock(&o->mosaic->mtx);
+        if (o->mosaic->outputs[o->tile] == o) o->mosaic->outputs[o->tile] = NULL;
+        pthread_mutex_unlock(&o->mosaic->mtx);
+    }
+
+    pthread_mutex_destroy(&o->mtx_frame);
+    free(o->frames[0].start);
+    free(o->frames[1].start);
+    free(o->xmap);
+    free(o->ymap);
+    free(o->xscale);
+    free(o->cscale);
+    free(o->sums);
+    free(o);
+}
+
+/**
+ * Copies the last completed frame of an output, like webcam_grab()
+ */
+void webcam_output_grab(webcam_output_t *o, buffer_t *frame)
+{
+    pthread_mutex_lock(&o->mtx_frame);
+
+    if (frame->start == NULL) {
+        frame->start = calloc(o->frames[o->front].length, sizeof(char));
+        frame->length = o->frames[o->front].length;
+    }
+    memcpy(frame->start, o->frames[o->front].start, o->frames[o->front].length);
+
+    pthread_mutex_unlock(&o->mtx_frame);
+}
+
+/**
+ * Adds a sink to an output, which from the next frame on gets every
+ * frame of the output
+ */
+void webcam_output_sink_add(webcam_output_t *o, webcam_sink_t *s)
+{
+    pthread_mutex_lock(&o->webcam->mtx_outputs);
+    s->next = o->sinks;
+    o->sinks = s;
+    pthread_mutex_unlock(&o->webcam->mtx_outputs);
+}
+
+/**
+ * Removes a sink from an output
+ * Once this returns, the sink is no longer called.
+ */
+void webcam_output_sink_remove(webcam_output_t *o, webcam_sink_t *s)
+{
+    webcam_sink_t **p;
+
+    pthread_mutex_lock(&o->webcam->mtx_outputs);
+    for (p = &o->sinks; *p != NULL; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&o->webcam->mtx_outputs);
+}
+
+/**
+ * The loop function for the mosaic thread
+ *
+ * At every tick, waits for the tiles being written, carries over the
+ * tiles that got no new frame, swaps the buffers and hands the new
+ * front buffer to the sinks.
+ */
+static void *mosaic_publishing(void *ptr)
+{
+    webcam_mosaic_t *m = (webcam_mosaic_t *)ptr;
+    webcam_mosaic_tile_t *back, *front;
+    struct timespec ts;
+    webcam_sink_t *s;
+    webcam_frame_t f;
+    uint64_t due = _now(), now, last = 0;
+    size_t stride = (size_t)m->width * 3, offset;
+    uint16_t y;
+    uint8_t t, b;
+
+    while (__atomic_load_n(&m->running, __ATOMIC_ACQUIRE)) {
+        due += 1000000000ull / m->fps;
+        ts.tv_sec = due / 1000000000ull;
+        ts.tv_nsec = due % 1000000000ull;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+
+        pthread_mutex_lock(&m->mtx);
+        m->swapping = true;
+        while (m->writing > 0) pthread_cond_wait(&m->idle, &m->mtx);
+
+        b = m->front ^ 1;
+        for (t = 0; t < m->columns * m->rows; t++) {
+            back = &m->written[b][t];
+            front = &m->written[m->front][t];
+            if (back->arrival >= front->arrival) continue;
+
+            offset = ((size_t)(t / m->columns) * m->tile_height * m->width + (size_t)(t % m->columns) * m->tile_width) * 3;
+            for (y = 0; y < m->tile_height; y++, offset += stride) {
+                memcpy(m->buffers[b].start + offset, m->buffers[m->front].start + offset, (size_t)m->tile_width * 3);
+            }
+            *back = *front;
+        }
+
+        now = _now();
+        pthread_mutex_lock(&m->mtx_front);
+        m->front = b;
+        for (t = 0; t < m->columns * m->rows; t++) {
+            m->tiles[t] = m->written[b][t];
+            m->tiles[t].live = m->outputs[t] != NULL;
+            m->tiles[t].fresh = m->tiles[t].arrival > last;
+            m->tiles[t].age = m->tiles[t].arrival > 0 ? now - m->tiles[t].arrival : 0;
+        }
+        m->published++;
+        pthread_mutex_unlock(&m->mtx_front);
+
+        m->swapping = false;
+        pthread_cond_broadcast(&m->idle);
+        pthread_mutex_unlock(&m->mtx);
+        last = now;
+
+        // Only this thread swaps, so the front buffer holds still for the sinks
+        CLEAR(f);
+        f.rgb = m->buffers[b];
+        f.sequence = m->published;
+        f.timestamp = now;
+        f.width = m->width;
+        f.height = m->height;
+        pthread_mutex_lock(&m->mtx_sinks);
+        for (s = m->sinks; s != NULL; s = s->next) s->push(s, &f);
+        pthread_mutex_unlock(&m->mtx_sinks);
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens a mosaic of columns by rows tiles of tile_width by tile_height,
+ * published fps times a second
+ */
+webcam_mosaic_t *webcam_mosaic_open(uint8_t columns, uint8_t rows, uint16_t tile_width, uint16_t tile_height,
+                                    uint32_t fps)
+{
+    webcam_mosaic_t *m;
+    size_t length = (size_t)columns * tile_width * rows * tile_height * 3;
+
+    if (columns * rows == 0 || columns * rows > WEBCAM_MOSAIC_TILES || fps == 0 ||
+        (uint32_t)columns * tile_width > UINT16_MAX || (uint32_t)rows * tile_height > UINT16_MAX) {
+        fprintf(stderr, "Unsupported mosaic of %ux%u tiles of %ux%u at %u fps\n",
+                columns, rows, tile_width, tile_height, fps);
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(webcam_mosaic_t));
+    if (m == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    m->columns = columns;
+    m->rows = rows;
+    m->tile_width = tile_width;
+    m->tile_height = tile_height;
+    m->width = columns * tile_width;
+    m->height = rows * tile_height;
+    m->fps = fps;
+
+    m->buffers[0].start = calloc(length, sizeof(char));
+    m->buffers[1].start = calloc(length, sizeof(char));
+    if (m->buffers[0].start == NULL || m->buffers[1].start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        free(m->buffers[0].start);
+        free(m->buffers[1].start);
+        free(m);
+        return NULL;
+    }
+    m->buffers[0].length = m->buffers[1].length = length;
+
+    pthread_mutex_init(&m->mtx, NULL);
+    pthread_cond_init(&m->idle, NULL);
+    pthread_mutex_init(&m->mtx_front, NULL);
+    pthread_mutex_init(&m->mtx_sinks, NULL);
+
+    m->running = true;
+    pthread_create(&m->thread, NULL, mosaic_publishing, (void *)m);
+
+    return m;
+}
+
+/**
+ * Stops publishing, removes the tiles from their webcams, and frees
+ * the mosaic
+ */
+void webcam_mosaic_close(webcam_mosaic_t *m)
+{
+    webcam_output_t *o;
+    uint8_t t;
+
+    __atomic_store_n(&m->running, false, __ATOMIC_RELEASE);
+    pthread_join(m->thread, NULL);
+
+    for (t = 0; t < WEBCAM_MOSAIC_TILES; t++) {
+        pthread_mutex_lock(&m->mtx);
+        o = m->outputs[t];
+        pthread_mutex_unlock(&m->mtx);
+        if (o != NULL) webcam_output_remove(o->webcam, o);
+    }
+
+    pthread_mutex_destroy(&m->mtx);
+    pthread_cond_destroy(&m->idle);
+    pthread_mutex_destroy(&m->mtx_front);
+    pthread_mutex_destroy(&m->mtx_sinks);
+    free(m->buffers[0].start);
+    free(m->buffers[1].start);
+    free(m);
+}
+
+/**
+ * Puts the webcam in the tile at column, row of the mosaic, scaled down
+ * from its whole frame; remove it with webcam_output_remove()
+ */
+webcam_output_t *webcam_mosaic_add(webcam_mosaic_t *m, webcam_t *w, uint8_t column, uint8_t row)
+{
+    webcam_output_t *o;
+    uint8_t tile = row * m->columns + column;
+
+    if (column >= m->columns || row >= m->rows) {
+        fprintf(stderr, "No tile at %u,%u in a mosaic of %ux%u\n", column, row, m->columns, m->rows);
+        return NULL;
+    }
+
+    // Not under mtx, as the capture thread takes it while holding mtx_outputs
+    o = _output_add(w, V4L2_PIX_FMT_RGB24, m->tile_width, m->tile_height, 0, 0, 0, 0, m, tile);
+    if (o == NULL) return NULL;
+
+    pthread_mutex_lock(&m->mtx);
+    if (m->outputs[tile] == NULL) {
+        m->outputs[tile] = o;
+        pthread_mutex_unlock(&m->mtx);
+        return o;
+    }
+    pthread_mutex_unlock(&m->mtx);
+
+    fprintf(stderr, "Tile %u,%u already has a webcam\n", column, row);
+    webcam_output_remove(w, o);
+
+    return NULL;
+}
+
+/**
+ * Copies the last published mosaic, like webcam_grab() does the frame,
+ * and the freshness of its tiles into tiles unless NULL; false before
+ * the first tick
+ */
+bool webcam_mosaic_grab(webcam_mosaic_t *m, buffer_t *frame, webcam_mosaic_tile_t *tiles)
+{
+    pthread_mutex_lock(&m->mtx_front);
+    if (m->published == 0) {
+        pthread_mutex_unlock(&m->mtx_front);
+        return false;
+    }
+
+    if (frame->start == NULL) {
+        frame->start = calloc(m->buffers[m->front].length, sizeof(char));
+        frame->length = m->buffers[m->front].length;
+    }
+    if (frame->start != NULL) memcpy(frame->start, m->buffers[m->front].start, frame->length);
+    if (tiles != NULL) memcpy(tiles, m->tiles, (size_t)m->columns * m->rows * sizeof(webcam_mosaic_tile_t));
+    pthread_mutex_unlock(&m->mtx_front);
+
+    return frame->start != NULL;
+}
+
+/**
+ * Adds a sink to the mosaic, which from the next tick on gets every
+ * published mosaic
+ */
+void webcam_mosaic_sink_add(webcam_mosaic_t *m, webcam_sink_t *s)
+{
+    pthread_mutex_lock(&m->mtx_sinks);
+    s->next = m->sinks;
+    m->sinks = s;
+    pthread_mutex_unlock(&m->mtx_sinks);
+}
+
+/**
+ * Removes a sink from the mosaic
+ * Once this returns, the sink is no longer called.
+ */
+void webcam_mosaic_sink_remove(webcam_mosaic_t *m, webcam_sink_t *s)
+{
+    webcam_sink_t **p;
+
+    pthread_mutex_lock(&m->mtx_sinks);
+    for (p = &m->sinks; *p != NULL; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m->mtx_sinks);
+}
+
+/**
+ * Makes the webcam build an image pyramid of the given number of levels
+ * for every frame, with RGB images as well if rgb is set; 0 levels for
+ * none. Takes effect from the next frame.
+ */
+void webcam_pyramid(webcam_t *w, uint8_t levels, bool rgb)
+{
+    __atomic_store_n(&w->pyramid_rgb, rgb, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->pyramid_levels, levels, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the last completed pyramid, like webcam_grab() does the frame
+ *
+ * The data buffer is allocated when NULL, and reallocated when the
+ * layout changed; false when the webcam makes no pyramid (yet).
+ */
+bool webcam_grab_pyramid(webcam_t *w, webcam_pyramid_t *pyramid)
+{
+    buffer_t data = pyramid->data;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    _demand(w, true);
+    if (w->pyramid.levels == 0) {
+        pthread_mutex_unlock(&w->mtx_frame);
+        return false;
+    }
+
+    if (data.start == NULL || data.length != w->pyramid.data.length) {
+        free(data.start);
+        data.length = w->pyramid.data.length;
+        data.start = malloc(data.length);
+    }
+
+    *pyramid = w->pyramid;
+    pyramid->data = data;
+    if (data.start != NULL) memcpy(data.start, w->pyramid.data.start, data.length);
+    pthread_mutex_unlock(&w->mtx_frame);
+
+    return data.start != NULL;
+}
+
+/**
+ * Makes the webcam compute the integral image of every frame's luma
+ * during its RGB conversion, which is then spread over the capture
+ * thread and a worker per other CPU
+ */
+void webcam_integral(webcam_t *w, bool on)
+{
+    long cpus;
+    uint8_t i;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    if (on && w->workers == NULL) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        w->nworkers = cpus <= 1 ? 0 : cpus > 8 ? 7 : cpus - 1;
+        w->workers = calloc(w->nworkers + 1, sizeof(pthread_t));
+        w->working = true;
+        for (i = 0; w->workers != NULL && i < w->nworkers; i++) {
+            pthread_create(&w->workers[i], NULL, webcam_converting, (void *)w);
+        }
+    }
+
+    // The capture thread frees the table, as the sinks may be using it
+    w->integral_on = on;
+    pthread_mutex_unlock(&w->mtx_frame);
+}
+
+/**
+ * Copies the integral image of the last frame, like webcam_grab() does
+ * the frame
+ *
+ * The table is allocated when NULL, and reallocated when the frame size
+ * changed; false when the webcam makes no integral image (yet).
+ */
+bool webcam_grab_integral(webcam_t *w, webcam_integral_t *integral)
+{
+    buffer_t table = integral->table;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    _demand(w, true);
+    if (w->integral.table.start == NULL) {
+        pthread_mutex_unlock(&w->mtx_frame);
+        return false;
+    }
+
+    if (table.start == NULL || table.length != w->integral.table.length) {
+        free(table.start);
+        table.length = w->integral.table.length;
+        table.start = malloc(table.length);
+    }
+
+    *integral = w->integral;
+    integral->table = table;
+    if (table.start != NULL) memcpy(table.start, w->integral.table.start, table.length);
+    pthread_mutex_unlock(&w->mtx_frame);
+
+    return table.start != NULL;
+}
+
+/**
+ * Opens a conversion scheduler with the given number of workers, 0 for
+ * one per CPU, to be shared by the webcams added to it
+ */
+webcam_scheduler_t *webcam_scheduler_open(uint8_t workers)
+{
+    webcam_scheduler_t *s;
+    long cpus;
+    uint8_t i;
+
+    if (workers == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus < 1 ? 1 : cpus > 64 ? 64 : cpus;
+    }
+
+    s = calloc(1, sizeof(webcam_scheduler_t));
+    if (s == NULL || NULL == (s->workers = calloc(workers, sizeof(pthread_t)))) {
+        fprintf(stderr, "Out of memory\n");
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->mtx, NULL);
+    pthread_cond_init(&s->work, NULL);
+    s->running = true;
+
+    s->nworkers = workers;
+    for (i = 0; i < s->nworkers; i++) {
+        pthread_create(&s->workers[i], NULL, scheduler_working, (void *)s);
+    }
+
+    return s;
+}
+
+/**
+ * Takes all webcams off the scheduler, stops its workers and frees it
+ */
+void webcam_scheduler_close(webcam_scheduler_t *s)
+{
+    uint8_t i;
+
+    while (s->count > 0) webcam_scheduler_remove(s, s->members[0]);
+
+    pthread_mutex_lock(&s->mtx);
+    s->running = false;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->mtx);
+    for (i = 0; i < s->nworkers; i++) pthread_join(s->workers[i], NULL);
+
+    pthread_cond_destroy(&s->work);
+    pthread_mutex_destroy(&s->mtx);
+    free(s->workers);
+    free(s);
+}
+
+/**
+ * Has the scheduler's workers share in the webcam's conversions from
+ * its next frame. Frames are due deadline microseconds after their
+ * conversion starts, and those of earlier deadlines are served first;
+ * adding it again only changes the hint. False when the webcam is on
+ * another scheduler or this one is full.
+ */
+bool webcam_scheduler_add(webcam_scheduler_t *s, webcam_t *w, uint32_t deadline)
+{
+    bool added = true;
+
+    pthread_mutex_lock(&w->mtx_frame);
+    if (w->scheduler == NULL) {
+        pthread_mutex_lock(&s->mtx);
+        added = s->count < WEBCAM_SCHEDULER_MAX;
+        if (added) s->members[s->count++] = w;
+        pthread_mutex_unlock(&s->mtx);
+        if (added) w->scheduler = s;
+    } else {
+        added = w->scheduler == s;
+    }
+    if (added) w->deadline = (uint64_t)deadline * 1000;
+    pthread_mutex_unlock(&w->mtx_frame);
+
+    if (!added) fprintf(stderr, "Webcam %s cannot be scheduled\n", w->name);
+
+    return added;
+}
+
+/**
+ * Takes the webcam off the scheduler, after the frame it is converting
+ */
+void webcam_scheduler_remove(webcam_scheduler_t *s, webcam_t *w)
+{
+    uint8_t i;
+
+    // No worker claims its blocks once it has left the members
+    pthread_mutex_lock(&w->mtx_frame);
+    pthread_mutex_lock(&s->mtx);
+    for (i = 0; i < s->count; i++) {
+        if (s->members[i] == w) {
+            s->members[i] = s->members[--s->count];
+            s->next = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->mtx);
+    if (w->scheduler == s) w->scheduler = NULL;
+    pthread_mutex_unlock(&w->mtx_frame);
+}
+
+/**
+ * Makes the webcam detect motion in every frame, in blocks whose mean
+ * luma differs from the background by more than threshold; 0 for no
+ * detection. Takes effect from the next frame.
+ */
+void webcam_motion(webcam_t *w, uint8_t threshold)
+{
+    __atomic_store_n(&w->motion_threshold, threshold, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the motion detected in the last frame; false when the webcam
+ * detects no motion (yet)
+ */
+bool webcam_grab_motion(webcam_t *w, webcam_motion_t *motion)
+{
+    bool ok;
+
+    pthread_mutex_lock(&w->mtx_motion);
+    ok = w->motion.columns > 0;
+    if (ok) *motion = w->motion;
+    pthread_mutex_unlock(&w->mtx_motion);
+
+    return ok;
+}
+
+/**
+ * Waits up to timeout milliseconds for a frame in which something moves,
+ * and copies its motion; false on timeout
+ */
+bool webcam_wait_motion(webcam_t *w, webcam_motion_t *motion, uint32_t timeout)
+{
+    struct timespec deadline;
+    uint64_t events;
+    int rc = 0;
+
+    _deadline(&deadline, CLOCK_MONOTONIC, timeout);
+
+    pthread_mutex_lock(&w->mtx_motion);
+    events = w->motion_events;
+    while (events == w->motion_events && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&w->moved, &w->mtx_motion, &deadline);
+    }
+    if (events != w->motion_events) *motion = w->motion;
+    pthread_mutex_unlock(&w->mtx_motion);
+
+    return events != w->motion_events;
+}
+
+/**
+ * Private function rounding a length up to a whole number of pages,
+ * as required for O_DIRECT writes
+ */
+static size_t _page_align(size_t length)
+{
+    return (length + WEBCAM_ARCHIVE_PAGE - 1) & ~(size_t)(WEBCAM_ARCHIVE_PAGE - 1);
+}
+
+/**
+ * Private function writing the whole buffer, returns the bytes written
+ */
+static size_t _write_all(int fd, const uint8_t *start, size_t length)
+{
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < length; done += n) {
+        n = write(fd, start + done, length - done);
+        if (n == -1 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            if (errno != EPIPE) fprintf(stderr, "Error while recording: %d, %s\n", errno, strerror(errno));
+            break;
+        }
+    }
+
+    return done;
+}
+
+/**
+ * The loop function for the recorder thread
+ *
+ * Writes the filled slots in order, until the recorder is closed and
+ * everything still in flight has been written. Every slot holds the
+ * frame header page followed by the payload, so a frame takes a
+ * single write. The index is kept here, off the capture thread.
+ * With a codec, the encoded copy of the slot is written once a worker
+ * has finished it.
+ */
+static void *recorder_writing(void *ptr)
+{
+    webcam_recorder_t *r = (webcam_recorder_t *)ptr;
+    webcam_archive_entry_t *index;
+    webcam_archive_frame_t *header;
+    buffer_t *slot;
+    size_t length, done;
+    uint8_t n;
+
+    for (;;) {
+        if (r->codec == WEBCAM_CODEC_NONE) {
+            while (-1 == sem_wait(&r->pending) && EINTR == errno);
+        } else {
+            while (-1 == sem_wait(&r->done) && EINTR == errno);
+        }
+
+        // Workers may finish out of order, so write whatever is ready in order
+        for (;;) {
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) break;
+
+            n = r->tail % r->nslots;
+            if (r->codec != WEBCAM_CODEC_NONE) {
+                if (!__atomic_load_n(&r->ready[n], __ATOMIC_ACQUIRE)) break;
+                r->ready[n] = 0;
+                slot = &r->encoded[n];
+            } else {
+                slot = &r->slots[n];
+            }
+
+            header = (webcam_archive_frame_t *)slot->start;
+            length = WEBCAM_ARCHIVE_PAGE + _page_align(slot->length);
+
+            // Zero the padding, so records are page-sized on disk
+            memset(slot->start + WEBCAM_ARCHIVE_PAGE + slot->length, 0,
+                   length - WEBCAM_ARCHIVE_PAGE - slot->length);
+
+            // Grow the index by doubling
+            if ((r->count & (r->count - 1)) == 0) {
+                index = realloc(r->index, (r->count ? r->count * 2 : 256) * sizeof(webcam_archive_entry_t));
+                if (index != NULL) r->index = index;
+            }
+
+            // A partial write still moves the file offset, but gets no index entry
+            done = _write_all(r->fd, slot->start, length);
+            if (done == length && r->index != NULL) {
+                r->index[r->count].offset = r->offset;
+                r->index[r->count].timestamp = header->timestamp;
+                r->count++;
+            }
+            r->offset += done;
+
+            __atomic_fetch_add(&r->bytes, done, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&r->frames, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+
+            if (r->codec == WEBCAM_CODEC_NONE) break;
+        }
+
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail &&
+            !__atomic_load_n(&r->running, __ATOMIC_ACQUIRE)) break;
+    }
+
+    return NULL;
+}
+
+/**
+ * The loop function for the recorder's encoding workers
+ *
+ * Every worker claims the oldest filled slot that nobody is encoding
+ * yet, and encodes it into the slot's encoded buffer.
+ */
+static void *recorder_encoding(void *ptr)
+{
+    webcam_recorder_t *r = (webcam_recorder_t *)ptr;
+    webcam_archive_frame_t *header;
+    buffer_t *slot, *encoded;
+    uint64_t claim;
+    uint8_t *scratch = NULL;
+    uint32_t stride = 0;
+    bool claimed;
+
+    for (;;) {
+        while (-1 == sem_wait(&r->pending) && EINTR == errno);
+
+        claim = __atomic_load_n(&r->claimed, __ATOMIC_ACQUIRE);
+        do {
+            claimed = claim != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        } while (claimed && !__atomic_compare_exchange_n(&r->claimed, &claim, claim + 1, true,
+                                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+        if (!claimed) {
+            if (!__atomic_load_n(&r->running, __ATOMIC_ACQUIRE)) break;
+            continue;
+        }
+
+        slot = &r->slots[claim % r->nslots];
+        encoded = &r->encoded[claim % r->nslots];
+        header = (webcam_archive_frame_t *)encoded->start;
+        memcpy(header, slot->start, sizeof(webcam_archive_frame_t));
+
+        // Rows are encoded one at a time through the scratch row
+        if (header->stride > stride) {
+            free(scratch);
+            stride = header->stride;
+            scratch = malloc(stride + 16);
+        }
+
+        // Frames that would not get smaller are stored as they are
+        encoded->length = slot->length;
+        if (scratch != NULL && header->stride > 0 &&
+            _delta_bound(slot->length, header->stride) <= r->encoded_capacity) {
+            encoded->length = _delta_encode(slot->start + WEBCAM_ARCHIVE_PAGE, slot->length,
+                                            header->stride, header->format,
+                                            encoded->start + WEBCAM_ARCHIVE_PAGE, scratch);
+        }
+        if (encoded->length < slot->length) {
+            header->codec = r->codec;
+        } else {
+            memcpy(encoded->start + WEBCAM_ARCHIVE_PAGE, slot->start + WEBCAM_ARCHIVE_PAGE, slot->length);
+            encoded->length = slot->length;
+            header->codec = WEBCAM_CODEC_NONE;
+        }
+        header->stored = encoded->length;
+
+        __atomic_store_n(&r->ready[claim % r->nslots], 1, __ATOMIC_RELEASE);
+        sem_post(&r->done);
+    }
+
+    free(scratch);
+
+    return NULL;
+}
+
+/**
+ * Private function copying a frame into a slot, after its header page
+ */
+static void _recorder_fill(webcam_recorder_t *r, buffer_t *slot, const webcam_frame_t *f, const buffer_t *src)
+{
+    webcam_archive_frame_t *header = (webcam_archive_frame_t *)slot->start;
+
+    header->magic = WEBCAM_ARCHIVE_FRAME;
+    header->format = r->source == WEBCAM_RECORD_RAW ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_RGB24;
+    header->sequence = f->sequence;
+    header->timestamp = f->timestamp;
+    header->length = src->length;
+    header->width = f->width;
+    header->height = f->height;
+    header->stride = f->width * (r->source == WEBCAM_RECORD_RAW ? 2 : 3);
+    header->codec = WEBCAM_CODEC_NONE;
+    header->stored = src->length;
+
+    memcpy(slot->start + WEBCAM_ARCHIVE_PAGE, src->start, src->length);
+    slot->length = src->length;
+}
+
+/**
+ * Private function handing the held frames up to the end of the
+ * post-roll to the writer, oldest first, for as long as slots are free
+ *
+ * A held buffer is swapped with the free slot, so nothing is copied.
+ */
+static void _recorder_release(webcam_recorder_t *r)
+{
+    const webcam_archive_frame_t *header;
+    buffer_t swap;
+
+    while (r->held_count > 0) {
+        header = (const webcam_archive_frame_t *)r->held[r->held_first].start;
+        if (r->until == 0 || header->timestamp > r->until) break;
+        if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->nslots) break;
+
+        swap = r->slots[r->head % r->nslots];
+        r->slots[r->head % r->nslots] = r->held[r->held_first];
+        r->held[r->held_first] = swap;
+        r->held_first = (r->held_first + 1) % r->nheld;
+        r->held_count--;
+
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+        sem_post(&r->pending);
+    }
+}
+
+/**
+ * Pending recording triggers by signal, counted so every triggered
+ * recorder sees each of them
+ */
+static uint32_t _record_signals = 0;
+
+/**
+ * Private sink function of a triggered recorder, holding the frame in
+ * the pre-roll ring and releasing what is to be recorded
+ */
+static void _recorder_hold(webcam_recorder_t *r, const webcam_frame_t *f, const buffer_t *src)
+{
+    uint32_t requests = __atomic_load_n(&r->requests, __ATOMIC_ACQUIRE);
+    uint32_t signals = __atomic_load_n(&_record_signals, __ATOMIC_ACQUIRE);
+    const webcam_archive_frame_t *header;
+    uint16_t n;
+
+    // Make room first, a trigger now must not turn the oldest frame into pre-roll
+    if (r->held_count == r->nheld) {
+        header = (const webcam_archive_frame_t *)r->held[r->held_first].start;
+        if (r->until != 0 && header->timestamp <= r->until) {
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&r->idle, 1, __ATOMIC_RELAXED);
+        }
+        r->held_first = (r->held_first + 1) % r->nheld;
+        r->held_count--;
+    }
+
+    if (requests != r->handled || signals != r->signals ||
+        (r->motion > 0 && f->motion != NULL && f->motion->moving >= r->motion)) {
+        r->handled = requests;
+        r->signals = signals;
+        r->until = f->timestamp + r->postroll;
+        __atomic_fetch_add(&r->triggers, 1, __ATOMIC_RELAXED);
+    }
+
+    n = (r->held_first + r->held_count) % r->nheld;
+    _recorder_fill(r, &r->held[n], f, src);
+    r->held_count++;
+
+    _recorder_release(r);
+}
+
+/**
+ * Private sink function copying a frame into the next free slot,
+ * or dropping it when the writer has fallen behind
+ */
+static void recorder_push(webcam_sink_t *s, const webcam_frame_t *f)
+{
+    webcam_recorder_t *r = (webcam_recorder_t *)s;
+    const buffer_t *src = r->source == WEBCAM_RECORD_RAW ? &f->raw : &f->rgb;
+
+    if (src->start == NULL || src->length > r->capacity) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (r->triggered) {
+        _recorder_hold(r, f, src);
+        return;
+    }
+
+    if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->nslots) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    _recorder_fill(r, &r->slots[r->head % r->nslots], f, src);
+
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    sem_post(&r->pending);
+}
+
+/**
+ * Private function allocating n page-aligned buffers of a header page
+ * plus length bytes, returns false when out of memory
+ */
+static bool _recorder_buffers(buffer_t **buffers, uint16_t n, size_t length)
+{
+    uint16_t i;
+
+    *buffers = calloc(n, sizeof(buffer_t));
+    for (i = 0; *buffers != NULL && i < n; i++) {
+        if (0 != posix_memalign((void **)&(*buffers)[i].start, WEBCAM_ARCHIVE_PAGE,
+                                WEBCAM_ARCHIVE_PAGE + _page_align(length))) {
+            (*buffers)[i].start = NULL;
+            return false;
+        }
+        memset((*buffers)[i].start, 0, WEBCAM_ARCHIVE_PAGE);
+    }
+
+    return *buffers != NULL;
+}
+
+/**
+ * Opens a recorder writing an archive to the file at the given path
+ *
+ * Frames of up to length bytes are accepted, with nslots of them in
+ * flight at most. The file is opened with O_DIRECT, so recording does
+ * not fill the page cache; on filesystems without O_DIRECT (tmpfs)
+ * regular writes are used instead.
+ * With a codec, frames are compressed by a pool of workers, one per
+ * online CPU and at most one per slot.
+ */
+webcam_recorder_t *webcam_recorder_open(const char *path, webcam_record_source_t source,
+                                        webcam_codec_t codec, size_t length, uint8_t nslots)
+{
+    webcam_recorder_t *r;
+    webcam_archive_header_t *header;
+    long cpus;
+    uint8_t i;
+
+    if (nslots == 0) {
+        fprintf(stderr, "A recorder needs at least one slot\n");
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(webcam_recorder_t));
+    if (r == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    r->sink.push = recorder_push;
+    r->source = source;
+    r->codec = codec;
+    r->direct = true;
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (-1 == r->fd && EINVAL == errno) {
+        r->direct = false;
+        r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if (-1 == r->fd) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+        free(r);
+        return NULL;
+    }
+
+    // Preallocate the slots, so recording never allocates. Frames that
+    // could encode larger than the encoded buffers are stored as they are.
+    r->nslots = nslots;
+    r->capacity = length;
+    r->encoded_capacity = length + length / 8 + WEBCAM_ARCHIVE_PAGE;
+    if (!_recorder_buffers(&r->slots, nslots, length) ||
+        (codec != WEBCAM_CODEC_NONE &&
+         (!_recorder_buffers(&r->encoded, nslots, r->encoded_capacity) ||
+          (r->ready = calloc(nslots, sizeof(uint8_t))) == NULL))) {
+        fprintf(stderr, "Out of memory\n");
+        webcam_recorder_close(r);
+        return NULL;
+    }
+
+    // The file header takes the first page, written from the first slot
+    header = (webcam_archive_header_t *)r->slots[0].start;
+    header->magic = WEBCAM_ARCHIVE_MAGIC;
+    header->version = WEBCAM_ARCHIVE_VERSION;
+    header->page = WEBCAM_ARCHIVE_PAGE;
+    r->offset = _write_all(r->fd, r->slots[0].start, WEBCAM_ARCHIVE_PAGE);
+    memset(r->slots[0].start, 0, WEBCAM_ARCHIVE_PAGE);
+
+    sem_init(&r->pending, 0, 0);
+    sem_init(&r->done, 0, 0);
+    r->running = true;
+    pthread_create(&r->thread, NULL, recorder_writing, (void *)r);
+
+    if (codec != WEBCAM_CODEC_NONE) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        r->nworkers = cpus < 1 ? 1 : cpus > nslots ? nslots : cpus;
+        r->workers = calloc(r->nworkers, sizeof(pthread_t));
+        for (i = 0; i < r->nworkers; i++) {
+            pthread_create(&r->workers[i], NULL, recorder_encoding, (void *)r);
+        }
+    }
+
+    return r;
+}
+
+/**
+ * Private function appending the index and trailer to the archive
+ */
+static void _recorder_finish(webcam_recorder_t *r)
+{
+    webcam_archive_trailer_t *trailer;
+    size_t length = _page_align(r->count * sizeof(webcam_archive_entry_t) +
+                                sizeof(webcam_archive_trailer_t));
+    uint8_t *page;
+
+    if (0 != posix_memalign((void **)&page, WEBCAM_ARCHIVE_PAGE, length)) {
+        fprintf(stderr, "Out of memory, archive left without index\n");
+        return;
+    }
+
+    // Index at the start, trailer in the last bytes of the last page
+    memset(page, 0, length);
+    if (r->count > 0) memcpy(page, r->index, r->count * sizeof(webcam_archive_entry_t));
+
+    trailer = (webcam_archive_trailer_t *)(page + length - sizeof(webcam_archive_trailer_t));
+    trailer->magic = WEBCAM_ARCHIVE_INDEX;
+    trailer->count = r->count;
+    trailer->index = r->offset;
+
+    _write_all(r->fd, page, length);
+    free(page);
+}
+
+/**
+ * Closes the recorder
+ *
+ * Waits for the frames in flight to be written, appends the index,
+ * then releases the file and the slots.
+ */
+void webcam_recorder_close(webcam_recorder_t *r)
+{
+    uint16_t n;
+    uint8_t i;
+
+    if (r->running) {
+        // Held frames still to be recorded wait for the writer
+        while (r->triggered && r->held_count > 0 && r->until != 0 &&
+               ((const webcam_archive_frame_t *)r->held[r->held_first].start)->timestamp <= r->until) {
+            _recorder_release(r);
+            if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->nslots) usleep(1000);
+        }
+
+        __atomic_store_n(&r->running, false, __ATOMIC_RELEASE);
+
+        // Workers drain the filled slots first, then the writer
+        for (i = 0; i < r->nworkers; i++) sem_post(&r->pending);
+        for (i = 0; i < r->nworkers; i++) pthread_join(r->workers[i], NULL);
+
+        sem_post(r->codec == WEBCAM_CODEC_NONE ? &r->pending : &r->done);
+        pthread_join(r->thread, NULL);
+        sem_destroy(&r->pending);
+        sem_destroy(&r->done);
+
+        _recorder_finish(r);
+    }
+
+    for (i = 0; r->slots != NULL && i < r->nslots; i++) free(r->slots[i].start);
+    for (i = 0; r->encoded != NULL && i < r->nslots; i++) free(r->encoded[i].start);
+    for (n = 0; r->held != NULL && n < r->nheld; n++) free(r->held[n].start);
+    free(r->slots);
+    free(r->held);
+    free(r->encoded);
+    free(r->ready);
+    free(r->workers);
+    free(r->index);
+
+    close(r->fd);
+    free(r);
+}
+
+/**
+ * Starts recording the webcam's frames to the file at the given path
+ *
+ * The webcam needs to be resized first, so the frame size is known.
+ */
+webcam_recorder_t *webcam_record(webcam_t *w, const char *path, webcam_record_source_t source,
+                                 webcam_codec_t codec)
+{
+    webcam_recorder_t *r;
+    size_t length = (size_t)w->width * w->height * (source == WEBCAM_RECORD_RAW ? 2 : 3);
+
+    r = webcam_recorder_open(path, source, codec, length, 8);
+    if (r != NULL) webcam_sink_add(w, &r->sink);
+
+    return r;
+}
+
+/**
+ * Stops recording and closes the recorder
+ */
+void webcam_record_stop(webcam_t *w, webcam_recorder_t *r)
+{
+    webcam_sink_remove(w, &r->sink);
+    webcam_recorder_close(r);
+}
+
+/**
+ * Makes a recorder record only around triggers: the frames of the last
+ * preroll milliseconds before the first one are kept in memory,
+ * allocated here for fps frames a second (0 for 30), and frames are
+ * recorded until postroll milliseconds after the last one. A motion of
+ * more than 0 blocks also triggers, on webcams detecting motion. Call
+ * before adding the recorder as a sink.
+ *
+ * Returns 0 on success, -1 when the pre-roll is too long or out of
+ * memory
+ */
+int webcam_recorder_trigger_setup(webcam_recorder_t *r, uint32_t preroll, uint32_t postroll, uint32_t motion,
+                                  uint32_t fps)
+{
+    uint64_t frames = ((uint64_t)preroll * (fps ? fps : 30) + 999) / 1000;
+
+    // Room for the pre-roll, and for the frame being pushed
+    if (frames >= UINT16_MAX) {
+        fprintf(stderr, "A pre-roll of %u ms at %u fps exceeds %u frames\n", preroll, fps ? fps : 30, UINT16_MAX - 1);
+        return -1;
+    }
+    if (!_recorder_buffers(&r->held, frames + 1, r->capacity)) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    r->nheld = frames + 1;
+    r->postroll = (uint64_t)postroll * 1000000ull;
+    r->motion = motion;
+    r->signals = __atomic_load_n(&_record_signals, __ATOMIC_ACQUIRE);
+    r->triggered = true;
+
+    return 0;
+}
+
+/**
+ * Triggers a triggered recorder, from any thread; the frame the
+ * capture thread pushes next starts or extends the post-roll
+ */
+void webcam_recorder_trigger(webcam_recorder_t *r)
+{
+    __atomic_fetch_add(&r->requests, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Private handler for the recording trigger signal
+ */
+static void record_handler(int sig)
+{
+    (void)sig;
+    __atomic_fetch_add(&_record_signals, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Triggers all triggered recorders whenever the process receives the
+ * given signal, e.g. SIGUSR2
+ */
+void webcam_recorder_trigger_on_signal(int sig)
+{
+    struct sigaction action;
+
+    CLEAR(action);
+    action.sa_handler = record_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, NULL);
+}
+
+/**
+ * Private function returning the frame rate the device reports, 0 when
+ * it reports none
+ */
+static uint32_t _webcam_fps(webcam_t *w)
+{
+    struct v4l2_streamparm parm;
+
+    CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (0 == _ioctl(w->fd, VIDIOC_G_PARM, &parm) && parm.parm.capture.timeperframe.numerator) {
+        return parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+    }
+
+    return 0;
+}
+
+/**
+ * Starts recording the webcam's frames around triggers, at the frame
+ * rate the device reports, see webcam_recorder_trigger_setup()
+ */
+webcam_recorder_t *webcam_record_triggered(webcam_t *w, const char *path, webcam_record_source_t source,
+                                           webcam_codec_t codec, uint32_t preroll, uint32_t postroll,
+                                           uint32_t motion)
+{
+    webcam_recorder_t *r;
+    size_t length = (size_t)w->width * w->height * (source == WEBCAM_RECORD_RAW ? 2 : 3);
+
+    r = webcam_recorder_open(path, source, codec, length, 8);
+    if (r == NULL) return NULL;
+
+    if (-1 == webcam_recorder_trigger_setup(r, preroll, postroll, motion, _webcam_fps(w))) {
+        webcam_recorder_close(r);
+        return NULL;
+    }
+    webcam_sink_add(w, &r->sink);
+
+    return r;
+}
+
+/**
+ * Private function splitting YUYV into Y, U and V planes (4:2:2)
+ */
+static void _yuyv_planar(const uint8_t *src, uint16_t width, uint16_t height, uint8_t *dst)
+{
+    size_t i, n = (size_t)width * height / 2;
+    uint8_t *y = dst, *u = dst + 2 * n, *v = u + n;
+
+    for (i = 0; i < n; i++) {
+        y[2 * i]     = src[4 * i];
+        u[i]         = src[4 * i + 1];
+        y[2 * i + 1] = src[4 * i + 2];
+        v[i]         = src[4 * i + 3];
+    }
+}
+
+/**
+ * Private function handing the whole buffer to a pipe by reference,
+ * returns the bytes spliced
+ */
+static size_t _vmsplice_all(int fd, uint8_t *start, size_t length)
+{
+    struct iovec iov;
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < length; done += n) {
+        iov.iov_base = start + done;
+        iov.iov_len = length - done;
+        n = vmsplice(fd, &iov, 1, 0);
+        if (n == -1 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            if (errno != EPIPE) fprintf(stderr, "Error while piping: %d, %s\n", errno, strerror(errno));
+            break;
+        }
+    }
+
+    return done;
+}
+
+/**
+ * Private function telling whether the reader of the pipe has consumed
+ * the stream up to the given offset, so the pages before it are no
+ * longer referenced by the pipe. The pipe never holds more than its
+ * capacity, so FIONREAD is only asked when that does not settle it.
+ */
+static bool _pipe_released(webcam_pipe_t *p, uint64_t end)
+{
+    uint64_t written = __atomic_load_n(&p->written, __ATOMIC_ACQUIRE);
+    int unread;
+
+    if (!p->splice || end + p->pipe_size <= written) return true;
+    if (-1 == ioctl(p->fd, FIONREAD, &unread)) return false;
+
+    return end + unread <= written;
+}
+
+/**
+ * The loop function for the pipe thread
+ *
+ * Writes the stream header, then splices the filled slots in order,
+ * until the pipe output is closed and everything in flight is handed
+ * over. Every slot holds the Y4M frame marker in the last bytes of its
+ * first page, so marker and payload go to the pipe as one range.
+ */
+static void *pipe_writing(void *ptr)
+{
+    webcam_pipe_t *p = (webcam_pipe_t *)ptr;
+    char header[64];
+    uint8_t *start;
+    size_t length, done;
+    sigset_t mask;
+    uint8_t n;
+
+    // A reader going away fails the write with EPIPE rather than killing the process
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if (p->format == WEBCAM_PIPE_Y4M) {
+        length = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C422\n",
+                          p->width, p->height, p->fps);
+        __atomic_store_n(&p->written, _write_all(p->fd, (uint8_t *)header, length), __ATOMIC_RELEASE);
+    }
+
+    for (;;) {
+        while (-1 == sem_wait(&p->pending) && EINTR == errno);
+
+        if (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->tail) {
+            if (!__atomic_load_n(&p->running, __ATOMIC_ACQUIRE)) break;
+            continue;
+        }
+
+        n = p->tail % p->nslots;
+        start = p->slots[n].start + WEBCAM_ARCHIVE_PAGE;
+        length = p->slots[n].length;
+        if (p->format == WEBCAM_PIPE_Y4M) {
+            start -= 6;
+            length += 6;
+        }
+
+        // The slot stays referenced by the pipe until read past its end
+        p->ends[n] = p->written + length;
+        done = p->splice ? _vmsplice_all(p->fd, start, length) : _write_all(p->fd, start, length);
+        __atomic_store_n(&p->written, p->written + done, __ATOMIC_RELEASE);
+
+        __atomic_fetch_add(&p->bytes, done, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->frames, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+
+        // The reader is gone, later frames are dropped once the slots run out
+        if (done < length) {
+            if (errno == EPIPE) fprintf(stderr, "The reader of the pipe is gone\n");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Private sink function filling the next free slot with a frame in the
+ * output format, or dropping it when the slot is still in the pipe
+ */
+static void pipe_push(webcam_sink_t *s, const webcam_frame_t *f)
+{
+    webcam_pipe_t *p = (webcam_pipe_t *)s;
+    const buffer_t *src = p->format == WEBCAM_PIPE_RGB ? &f->rgb : &f->raw;
+    size_t length = (size_t)p->width * p->height * (p->format == WEBCAM_PIPE_RGB ? 3 : 2);
+    uint8_t n = p->head % p->nslots;
+    buffer_t *slot = &p->slots[n];
+
+    if (p->head - __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == p->nslots ||
+        f->width != p->width || f->height != p->height || src->length < length ||
+        !_pipe_released(p, p->ends[n])) {
+        __atomic_fetch_add(&p->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (p->format == WEBCAM_PIPE_Y4M) {
+        _yuyv_planar(src->start, p->width, p->height, slot->start + WEBCAM_ARCHIVE_PAGE);
+    } else {
+        memcpy(slot->start + WEBCAM_ARCHIVE_PAGE, src->start, length);
+    }
+    slot->length = length;
+
+    __atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+    sem_post(&p->pending);
+}
+
+/**
+ * Opens a pipe output writing frames of the given size to fd
+ *
+ * The fd stays owned by the caller. When it is a pipe, frames are
+ * handed over with vmsplice and the pipe is enlarged, so the reader
+ * can take bigger chunks at a time; anything else gets regular writes.
+ * A reader that splices the pipe onwards instead of reading it must
+ * keep up, as slots are refilled once their bytes have left the pipe.
+ */
+webcam_pipe_t *webcam_pipe_open(int fd, webcam_pipe_format_t format, uint16_t width, uint16_t height,
+                                uint32_t fps, uint8_t nslots)
+{
+    webcam_pipe_t *p;
+    struct stat st;
+    size_t length;
+    int size;
+    uint8_t i;
+
+    if (nslots == 0) {
+        fprintf(stderr, "A pipe needs at least one slot\n");
+        return NULL;
+    }
+
+    p = calloc(1, sizeof(webcam_pipe_t));
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    p->sink.push = pipe_push;
+    p->format = format;
+    p->fd = fd;
+    p->width = width;
+    p->height = height;
+    p->fps = fps ? fps : 30;
+
+    p->splice = 0 == fstat(fd, &st) && S_ISFIFO(st.st_mode);
+    if (p->splice) {
+        fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+        size = fcntl(fd, F_GETPIPE_SZ);
+        p->splice = size > 0;
+        p->pipe_size = size;
+    }
+
+    // Slots are mapped rather than allocated, so pages still in the pipe
+    // when the output is closed are never handed out again by malloc
+    p->nslots = nslots;
+    p->capacity = (size_t)width * height * (format == WEBCAM_PIPE_RGB ? 3 : 2);
+    length = WEBCAM_ARCHIVE_PAGE + _page_align(p->capacity);
+    p->slots = calloc(nslots, sizeof(buffer_t));
+    p->ends = calloc(nslots, sizeof(uint64_t));
+    for (i = 0; p->slots != NULL && p->ends != NULL && i < nslots; i++) {
+        p->slots[i].start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p->slots[i].start == MAP_FAILED) {
+            p->slots[i].start = NULL;
+            break;
+        }
+        memcpy(p->slots[i].start + WEBCAM_ARCHIVE_PAGE - 6, "FRAME\n", 6);
+    }
+
+    if (i < nslots) {
+        fprintf(stderr, "Out of memory\n");
+        webcam_pipe_close(p);
+        return NULL;
+    }
+
+    sem_init(&p->pending, 0, 0);
+    p->running = true;
+    pthread_create(&p->thread, NULL, pipe_writing, (void *)p);
+
+    return p;
+}
+
+/**
+ * Closes the pipe output
+ *
+ * Waits for the frames in flight to be handed to the pipe. Pages the
+ * reader has not consumed yet stay referenced by the pipe after they
+ * are unmapped, so the last frames arrive intact.
+ */
+void webcam_pipe_close(webcam_pipe_t *p)
+{
+    uint8_t i;
+
+    if (p->running) {
+        __atomic_store_n(&p->running, false, __ATOMIC_RELEASE);
+        sem_post(&p->pending);
+        pthread_join(p->thread, NULL);
+        sem_destroy(&p->pending);
+    }
+
+    for (i = 0; p->slots != NULL && i < p->nslots; i++) {
+        if (p->slots[i].start != NULL) {
+            munmap(p->slots[i].start, WEBCAM_ARCHIVE_PAGE + _page_align(p->capacity));
+        }
+    }
+    free(p->slots);
+    free(p->ends);
+    free(p);
+}
+
+/**
+ * Starts streaming the webcam's frames to fd, at the frame rate the
+ * device reports
+ *
+ * The webcam needs to be resized first, so the frame size is known.
+ */
+webcam_pipe_t *webcam_pipe(webcam_t *w, int fd, webcam_pipe_format_t format)
+{
+    webcam_pipe_t *p = webcam_pipe_open(fd, format, w->width, w->height, _webcam_fps(w), 4);
+
+    if (p != NULL) webcam_sink_add(w, &p->sink);
+
+    return p;
+}
+
+/**
+ * Stops streaming to the pipe and closes the pipe output
+ */
+void webcam_pipe_stop(webcam_t *w, webcam_pipe_t *p)
+{
+    webcam_sink_remove(w, &p->sink);
+    webcam_pipe_close(p);
+}
+
+/**
+ * Baseline JPEG tables (ITU T.81 Annex K), in natural order for the
+ * quantization tables
+ */
+static const uint8_t _jpeg_quant[2][64] = {
+    {
+        16,  11,  10,  16,  24,  40,  51,  61,
+        12,  12,  14,  19,  26,  58,  60,  55,
+        14,  13,  16,  24,  40,  57,  69,  56,
+        14,  17,  22,  29,  51,  87,  80,  62,
+        18,  22,  37,  56,  68, 109, 103,  77,
+        24,  35,  55,  64,  81, 104, 113,  92,
+        49,  64,  78,  87, 103, 121, 120, 101,
+        72,  92,  95,  98, 112, 100, 103,  99
+    }, {
+        17,  18,  24,  47,  99,  99,  99,  99,
+        18,  21,  26,  66,  99,  99,  99,  99,
+        24,  26,  56,  99,  99,  99,  99,  99,
+        47,  66,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99
+    }
+};
+
+static const uint8_t _jpeg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const uint8_t _jpeg_dc_bits[2][16] = {
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 }
+};
+
+static const uint8_t _jpeg_dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t _jpeg_ac_bits[2][16] = {
+    { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+    { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 }
+};
+
+static const uint8_t _jpeg_ac_values[2][162] = {
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa
+    }, {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa
+    }
+};
+
+/**
+ * Huffman codes and their lengths by symbol, derived from the tables
+ * above on first use
+ */
+static uint16_t _jpeg_dc_code[2][12];
+static uint8_t  _jpeg_dc_size[2][12];
+static uint16_t _jpeg_ac_code[2][256];
+static uint8_t  _jpeg_ac_size[2][256];
+static pthread_once_t _jpeg_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Private function generating the canonical codes of a Huffman table
+ */
+static void _jpeg_huffman(const uint8_t *bits, const uint8_t *values, uint16_t *code, uint8_t *size)
+{
+    uint16_t c = 0;
+    int l, i, k = 0;
+
+    for (l = 1; l <= 16; l++) {
+        for (i = 0; i < bits[l - 1]; i++, k++) {
+            code[values[k]] = c++;
+            size[values[k]] = l;
+        }
+        c <<= 1;
+    }
+}
+
+static void _jpeg_tables(void)
+{
+    int t;
+
+    for (t = 0; t < 2; t++) {
+        _jpeg_huffman(_jpeg_dc_bits[t], _jpeg_dc_values, _jpeg_dc_code[t], _jpeg_dc_size[t]);
+        _jpeg_huffman(_jpeg_ac_bits[t], _jpeg_ac_values[t], _jpeg_ac_code[t], _jpeg_ac_size[t]);
+    }
+}
+
+/**
+ * Entropy coder output: bits are gathered in acc, and bytes of 0xff
+ * are stuffed with a zero byte
+ */
+typedef struct _jpeg_bits {
+    buffer_t    *out;
+    size_t      *capacity;
+    uint64_t    acc;
+    int         n;
+} _jpeg_bits_t;
+
+static inline void _jpeg_put(_jpeg_bits_t *b, uint32_t code, int size)
+{
+    uint8_t byte;
+
+    b->acc = (b->acc << size) | (code & ((1u << size) - 1));
+    for (b->n += size; b->n >= 8; b->n -= 8) {
+        byte = b->acc >> (b->n - 8);
+        b->out->start[b->out->length++] = byte;
+        if (byte == 0xff) b->out->start[b->out->length++] = 0;
+    }
+}
+
+/**
+ * Private function growing the strip output, so the next MCU fits even
+ * when every coefficient takes the longest code and every byte is
+ * stuffed; returns false when out of memory
+ */
+static bool _jpeg_reserve(_jpeg_bits_t *b)
+{
+    uint8_t *start;
+    size_t capacity = *b->capacity;
+
+    if (b->out->length + 4096 <= capacity) return true;
+
+    capacity = capacity ? capacity * 2 : 65536;
+    start = realloc(b->out->start, capacity);
+    if (start == NULL) return false;
+
+    b->out->start = start;
+    *b->capacity = capacity;
+
+    return true;
+}
+
+/**
+ * Private function transforming, quantizing and coding one 8x8 block of
+ * level-shifted samples, with the AAN floating point forward DCT
+ */
+static void _jpeg_block(_jpeg_bits_t *b, float *d, const float *divisors, int t, int *dc)
+{
+    float t0, t1, t2, t3, t4, t5, t6, t7, t10, t11, t12, t13, z1, z2, z3, z4, z5, z11, z13;
+    float *p;
+    int q[64], i, k, run, v, a, size;
+
+    for (i = 0; i < 16; i++) {
+        // Rows first, then columns
+        p = i < 8 ? d + i * 8 : d + i - 8;
+        k = i < 8 ? 1 : 8;
+
+        t0 = p[0] + p[7 * k];
+        t7 = p[0] - p[7 * k];
+        t1 = p[k] + p[6 * k];
+        t6 = p[k] - p[6 * k];
+        t2 = p[2 * k] + p[5 * k];
+        t5 = p[2 * k] - p[5 * k];
+        t3 = p[3 * k] + p[4 * k];
+        t4 = p[3 * k] - p[4 * k];
+
+        t10 = t0 + t3;
+        t13 = t0 - t3;
+        t11 = t1 + t2;
+        t12 = t1 - t2;
+
+        p[0] = t10 + t11;
+        p[4 * k] = t10 - t11;
+        z1 = (t12 + t13) * 0.707106781f;
+        p[2 * k] = t13 + z1;
+        p[6 * k] = t13 - z1;
+
+        t10 = t4 + t5;
+        t11 = t5 + t6;
+        t12 = t6 + t7;
+        z5 = (t10 - t12) * 0.382683433f;
+        z2 = 0.541196100f * t10 + z5;
+        z4 = 1.306562965f * t12 + z5;
+        z3 = t11 * 0.707106781f;
+        z11 = t7 + z3;
+        z13 = t7 - z3;
+
+        p[5 * k] = z13 + z2;
+        p[3 * k] = z13 - z2;
+        p[k] = z11 + z4;
+        p[7 * k] = z11 - z4;
+    }
+
+    // Round to nearest, in zigzag order
+    for (i = 0; i < 64; i++) {
+        k = _jpeg_zigzag[i];
+        q[i] = (int)(d[k] * divisors[k] + 16384.5f) - 16384;
+    }
+
+    v = q[0] - *dc;
+    *dc = q[0];
+    a = v < 0 ? -v : v;
+    for (size = 0; a; a >>= 1) size++;
+    _jpeg_put(b, _jpeg_dc_code[t][size], _jpeg_dc_size[t][size]);
+    if (size) _jpeg_put(b, v < 0 ? v - 1 : v, size);
+
+    for (i = 1, run = 0; i < 64; i++) {
+        v = q[i];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16) _jpeg_put(b, _jpeg_ac_code[t][0xf0], _jpeg_ac_size[t][0xf0]);
+
+        a = v < 0 ? -v : v;
+        for (size = 0; a; a >>= 1) size++;
+        _jpeg_put(b, _jpeg_ac_code[t][(run << 4) | size], _jpeg_ac_size[t][(run << 4) | size]);
+        _jpeg_put(b, v < 0 ? v - 1 : v, size);
+        run = 0;
+    }
+    if (run) _jpeg_put(b, _jpeg_ac_code[t][0], _jpeg_ac_size[t][0]);
+}
+
+/**
+ * Private function entropy coding one strip of a 4:2:2 frame
+ *
+ * Every MCU covers 16x8 pixels: two luma blocks, then one block each of
+ * Cb and Cr. Samples past the edges repeat the last row and column.
+ */
+static bool _jpeg_strip(webcam_http_t *h, webcam_jpeg_job_t *job, uint16_t strip)
+{
+    uint32_t stride = job->width * 2, mcus = (job->width + 15) / 16, pairs = job->width / 2;
+    uint32_t first = strip * job->rows, last = first + job->rows, mx, my, x, y, sy, sx;
+    uint32_t rows = (job->height + 7) / 8;
+    const uint8_t *row;
+    _jpeg_bits_t b;
+    float blocks[4][64];
+    int dc[3] = { 0, 0, 0 };
+
+    b.out = &job->out[strip];
+    b.capacity = &job->capacity[strip];
+    b.out->length = 0;
+    b.acc = 0;
+    b.n = 0;
+
+    for (my = first; my < last && my < rows; my++) {
+        for (mx = 0; mx < mcus; mx++) {
+            if (!_jpeg_reserve(&b)) return false;
+
+            for (y = 0; y < 8; y++) {
+                sy = my * 8 + y < job->height ? my * 8 + y : job->height - 1u;
+                row = job->yuyv + (size_t)sy * stride;
+
+                for (x = 0; x < 16; x++) {
+                    sx = mx * 16 + x < job->width ? mx * 16 + x : job->width - 1u;
+                    blocks[x / 8][y * 8 + x % 8] = row[2 * sx] - 128.0f;
+                }
+                for (x = 0; x < 8; x++) {
+                    sx = mx * 8 + x < pairs ? mx * 8 + x : pairs - 1;
+                    blocks[2][y * 8 + x] = row[4 * sx + 1] - 128.0f;
+                    blocks[3][y * 8 + x] = row[4 * sx + 3] - 128.0f;
+                }
+            }
+
+            _jpeg_block(&b, blocks[0], h->divisors[0], 0, &dc[0]);
+            _jpeg_block(&b, blocks[1], h->divisors[0], 0, &dc[0]);
+            _jpeg_block(&b, blocks[2], h->divisors[1], 1, &dc[1]);
+            _jpeg_block(&b, blocks[3], h->divisors[1], 1, &dc[2]);
+        }
+    }
+
+    // Pad the last byte with ones
+    if (b.n > 0) _jpeg_put(&b, 0x7f, 8 - b.n);
+
+    return true;
+}
+
+/**
+ * Private function encoding one strip of the oldest job that still has
+ * strips to claim, returns false when there is none
+ */
+static bool _jpeg_work(webcam_http_t *h)
+{
+    webcam_jpeg_job_t *job;
+    uint16_t strip;
+
+    pthread_mutex_lock(&h->mtx_jobs);
+    job = h->jobs;
+    if (job == NULL) {
+        pthread_mutex_unlock(&h->mtx_jobs);
+        return false;
+    }
+
+    strip = job->next++;
+    if (job->next == job->strips) h->jobs = job->next_job;
+    pthread_mutex_unlock(&h->mtx_jobs);
+
+    if (!_jpeg_strip(h, job, strip)) job->out[strip].length = 0;
+
+    if (__atomic_add_fetch(&job->finished, 1, __ATOMIC_ACQ_REL) == job->strips) {
+        sem_post(&job->done);
+    }
+
+    return true;
+}
+
+/**
+ * The loop function for the server's JPEG workers
+ */
+static void *jpeg_encoding(void *ptr)
+{
+    webcam_http_t *h = (webcam_http_t *)ptr;
+
+    for (;;) {
+        while (-1 == sem_wait(&h->work) && EINTR == errno);
+        if (!__atomic_load_n(&h->running, __ATOMIC_ACQUIRE)) break;
+
+        while (_jpeg_work(h));
+    }
+
+    return NULL;
+}
+
+/**
+ * Private function writing the JPEG headers up to the scan, returns the
+ * bytes written
+ */
+static size_t _jpeg_header(webcam_http_t *h, uint8_t *p, uint16_t width, uint16_t height, uint16_t restart)
+{
+    static const uint8_t jfif[] = {
+        0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+        0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00
+    };
+    static const uint8_t sos[] = {
+        0xff, 0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00
+    };
+    uint8_t *start = p;
+    int t, i, n;
+
+    memcpy(p, jfif, sizeof(jfif));
+    p += sizeof(jfif);
+
+    for (t = 0; t < 2; t++) {
+        *p++ = 0xff; *p++ = 0xdb; *p++ = 0x00; *p++ = 0x43; *p++ = t;
+        for (i = 0; i < 64; i++) *p++ = h->qtable[t][_jpeg_zigzag[i]];
+    }
+
+    *p++ = 0xff; *p++ = 0xc0; *p++ = 0x00; *p++ = 0x11; *p++ = 0x08;
+    *p++ = height >> 8; *p++ = height; *p++ = width >> 8; *p++ = width;
+    *p++ = 0x03;
+    *p++ = 0x01; *p++ = 0x21; *p++ = 0x00;
+    *p++ = 0x02; *p++ = 0x11; *p++ = 0x01;
+    *p++ = 0x03; *p++ = 0x11; *p++ = 0x01;
+
+    for (t = 0; t < 2; t++) {
+        for (i = 0, n = 0; i < 16; i++) n += _jpeg_dc_bits[t][i];
+        *p++ = 0xff; *p++ = 0xc4; *p++ = 0x00; *p++ = 3 + 16 + n; *p++ = t;
+        memcpy(p, _jpeg_dc_bits[t], 16);
+        memcpy(p + 16, _jpeg_dc_values, n);
+        p += 16 + n;
+
+        for (i = 0, n = 0; i < 16; i++) n += _jpeg_ac_bits[t][i];
+        *p++ = 0xff; *p++ = 0xc4; *p++ = 0x00; *p++ = 3 + 16 + n; *p++ = 0x10 | t;
+        memcpy(p, _jpeg_ac_bits[t], 16);
+        memcpy(p + 16, _jpeg_ac_values[t], n);
+        p += 16 + n;
+    }
+
+    *p++ = 0xff; *p++ = 0xdd; *p++ = 0x00; *p++ = 0x04; *p++ = restart >> 8; *p++ = restart;
+
+    memcpy(p, sos, sizeof(sos));
+    p += sizeof(sos);
+
+    return p - start;
+}
+
+/**
+ * Private function encoding the staged frame of a stream as JPEG
+ *
+ * The strips are handed to the server's workers, and the calling
+ * thread encodes strips as well until none are left to claim.
+ */
+static webcam_jpeg_t *_jpeg_encode(webcam_http_t *h, webcam_http_stream_t *s)
+{
+    webcam_jpeg_job_t *job = &s->job, **tail;
+    webcam_jpeg_t *j;
+    uint32_t mcus = (s->width + 15) / 16, rows = (s->height + 7) / 8;
+    uint16_t i, strips;
+    size_t length;
+    uint8_t *p;
+
+    // About four strips per worker, each at most 65535 MCUs long
+    job->rows = rows / (4 * (h->nworkers + 1));
+    if (job->rows < 1) job->rows = 1;
+    if ((uint32_t)job->rows * mcus > 65535) job->rows = 65535 / mcus;
+    strips = (rows + job->rows - 1) / job->rows;
+
+    if (strips > s->nstrips) {
+        job->out = realloc(job->out, strips * sizeof(buffer_t));
+        job->capacity = realloc(job->capacity, strips * sizeof(size_t));
+        if (job->out == NULL || job->capacity == NULL) return NULL;
+        for (i = s->nstrips; i < strips; i++) {
+            job->out[i].start = NULL;
+            job->capacity[i] = 0;
+        }
+        s->nstrips = strips;
+    }
+
+    job->yuyv = s->staging.start;
+    job->width = s->width;
+    job->height = s->height;
+    job->strips = strips;
+    job->next = 0;
+    job->finished = 0;
+    job->next_job = NULL;
+
+    pthread_mutex_lock(&h->mtx_jobs);
+    for (tail = &h->jobs; *tail != NULL; tail = &(*tail)->next_job);
+    *tail = job;
+    pthread_mutex_unlock(&h->mtx_jobs);
+
+    for (i = 0; i < h->nworkers && i + 1 < strips; i++) sem_post(&h->work);
+    while (_jpeg_work(h));
+    while (-1 == sem_wait(&job->done) && EINTR == errno);
+
+    // Headers, then the strips separated by restart markers
+    for (i = 0, length = 1024; i < strips; i++) {
+        if (job->out[i].length == 0) return NULL;
+        length += job->out[i].length + 2;
+    }
+
+    j = malloc(sizeof(webcam_jpeg_t) + length);
+    if (j == NULL) return NULL;
+
+    p = j->data + _jpeg_header(h, j->data, s->width, s->height, job->rows * mcus);
+    for (i = 0; i < strips; i++) {
+        if (i > 0) {
+            *p++ = 0xff;
+            *p++ = 0xd0 + (i - 1) % 8;
+        }
+        memcpy(p, job->out[i].start, job->out[i].length);
+        p += job->out[i].length;
+    }
+    *p++ = 0xff;
+    *p++ = 0xd9;
+
+    j->refs = 1;
+    j->sequence = s->encoded;
+    j->length = p - j->data;
+
+    return j;
+}
+
+/**
+ * Takes a reference to a shared JPEG frame
+ */
+webcam_jpeg_t *webcam_jpeg_ref(webcam_jpeg_t *j)
+{
+    __atomic_fetch_add(&j->refs, 1, __ATOMIC_RELAXED);
+
+    return j;
+}
+
+/**
+ * Drops a reference to a shared JPEG frame, freeing it with the last
+ */
+void webcam_jpeg_release(webcam_jpeg_t *j)
+{
+    if (j != NULL && __atomic_sub_fetch(&j->refs, 1, __ATOMIC_ACQ_REL) == 0) free(j);
+}
+
+/**
+ * The loop function for the encoding thread of a stream
+ *
+ * Encodes the staged frame, makes it the stream's current frame and
+ * wakes the server thread to fan it out.
+ */
+static void *http_encoding(void *ptr)
+{
+    webcam_http_stream_t *s = (webcam_http_stream_t *)ptr;
+    webcam_http_t *h = s->server;
+    webcam_jpeg_t *j, *old;
+    uint64_t t;
+
+    for (;;) {
+        while (-1 == sem_wait(&s->pending) && EINTR == errno);
+        if (!__atomic_load_n(&h->running, __ATOMIC_ACQUIRE)) break;
+
+        TRACE_START(t_encode);
+        t = _now();
+        j = _jpeg_encode(h, s);
+        __atomic_fetch_add(&s->encode_ns, _now() - t, __ATOMIC_RELAXED);
+        TRACE_END("jpeg", s->index, t_encode, s->encoded);
+        __atomic_store_n(&s->busy, false, __ATOMIC_RELEASE);
+        if (j == NULL) continue;
+
+        pthread_mutex_lock(&s->mtx_current);
+        old = s->current;
+        s->current = j;
+        pthread_mutex_unlock(&s->mtx_current);
+        webcam_jpeg_release(old);
+
+        __atomic_fetch_add(&s->encoded, 1, __ATOMIC_RELAXED);
+        if (-1 == write(h->wake[1], "", 1) && EAGAIN != errno) {
+            fprintf(stderr, "Cannot wake the HTTP server: %d, %s\n", errno, strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Private sink function staging a frame for encoding, unless nobody is
+ * watching or the previous frame is still being encoded
+ */
+static void http_push(webcam_sink_t *sink, const webcam_frame_t *f)
+{
+    webcam_http_stream_t *s = (webcam_http_stream_t *)sink;
+    size_t length = (size_t)f->width * f->height * 2;
+
+    if (__atomic_load_n(&s->clients, __ATOMIC_ACQUIRE) == 0 || f->raw.length < length) return;
+
+    if (__atomic_load_n(&s->busy, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(&s->skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (s->staging.length != length) {
+        free(s->staging.start);
+        s->staging.start = malloc(length);
+        s->staging.length = s->staging.start != NULL ? length : 0;
+        if (s->staging.start == NULL) return;
+    }
+
+    memcpy(s->staging.start, f->raw.start, length);
+    s->width = f->width;
+    s->height = f->height;
+
+    __atomic_store_n(&s->busy, true, __ATOMIC_RELEASE);
+    sem_post(&s->pending);
+}
+
+/**
+ * Private function closing a client connection
+ */
+static void _http_drop(webcam_http_client_t *c)
+{
+    if (c->stream != NULL) __atomic_fetch_sub(&c->stream->clients, 1, __ATOMIC_RELEASE);
+    webcam_jpeg_release(c->jpeg);
+    close(c->fd);
+    CLEAR(*c);
+    c->fd = -1;
+}
+
+/**
+ * Private function sending as much of the client's frame as the socket
+ * takes without blocking, straight from the shared buffer
+ */
+static void _http_send(webcam_http_client_t *c)
+{
+    struct iovec iov[3];
+    struct msghdr msg;
+    size_t total = c->part_length + c->jpeg->length + 2, skip = c->sent;
+    ssize_t n;
+    int i;
+
+    iov[0].iov_base = c->part;
+    iov[0].iov_len = c->part_length;
+    iov[1].iov_base = c->jpeg->data;
+    iov[1].iov_len = c->jpeg->length;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+
+    for (i = 0; skip >= iov[i].iov_len; i++) skip -= iov[i].iov_len;
+    iov[i].iov_base = (uint8_t *)iov[i].iov_base + skip;
+    iov[i].iov_len -= skip;
+
+    // A client gone mid-stream fails with EPIPE rather than raising SIGPIPE
+    CLEAR(msg);
+    msg.msg_iov = iov + i;
+    msg.msg_iovlen = 3 - i;
+    n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (n == -1) {
+        if (EAGAIN != errno && EINTR != errno) _http_drop(c);
+        return;
+    }
+
+    c->sent += n;
+    if (c->sent == total) {
+        c->last = c->jpeg->sequence;
+        c->frames++;
+        webcam_jpeg_release(c->jpeg);
+        c->jpeg = NULL;
+    }
+}
+
+/**
+ * Private function starting the stream's current frame on an idle
+ * client, counting the frames it missed while busy
+ */
+static void _http_next(webcam_http_client_t *c)
+{
+    webcam_http_stream_t *s = c->stream;
+    webcam_jpeg_t *j = NULL;
+    int n = 0;
+
+    pthread_mutex_lock(&s->mtx_current);
+    if (s->current != NULL && (c->frames == 0 || s->current->sequence != c->last)) {
+        j = webcam_jpeg_ref(s->current);
+    }
+    pthread_mutex_unlock(&s->mtx_current);
+    if (j == NULL) return;
+
+    if (c->frames == 0) {
+        n = snprintf(c->part, sizeof(c->part), "HTTP/1.0 200 OK\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Connection: close\r\n"
+                     "Content-Type: multipart/x-mixed-replace; boundary=webcamframe\r\n\r\n");
+    } else {
+        c->skipped += j->sequence - c->last - 1;
+    }
+    n += snprintf(c->part + n, sizeof(c->part) - n, "--webcamframe\r\n"
+                  "Content-Type: image/jpeg\r\n"
+                  "Content-Length: %zu\r\n\r\n", j->length);
+
+    c->jpeg = j;
+    c->part_length = n;
+    c->sent = 0;
+    _http_send(c);
+}
+
+/**
+ * Private function reading the request of a client, and picking the
+ * stream it asks for
+ */
+static void _http_request(webcam_http_t *h, webcam_http_client_t *c)
+{
+    static const char *missing = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    webcam_http_stream_t *s;
+    unsigned int index;
+    ssize_t n;
+
+    n = read(c->fd, c->request + c->received, sizeof(c->request) - 1 - c->received);
+    if (n == -1 && (EAGAIN == errno || EINTR == errno)) return;
+    if (n <= 0) {
+        _http_drop(c);
+        return;
+    }
+
+    // Streaming clients have nothing more to say
+    if (c->stream != NULL) return;
+
+    c->received += n;
+    c->request[c->received] = '\0';
+    if (strstr(c->request, "\r\n\r\n") == NULL) {
+        if (c->received == sizeof(c->request) - 1) _http_drop(c);
+        return;
+    }
+
+    pthread_mutex_lock(&h->mtx_streams);
+    for (s = h->streams; s != NULL; s = s->next) {
+        if (1 == sscanf(c->request, "GET /%u ", &index) && index == s->index) break;
+    }
+    pthread_mutex_unlock(&h->mtx_streams);
+
+    if (s == NULL) {
+        send(c->fd, missing, strlen(missing), MSG_NOSIGNAL);
+        _http_drop(c);
+        return;
+    }
+
+    c->stream = s;
+    __atomic_fetch_add(&s->clients, 1, __ATOMIC_RELEASE);
+    _http_next(c);
+}
+
+/**
+ * The loop function for the server thread
+ *
+ * Polls the listening socket, the wake-up pipe and the clients: new
+ * clients are accepted, requests read, and whenever a stream has a new
+ * frame, every idle client of it starts sending that frame.
+ */
+static void *http_serving(void *ptr)
+{
+    webcam_http_t *h = (webcam_http_t *)ptr;
+    struct pollfd fds[2 + WEBCAM_HTTP_CLIENTS];
+    webcam_http_client_t *c;
+    char drain[64];
+    int i, fd, size = WEBCAM_HTTP_SNDBUF;
+
+    for (;;) {
+        fds[0].fd = h->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = h->wake[0];
+        fds[1].events = POLLIN;
+        for (i = 0; i < WEBCAM_HTTP_CLIENTS; i++) {
+            c = &h->clients[i];
+            fds[2 + i].fd = c->fd;
+            fds[2 + i].events = c->jpeg != NULL ? POLLOUT : POLLIN;
+            fds[2 + i].revents = 0;
+        }
+
+        if (-1 == poll(fds, 2 + WEBCAM_HTTP_CLIENTS, -1) && EINTR != errno) break;
+        if (!__atomic_load_n(&h->running, __ATOMIC_ACQUIRE)) break;
+
+        if (fds[1].revents & POLLIN) {
+            while (read(h->wake[0], drain, sizeof(drain)) > 0);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            fd = accept4(h->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            for (i = 0; fd != -1 && i < WEBCAM_HTTP_CLIENTS && h->clients[i].fd != -1; i++);
+            if (i < WEBCAM_HTTP_CLIENTS) {
+                // Keep the kernel from queueing frames for slow clients
+                setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+                h->clients[i].fd = fd;
+            } else if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        for (i = 0; i < WEBCAM_HTTP_CLIENTS; i++) {
+            c = &h->clients[i];
+            if (c->fd == -1 || fds[2 + i].fd != c->fd) continue;
+
+            if (fds[2 + i].revents & (POLLERR | POLLHUP)) {
+                _http_drop(c);
+            } else if (fds[2 + i].revents & POLLIN) {
+                _http_request(h, c);
+            } else if (fds[2 + i].revents & POLLOUT) {
+                _http_send(c);
+            }
+        }
+
+        // Fan the latest frames out to everyone who is done with theirs
+        for (i = 0; i < WEBCAM_HTTP_CLIENTS; i++) {
+            c = &h->clients[i];
+            if (c->fd != -1 && c->stream != NULL && c->jpeg == NULL) _http_next(c);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens an HTTP server listening on the given address and port, NULL
+ * for all addresses and 0 for any free port (see h->port)
+ *
+ * JPEG quality is 1-100; frames are encoded by a pool of one worker
+ * per online CPU on top of the streams' own threads.
+ */
+webcam_http_t *webcam_http_open(const char *address, uint16_t port, uint8_t quality)
+{
+    webcam_http_t *h;
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    static const float aan[8] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+    };
+    long cpus;
+    int i, t, q, one = 1;
+
+    pthread_once(&_jpeg_once, _jpeg_tables);
+
+    h = calloc(1, sizeof(webcam_http_t));
+    if (h == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    for (i = 0; i < WEBCAM_HTTP_CLIENTS; i++) h->clients[i].fd = -1;
+
+    // Scale the tables as libjpeg does, and fold in the AAN scale factors
+    h->quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    q = h->quality < 50 ? 5000 / h->quality : 200 - 2 * h->quality;
+    for (t = 0; t < 2; t++) {
+        for (i = 0; i < 64; i++) {
+            h->qtable[t][i] = (_jpeg_quant[t][i] * q + 50) / 100 < 1 ? 1 :
+                              (_jpeg_quant[t][i] * q + 50) / 100 > 255 ? 255 :
+                              (_jpeg_quant[t][i] * q + 50) / 100;
+            h->divisors[t][i] = 1.0f / (h->qtable[t][i] * aan[i / 8] * aan[i % 8] * 8.0f);
+        }
+    }
+
+    CLEAR(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (address != NULL && 1 != inet_pton(AF_INET, address, &addr.sin_addr)) {
+        fprintf(stderr, "Invalid address '%s'\n", address);
+        free(h);
+        return NULL;
+    }
+
+    h->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == h->fd ||
+        -1 == setsockopt(h->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        -1 == bind(h->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == listen(h->fd, 16) ||
+        -1 == getsockname(h->fd, (struct sockaddr *)&addr, &length) ||
+        -1 == pipe2(h->wake, O_NONBLOCK | O_CLOEXEC)) {
+        fprintf(stderr, "Cannot listen on port %u: %d, %s\n", port, errno, strerror(errno));
+        if (h->fd != -1) close(h->fd);
+        free(h);
+        return NULL;
+    }
+    h->port = ntohs(addr.sin_port);
+
+    pthread_mutex_init(&h->mtx_streams, NULL);
+    pthread_mutex_init(&h->mtx_jobs, NULL);
+    sem_init(&h->work, 0, 0);
+    h->running = true;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    h->nworkers = cpus < 1 ? 1 : cpus > 64 ? 64 : cpus;
+    h->workers = calloc(h->nworkers, sizeof(pthread_t));
+    for (i = 0; h->workers != NULL && i < h->nworkers; i++) {
+        pthread_create(&h->workers[i], NULL, jpeg_encoding, (void *)h);
+    }
+    if (h->workers == NULL) h->nworkers = 0;
+
+    pthread_create(&h->thread, NULL, http_serving, (void *)h);
+
+    return h;
+}
+
+/**
+ * Adds an MJPEG stream to the server at /<index>, fed by pushing
+ * frames to its sink
+ */
+webcam_http_stream_t *webcam_http_stream_open(webcam_http_t *h, uint8_t index)
+{
+    webcam_http_stream_t *s;
+
+    s = calloc(1, sizeof(webcam_http_stream_t));
+    if (s == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    s->sink.push = http_push;
+    s->server = h;
+    s->index = index;
+    sem_init(&s->pending, 0, 0);
+    sem_init(&s->job.done, 0, 0);
+    pthread_mutex_init(&s->mtx_current, NULL);
+    pthread_create(&s->thread, NULL, http_encoding, (void *)s);
+
+    pthread_mutex_lock(&h->mtx_streams);
+    s->next = h->streams;
+    h->streams = s;
+    pthread_mutex_unlock(&h->mtx_streams);
+
+    return s;
+}
+
+/**
+ * Serves the webcam's frames as an MJPEG stream at /<webcam index>
+ */
+webcam_http_stream_t *webcam_http_serve(webcam_http_t *h, webcam_t *w)
+{
+    webcam_http_stream_t *s = webcam_http_stream_open(h, w->index);
+
+    if (s != NULL) {
+        s->webcam = w;
+        webcam_sink_add(w, &s->sink);
+    }
+
+    return s;
+}
+
+/**
+ * Closes the server: detaches the streams from their webcams, and
+ * disconnects all clients
+ */
+void webcam_http_close(webcam_http_t *h)
+{
+    webcam_http_stream_t *s;
+    int i;
+
+    for (s = h->streams; s != NULL; s = s->next) {
+        if (s->webcam != NULL) webcam_sink_remove(s->webcam, &s->sink);
+    }
+
+    __atomic_store_n(&h->running, false, __ATOMIC_RELEASE);
+    if (-1 == write(h->wake[1], "", 1)) {
+        fprintf(stderr, "Cannot wake the HTTP server: %d, %s\n", errno, strerror(errno));
+    }
+    pthread_join(h->thread, NULL);
+
+    // Streams finish the frame they are encoding with the workers' help
+    for (s = h->streams; s != NULL; s = s->next) {
+        sem_post(&s->pending);
+        pthread_join(s->thread, NULL);
+    }
+    for (i = 0; i < h->nworkers; i++) sem_post(&h->work);
+    for (i = 0; i < h->nworkers; i++) pthread_join(h->workers[i], NULL);
+
+    for (i = 0; i < WEBCAM_HTTP_CLIENTS; i++) {
+        if (h->clients[i].fd != -1) _http_drop(&h->clients[i]);
+    }
+
+    while ((s = h->streams) != NULL) {
+        h->streams = s->next;
+        for (i = 0; i < s->nstrips; i++) free(s->job.out[i].start);
+        free(s->job.out);
+        free(s->job.capacity);
+        free(s->staging.start);
+        webcam_jpeg_release(s->current);
+        sem_destroy(&s->pending);
+        sem_destroy(&s->job.done);
+        pthread_mutex_destroy(&s->mtx_current);
+        free(s);
+    }
+
+    sem_destroy(&h->work);
+    pthread_mutex_destroy(&h->mtx_streams);
+    pthread_mutex_destroy(&h->mtx_jobs);
+    free(h->workers);
+    close(h->wake[0]);
+    close(h->wake[1]);
+    close(h->fd);
+    free(h);
+}
+
+/**
+ * Private function swapping YUYV into the Cb Y Cr Y order of RFC 4175,
+ * or back, as the swap is its own inverse
+ */
+static void _rtp_swizzle(const uint8_t *src, uint8_t *dst, size_t length)
+{
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i + 4 <= length; i += 4) {
+        memcpy(&v, src + i, 4);
+        v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+        memcpy(dst + i, &v, 4);
+    }
+}
+
+/**
+ * Private function laying out the messages of a slot: runs of full
+ * packets up to the end of a line become one GSO message each, at most
+ * WEBCAM_RTP_SEGMENTS datagrams long; without GSO every packet is a
+ * message of its own
+ */
+static void _rtp_messages(webcam_rtp_t *r, webcam_rtp_slot_t *slot)
+{
+    size_t stride = WEBCAM_RTP_HEADER + r->chunk, line = (size_t)r->width * 2, length;
+    struct cmsghdr *cmsg;
+    struct mmsghdr *m = NULL;
+    uint32_t i, k, segments = 0, most = 65000 / stride;
+
+    slot->nmessages = 0;
+    memset(slot->messages, 0, r->npackets * sizeof(struct mmsghdr));
+
+    for (i = 0; i < r->npackets; i++) {
+        k = i % r->per_line;
+        length = WEBCAM_RTP_HEADER + (k + 1 < r->per_line ? r->chunk : line - (size_t)k * r->chunk);
+
+        // GSO takes up to 64 KB per message
+        if (m == NULL || !r->gso || segments == WEBCAM_RTP_SEGMENTS || segments == most) {
+            m = &slot->messages[slot->nmessages];
+            slot->iov[slot->nmessages].iov_base = slot->packets + i * stride;
+            slot->iov[slot->nmessages].iov_len = 0;
+            m->msg_hdr.msg_iov = &slot->iov[slot->nmessages];
+            m->msg_hdr.msg_iovlen = 1;
+
+            if (r->gso) {
+                m->msg_hdr.msg_control = slot->control + slot->nmessages * CMSG_SPACE(sizeof(uint16_t));
+                m->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                cmsg = CMSG_FIRSTHDR(&m->msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t *)CMSG_DATA(cmsg) = stride;
+            }
+
+            slot->nmessages++;
+            segments = 0;
+        }
+
+        m->msg_hdr.msg_iov->iov_len += length;
+        segments++;
+
+        // Only the last datagram of a message may be shorter
+        if (length < stride) m = NULL;
+    }
+}
+
+/**
+ * The loop function for the RTP sender thread
+ *
+ * Sends every filled slot with as few sendmmsg calls as the kernel
+ * allows, falling back to one datagram per message when the network
+ * stack turns GSO down.
+ */
+static void *rtp_sending(void *ptr)
+{
+    webcam_rtp_t *r = (webcam_rtp_t *)ptr;
+    webcam_rtp_slot_t *slot;
+    uint32_t sent, i;
+    size_t bytes;
+    int n;
+
+    for (;;) {
+        while (-1 == sem_wait(&r->pending) && EINTR == errno);
+
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+            if (!__atomic_load_n(&r->running, __ATOMIC_ACQUIRE)) break;
+            continue;
+        }
+
+        slot = &r->slots[r->tail % r->nslots];
+        for (sent = 0, bytes = 0; sent < slot->nmessages; sent += n) {
+            n = sendmmsg(r->fd, slot->messages + sent, slot->nmessages - sent, 0);
+            __atomic_fetch_add(&r->syscalls, 1, __ATOMIC_RELAXED);
+            if (n > 0) {
+                for (i = sent; i < sent + n; i++) bytes += slot->messages[i].msg_len;
+                continue;
+            }
+
+            n = 0;
+            if (EINTR == errno) continue;
+            if (r->gso && sent == 0 && (EIO == errno || EINVAL == errno)) {
+                r->gso = false;
+                for (i = 0; i < r->nslots; i++) _rtp_messages(r, &r->slots[i]);
+                continue;
+            }
+
+            // Nobody listening yet is not worth a message per frame
+            if (ECONNREFUSED != errno) {
+                fprintf(stderr, "Error while sending RTP: %d, %s\n", errno, strerror(errno));
+            }
+            break;
+        }
+
+        __atomic_fetch_add(&r->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&r->packets, r->npackets, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&r->frames, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Private sink function packetizing a frame into the next free slot, or
+ * dropping it when the sender has fallen behind
+ *
+ * Every packet carries the RTP header, the extended sequence number
+ * and a single sample row header, then up to one chunk of a line.
+ */
+static void rtp_push(webcam_sink_t *s, const webcam_frame_t *f)
+{
+    webcam_rtp_t *r = (webcam_rtp_t *)s;
+    size_t line = (size_t)r->width * 2, stride = WEBCAM_RTP_HEADER + r->chunk;
+    uint32_t timestamp = f->timestamp * 9 / 100000, seq, offset, length;
+    const uint8_t *src;
+    uint8_t *p;
+    uint16_t y, k;
+
+    if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->nslots ||
+        f->width != r->width || f->height != r->height || f->raw.length < line * r->height) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    p = r->slots[r->head % r->nslots].packets;
+    for (y = 0; y < r->height; y++) {
+        src = f->raw.start + y * line;
+
+        for (k = 0, offset = 0; k < r->per_line; k++, offset += length, p += stride) {
+            length = k + 1 < r->per_line ? r->chunk : line - offset;
+            seq = r->sequence++;
+
+            p[0] = 0x80;
+            p[1] = 96 | (y + 1 == r->height && k + 1 == r->per_line ? 0x80 : 0);
+            p[2] = seq >> 8;
+            p[3] = seq;
+            p[4] = timestamp >> 24;
+            p[5] = timestamp >> 16;
+            p[6] = timestamp >> 8;
+            p[7] = timestamp;
+            p[8] = r->ssrc >> 24;
+            p[9] = r->ssrc >> 16;
+            p[10] = r->ssrc >> 8;
+            p[11] = r->ssrc;
+            p[12] = seq >> 24;
+            p[13] = seq >> 16;
+
+            // Length, field and line number, continuation and pixel offset
+            p[14] = length >> 8;
+            p[15] = length;
+            p[16] = (y >> 8) & 0x7f;
+            p[17] = y;
+            p[18] = (offset / 2 >> 8) & 0x7f;
+            p[19] = offset / 2;
+
+            _rtp_swizzle(src + offset, p + WEBCAM_RTP_HEADER, length);
+        }
+    }
+
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    sem_post(&r->pending);
+}
+
+/**
+ * Opens an RTP sender for frames of the given size to address:port
+ *
+ * Lines are split into the fewest packets that fit the datagram size,
+ * all of the same length where the line allows it, so GSO can send
+ * long runs of them at once.
+ */
+webcam_rtp_t *webcam_rtp_open(const char *address, uint16_t port, uint16_t width, uint16_t height,
+                              uint8_t nslots)
+{
+    webcam_rtp_t *r;
+    webcam_rtp_slot_t *slot;
+    struct sockaddr_in addr;
+    size_t line = (size_t)width * 2;
+    int size = 4 << 20, segment = 1;
+    uint8_t i;
+
+    if (nslots == 0) {
+        fprintf(stderr, "An RTP sender needs at least one slot\n");
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(webcam_rtp_t));
+    if (r == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    r->sink.push = rtp_push;
+    r->width = width;
+    r->height = height;
+    r->ssrc = (uint32_t)_now() ^ ((uint32_t)getpid() << 16);
+    r->per_line = (line + WEBCAM_RTP_DATAGRAM - WEBCAM_RTP_HEADER - 1) / (WEBCAM_RTP_DATAGRAM - WEBCAM_RTP_HEADER);
+    r->chunk = ((line + r->per_line - 1) / r->per_line + 3) & ~3u;
+    r->npackets = (uint32_t)r->per_line * height;
+
+    CLEAR(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (1 != inet_pton(AF_INET, address, &addr.sin_addr)) {
+        fprintf(stderr, "Invalid address '%s'\n", address);
+        free(r);
+        return NULL;
+    }
+
+    r->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == r->fd || -1 == connect(r->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Cannot send to %s:%u: %d, %s\n", address, port, errno, strerror(errno));
+        if (r->fd != -1) close(r->fd);
+        free(r);
+        return NULL;
+    }
+
+    // A whole frame goes out in one burst; fails quietly without privileges
+    if (-1 == setsockopt(r->fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size))) {
+        setsockopt(r->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    r->gso = 0 == setsockopt(r->fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+    segment = 0;
+    if (r->gso) setsockopt(r->fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+
+    r->nslots = nslots;
+    r->slots = calloc(nslots, sizeof(webcam_rtp_slot_t));
+    for (i = 0; r->slots != NULL && i < nslots; i++) {
+        slot = &r->slots[i];
+        slot->packets = malloc((size_t)r->npackets * (WEBCAM_RTP_HEADER + r->chunk));
+        slot->messages = malloc(r->npackets * sizeof(struct mmsghdr));
+        slot->iov = malloc(r->npackets * sizeof(struct iovec));
+        slot->control = calloc(r->npackets, CMSG_SPACE(sizeof(uint16_t)));
+        if (slot->packets == NULL || slot->messages == NULL || slot->iov == NULL || slot->control == NULL) break;
+
+        _rtp_messages(r, slot);
+    }
+
+    if (r->slots == NULL || i < nslots) {
+        fprintf(stderr, "Out of memory\n");
+        webcam_rtp_close(r);
+        return NULL;
+    }
+
+    sem_init(&r->pending, 0, 0);
+    r->running = true;
+    pthread_create(&r->thread, NULL, rtp_sending, (void *)r);
+
+    return r;
+}
+
+/**
+ * Closes the RTP sender, after the frames in flight have been sent
+ */
+void webcam_rtp_close(webcam_rtp_t *r)
+{
+    uint8_t i;
+
+    if (r->running) {
+        __atomic_store_n(&r->running, false, __ATOMIC_RELEASE);
+        sem_post(&r->pending);
+        pthread_join(r->thread, NULL);
+        sem_destroy(&r->pending);
+    }
+
+    for (i = 0; r->slots != NULL && i < r->nslots; i++) {
+        free(r->slots[i].packets);
+        free(r->slots[i].messages);
+        free(r->slots[i].iov);
+        free(r->slots[i].control);
+    }
+    free(r->slots);
+
+    close(r->fd);
+    free(r);
+}
+
+/**
+ * Starts sending the webcam's frames to address:port over RTP
+ *
+ * The webcam needs to be resized first, so the frame size is known.
+ */
+webcam_rtp_t *webcam_rtp(webcam_t *w, const char *address, uint16_t port)
+{
+    webcam_rtp_t *r = webcam_rtp_open(address, port, w->width, w->height, 4);
+
+    if (r != NULL) webcam_sink_add(w, &r->sink);
+
+    return r;
+}
+
+/**
+ * Stops sending and closes the RTP sender
+ */
+void webcam_rtp_stop(webcam_t *w, webcam_rtp_t *r)
+{
+    webcam_sink_remove(w, &r->sink);
+    webcam_rtp_close(r);
+}
+
+/**
+ * Private function placing the lines of one packet in the frame, and
+ * handing the frame on when its last packet arrives
+ */
+static void _rtp_packet(webcam_rtp_receiver_t *r, const uint8_t *p, size_t length)
+{
+    const uint8_t *srd = p + 14, *data, *end = p + length;
+    uint32_t seq, timestamp;
+    size_t line = (size_t)r->width * 2, n, offset;
+    webcam_frame_t f;
+    uint16_t y;
+
+    if (length < WEBCAM_RTP_HEADER || (p[0] & 0xc0) != 0x80) return;
+
+    seq = (uint32_t)p[12] << 24 | (uint32_t)p[13] << 16 | (uint32_t)p[2] << 8 | p[3];
+    timestamp = (uint32_t)p[4] << 24 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+
+    r->packets++;
+    if (r->started && (int32_t)(seq - r->expected) > 0) r->lost += seq - r->expected;
+    if (!r->started || (int32_t)(seq - r->expected) >= 0) r->expected = seq + 1;
+    r->started = true;
+
+    // A new timestamp before the marker means the last packets were lost
+    if (timestamp != r->timestamp) {
+        if (r->received > 0) r->incomplete++;
+        r->received = 0;
+        r->timestamp = timestamp;
+    }
+
+    // The row headers come first, then the data of every row in turn
+    for (data = srd; data + 6 <= end && (data[4] & 0x80); data += 6);
+    data += 6;
+
+    for (; srd + 6 <= end && data <= end; srd += 6) {
+        n = (size_t)srd[0] << 8 | srd[1];
+        y = (srd[2] & 0x7f) << 8 | srd[3];
+        offset = ((size_t)(srd[4] & 0x7f) << 8 | srd[5]) * 2;
+
+        if (y < r->height && offset + n <= line && data + n <= end) {
+            _rtp_swizzle(data, r->frame.start + y * line + offset, n);
+            r->received += n;
+        }
+        data += n;
+
+        if (!(srd[4] & 0x80)) break;
+    }
+
+    if (!(p[1] & 0x80)) return;
+
+    if (r->received == r->frame.length) {
+        r->frames++;
+        if (r->sink != NULL) {
+            CLEAR(f);
+            f.raw = r->frame;
+            f.sequence = r->frames;
+            f.timestamp = (uint64_t)timestamp * 100000 / 9;
+            f.width = r->width;
+            f.height = r->height;
+            r->sink->push(r->sink, &f);
+        }
+    } else {
+        r->incomplete++;
+    }
+    r->received = 0;
+}
+
+/**
+ * The loop function for the RTP receiver thread
+ *
+ * Takes up to WEBCAM_RTP_BATCH messages per recvmmsg; with GRO every
+ * message may hold several datagrams of the size given alongside.
+ */
+static void *rtp_receiving(void *ptr)
+{
+    webcam_rtp_receiver_t *r = (webcam_rtp_receiver_t *)ptr;
+    size_t size = r->gro ? 65536 : 2048, segment, offset;
+    struct cmsghdr *cmsg;
+    struct msghdr *h;
+    int i, n;
+
+    while (__atomic_load_n(&r->running, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < WEBCAM_RTP_BATCH; i++) {
+            r->iov[i].iov_base = r->buffers + i * size;
+            r->iov[i].iov_len = size;
+            h = &r->messages[i].msg_hdr;
+            memset(h, 0, sizeof(*h));
+            h->msg_iov = &r->iov[i];
+            h->msg_iovlen = 1;
+            h->msg_control = r->control + i * CMSG_SPACE(sizeof(int));
+            h->msg_controllen = CMSG_SPACE(sizeof(int));
+        }
+
+        n = recvmmsg(r->fd, r->messages, WEBCAM_RTP_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+        __atomic_fetch_add(&r->syscalls, 1, __ATOMIC_RELAXED);
+
+        for (i = 0; i < n; i++) {
+            h = &r->messages[i].msg_hdr;
+            segment = r->messages[i].msg_len;
+            for (cmsg = CMSG_FIRSTHDR(h); cmsg != NULL; cmsg = CMSG_NXTHDR(h, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    segment = *(int *)CMSG_DATA(cmsg);
+                }
+            }
+            if (segment == 0) continue;
+
+            for (offset = 0; offset < r->messages[i].msg_len; offset += segment) {
+                _rtp_packet(r, r->buffers + i * size + offset,
+                            r->messages[i].msg_len - offset < segment ? r->messages[i].msg_len - offset : segment);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens an RTP receiver for frames of the given size on a UDP port, 0
+ * for any free port (see r->port)
+ *
+ * Completed frames are pushed to the sink, from the receiver's thread,
+ * with the raw YUYV frame only.
+ */
+webcam_rtp_receiver_t *webcam_rtp_receiver_open(uint16_t port, uint16_t width, uint16_t height,
+                                                webcam_sink_t *sink)
+{
+    webcam_rtp_receiver_t *r;
+    struct sockaddr_in addr;
+    struct timeval timeout = { 0, 100000 };
+    socklen_t length = sizeof(addr);
+    int size = 16 << 20, one = 1;
+
+    r = calloc(1, sizeof(webcam_rtp_receiver_t));
+    if (r == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    r->sink = sink;
+    r->width = width;
+    r->height = height;
+
+    CLEAR(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    r->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == r->fd ||
+        -1 == bind(r->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == getsockname(r->fd, (struct sockaddr *)&addr, &length) ||
+        -1 == setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+        fprintf(stderr, "Cannot receive on port %u: %d, %s\n", port, errno, strerror(errno));
+        if (r->fd != -1) close(r->fd);
+        free(r);
+        return NULL;
+    }
+    r->port = ntohs(addr.sin_port);
+
+    if (-1 == setsockopt(r->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))) {
+        setsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    r->gro = 0 == setsockopt(r->fd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+
+    r->frame.length = (size_t)width * height * 2;
+    r->frame.start = calloc(r->frame.length, sizeof(uint8_t));
+    r->buffers = malloc(WEBCAM_RTP_BATCH * (r->gro ? 65536 : 2048));
+    r->messages = calloc(WEBCAM_RTP_BATCH, sizeof(struct mmsghdr));
+    r->iov = calloc(WEBCAM_RTP_BATCH, sizeof(struct iovec));
+    r->control = calloc(WEBCAM_RTP_BATCH, CMSG_SPACE(sizeof(int)));
+    if (r->frame.start == NULL || r->buffers == NULL || r->messages == NULL ||
+        r->iov == NULL || r->control == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        webcam_rtp_receiver_close(r);
+        return NULL;
+    }
+
+    r->running = true;
+    pthread_create(&r->thread, NULL, rtp_receiving, (void *)r);
+
+    return r;
+}
+
+/**
+ * Closes the RTP receiver
+ */
+void webcam_rtp_receiver_close(webcam_rtp_receiver_t *r)
+{
+    if (r->running) {
+        __atomic_store_n(&r->running, false, __ATOMIC_RELEASE);
+        pthread_join(r->thread, NULL);
+    }
+
+    free(r->frame.start);
+    free(r->buffers);
+    free(r->messages);
+    free(r->iov);
+    free(r->control);
+
+    close(r->fd);
+    free(r);
+}
+
+/**
+ * Private function filling in the address of a local socket, where a
+ * leading '@' picks the abstract namespace
+ */
+static socklen_t _local_address(const char *path, struct sockaddr_un *addr)
+{
+    size_t n = strlen(path);
+
+    CLEAR(*addr);
+    addr->sun_family = AF_UNIX;
+    if (n >= sizeof(addr->sun_path)) n = sizeof(addr->sun_path) - 1;
+    memcpy(addr->sun_path, path, n);
+    if (path[0] == '@') addr->sun_path[0] = '\0';
+
+    return offsetof(struct sockaddr_un, sun_path) + n + (path[0] == '@' ? 0 : 1);
+}
+
+/**
+ * Private function finding the view that serves a hello, or setting up
+ * a new one on a fresh memfd; NULL when the format is unknown or the
+ * region lies outside the frame. Called with mtx_clients held.
+ */
+static webcam_local_view_t *_local_view(webcam_local_t *l, const webcam_local_hello_t *hello)
+{
+    webcam_local_view_t *v, *unused = NULL;
+    uint16_t x = hello->x, y = hello->y, width, height;
+    uint32_t bpp;
+    int i;
+
+    if (hello->format == V4L2_PIX_FMT_YUYV) {
+        bpp = 2;
+        x &= ~1;
+    } else if (hello->format == V4L2_PIX_FMT_RGB24) {
+        bpp = 3;
+    } else {
+        return NULL;
+    }
+
+    if (x >= l->width || y >= l->height) return NULL;
+    width = hello->width == 0 || x + hello->width > l->width ? l->width - x : hello->width;
+    height = hello->height == 0 || y + hello->height > l->height ? l->height - y : hello->height;
+    if (bpp == 2) width &= ~1;
+    if (width == 0) return NULL;
+
+    for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) {
+        v = &l->views[i];
+        if (v->clients == 0) {
+            if (unused == NULL) unused = v;
+            continue;
+        }
+        if (v->format == hello->format && v->x == x && v->y == y && v->width == width && v->height == height) {
+            return v;
+        }
+    }
+    if (unused == NULL) return NULL;
+
+    v = unused;
+    if (v->map != NULL) {
+        munmap(v->map, v->length);
+        close(v->fd);
+        v->map = NULL;
+    }
+
+    v->format = hello->format;
+    v->x = x;
+    v->y = y;
+    v->width = width;
+    v->height = height;
+    v->stride = width * bpp;
+    v->data = _page_align(l->nslots * sizeof(uint64_t));
+    v->slot_size = _page_align((size_t)v->stride * height);
+    v->length = v->data + l->nslots * v->slot_size;
+    v->next = 0;
+
+    v->fd = memfd_create("webcam", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (-1 == v->fd || -1 == ftruncate(v->fd, v->length) ||
+        MAP_FAILED == (v->map = mmap(NULL, v->length, PROT_READ | PROT_WRITE, MAP_SHARED, v->fd, 0))) {
+        fprintf(stderr, "Cannot set up a view: %d, %s\n", errno, strerror(errno));
+        if (v->fd != -1) close(v->fd);
+        v->map = NULL;
+        return NULL;
+    }
+
+    // Clients can neither resize the memfd nor map it writable
+    fcntl(v->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+    fcntl(v->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+    memset(v->map, 0xff, l->nslots * sizeof(uint64_t));
+
+    return v;
+}
+
+/**
+ * Private function disconnecting a client. Called with mtx_clients held.
+ */
+static void _local_drop(webcam_local_client_t *c)
+{
+    if (c->view != NULL) c->view->clients--;
+    close(c->fd);
+    CLEAR(*c);
+    c->fd = -1;
+}
+
+/**
+ * Private function answering the hello of a client with a welcome and
+ * a read-only descriptor of its view. Called with mtx_clients held, so
+ * no frame message can overtake the welcome.
+ */
+static void _local_hello(webcam_local_t *l, webcam_local_client_t *c)
+{
+    webcam_local_hello_t hello;
+    webcam_local_welcome_t welcome;
+    webcam_local_view_t *v = NULL;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char            buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    char path[64];
+    ssize_t n;
+    int fd = -1;
+
+    n = recv(c->fd, &hello, sizeof(hello), MSG_DONTWAIT);
+    if (n == -1 && (EAGAIN == errno || EINTR == errno)) return;
+    if (n <= 0) {
+        _local_drop(c);
+        return;
+    }
+
+    CLEAR(welcome);
+    welcome.magic = WEBCAM_LOCAL_MAGIC;
+    if (n != sizeof(hello) || hello.magic != WEBCAM_LOCAL_MAGIC) {
+        welcome.status = EPROTO;
+    } else if ((v = _local_view(l, &hello)) == NULL) {
+        welcome.status = EINVAL;
+    } else {
+        welcome.format = v->format;
+        welcome.x = v->x;
+        welcome.y = v->y;
+        welcome.width = v->width;
+        welcome.height = v->height;
+        welcome.stride = v->stride;
+        welcome.nslots = l->nslots;
+        welcome.data = v->data;
+        welcome.slot_size = v->slot_size;
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", v->fd);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    CLEAR(msg);
+    iov.iov_base = &welcome;
+    iov.iov_len = sizeof(welcome);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (v != NULL) {
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fd != -1 ? &fd : &v->fd, sizeof(int));
+    }
+
+    n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (fd != -1) close(fd);
+
+    if (n != sizeof(welcome) || v == NULL) {
+        _local_drop(c);
+        return;
+    }
+
+    c->view = v;
+    v->clients++;
+}
+
+/**
+ * The loop function for the local server thread
+ *
+ * Accepts clients, answers their hellos, and notices when they leave.
+ */
+static void *local_serving(void *ptr)
+{
+    webcam_local_t *l = (webcam_local_t *)ptr;
+    struct pollfd fds[2 + WEBCAM_LOCAL_CLIENTS];
+    webcam_local_client_t *c;
+    char drain[64];
+    int i, fd;
+
+    for (;;) {
+        fds[0].fd = l->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = l->wake[0];
+        fds[1].events = POLLIN;
+
+        pthread_mutex_lock(&l->mtx_clients);
+        for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) {
+            fds[2 + i].fd = l->clients[i].fd;
+            fds[2 + i].events = POLLIN;
+            fds[2 + i].revents = 0;
+        }
+        pthread_mutex_unlock(&l->mtx_clients);
+
+        if (-1 == poll(fds, 2 + WEBCAM_LOCAL_CLIENTS, -1) && EINTR != errno) break;
+        if (!__atomic_load_n(&l->running, __ATOMIC_ACQUIRE)) break;
+
+        if (fds[1].revents & POLLIN) {
+            while (read(l->wake[0], drain, sizeof(drain)) > 0);
+        }
+
+        pthread_mutex_lock(&l->mtx_clients);
+        if (fds[0].revents & POLLIN) {
+            fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            for (i = 0; fd != -1 && i < WEBCAM_LOCAL_CLIENTS && l->clients[i].fd != -1; i++);
+            if (i < WEBCAM_LOCAL_CLIENTS) {
+                l->clients[i].fd = fd;
+            } else if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) {
+            c = &l->clients[i];
+            if (c->fd == -1 || fds[2 + i].fd != c->fd || fds[2 + i].revents == 0) continue;
+
+            if (c->view == NULL && (fds[2 + i].revents & POLLIN)) {
+                _local_hello(l, c);
+            } else if (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                // Clients only ever speak once, so anything else is a goodbye
+                _local_drop(c);
+            }
+        }
+        pthread_mutex_unlock(&l->mtx_clients);
+    }
+
+    return NULL;
+}
+
+/**
+ * Private sink function writing a frame into every view that has
+ * clients, and telling each client where to find it
+ *
+ * Slot sequence numbers are updated seqlock style around the copy.
+ * Clients whose socket is full skip the frame.
+ */
+static void local_push(webcam_sink_t *s, const webcam_frame_t *f)
+{
+    webcam_local_t *l = (webcam_local_t *)s;
+    webcam_local_message_t m;
+    webcam_local_client_t *c;
+    webcam_local_view_t *v;
+    const uint8_t *src;
+    uint64_t *sequences;
+    uint32_t bpp, slot, row;
+    bool written[WEBCAM_LOCAL_CLIENTS];
+    int i;
+
+    if (f->width != l->width || f->height != l->height) return;
+
+    pthread_mutex_lock(&l->mtx_clients);
+    for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) {
+        v = &l->views[i];
+        bpp = v->format == V4L2_PIX_FMT_YUYV ? 2 : 3;
+        src = bpp == 2 ? f->raw.start : f->rgb.start;
+        written[i] = v->clients > 0 && src != NULL &&
+                     (bpp == 2 ? f->raw.length : f->rgb.length) >= (size_t)l->width * l->height * bpp;
+        if (!written[i]) continue;
+
+        slot = v->next % l->nslots;
+        sequences = (uint64_t *)v->map;
+        __atomic_store_n(&sequences[slot], WEBCAM_LOCAL_WRITING, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        for (row = 0; row < v->height; row++) {
+            memcpy(v->map + v->data + slot * v->slot_size + (size_t)row * v->stride,
+                   src + ((size_t)(v->y + row) * l->width + v->x) * bpp, v->stride);
+        }
+
+        __atomic_store_n(&sequences[slot], l->frames, __ATOMIC_RELEASE);
+        v->next++;
+    }
+
+    for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) {
+        c = &l->clients[i];
+        if (c->fd == -1 || c->view == NULL || !written[c->view - l->views]) continue;
+
+        v = c->view;
+        CLEAR(m);
+        m.sequence = l->frames;
+        m.timestamp = f->timestamp;
+        m.slot = (v->next - 1) % l->nslots;
+        m.offset = v->data + m.slot * v->slot_size;
+        m.length = (size_t)v->stride * v->height;
+
+        if (sizeof(m) == send(c->fd, &m, sizeof(m), MSG_DONTWAIT | MSG_NOSIGNAL)) {
+            c->frames++;
+        } else {
+            c->skipped++;
+        }
+    }
+    l->frames++;
+    pthread_mutex_unlock(&l->mtx_clients);
+}
+
+/**
+ * Opens a local frame server for frames of the given size on a Unix
+ * socket at path, or in the abstract namespace when path starts with
+ * '@'. Every view keeps nslots frames.
+ */
+webcam_local_t *webcam_local_open(const char *path, uint16_t width, uint16_t height, uint8_t nslots)
+{
+    webcam_local_t *l;
+    struct sockaddr_un addr;
+    struct stat st;
+    socklen_t length;
+    int i;
+
+    l = calloc(1, sizeof(webcam_local_t));
+    if (l == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    l->sink.push = local_push;
+    snprintf(l->path, sizeof(l->path), "%s", path);
+    l->width = width;
+    l->height = height;
+    l->nslots = nslots < 2 ? 2 : nslots;
+    for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) l->clients[i].fd = -1;
+
+    // Replace a socket left behind, but nothing else
+    if (path[0] != '@' && 0 == stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+
+    length = _local_address(path, &addr);
+    l->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == l->fd ||
+        -1 == bind(l->fd, (struct sockaddr *)&addr, length) ||
+        -1 == listen(l->fd, 16) ||
+        -1 == pipe2(l->wake, O_NONBLOCK | O_CLOEXEC)) {
+        fprintf(stderr, "Cannot listen on '%s': %d, %s\n", path, errno, strerror(errno));
+        if (l->fd != -1) close(l->fd);
+        free(l);
+        return NULL;
+    }
+
+    pthread_mutex_init(&l->mtx_clients, NULL);
+    l->running = true;
+    pthread_create(&l->thread, NULL, local_serving, (void *)l);
+
+    return l;
+}
+
+/**
+ * Closes the local frame server, disconnecting all clients
+ */
+void webcam_local_close(webcam_local_t *l)
+{
+    int i;
+
+    __atomic_store_n(&l->running, false, __ATOMIC_RELEASE);
+    if (-1 == write(l->wake[1], "", 1)) {
+        fprintf(stderr, "Cannot wake the local server: %d, %s\n", errno, strerror(errno));
+    }
+    pthread_join(l->thread, NULL);
+
+    for (i = 0; i < WEBCAM_LOCAL_CLIENTS; i++) {
+        if (l->clients[i].fd != -1) _local_drop(&l->clients[i]);
+        if (l->views[i].map != NULL) {
+            munmap(l->views[i].map, l->views[i].length);
+            close(l->views[i].fd);
+        }
+    }
+
+    pthread_mutex_destroy(&l->mtx_clients);
+    close(l->wake[0]);
+    close(l->wake[1]);
+    close(l->fd);
+    if (l->path[0] != '@') unlink(l->path);
+    free(l);
+}
+
+/**
+ * Starts serving the webcam's frames to local clients at path
+ *
+ * The webcam needs to be resized first, so the frame size is known.
+ */
+webcam_local_t *webcam_local(webcam_t *w, const char *path)
+{
+    webcam_local_t *l = webcam_local_open(path, w->width, w->height, 4);
+
+    if (l != NULL) webcam_sink_add(w, &l->sink);
+
+    return l;
+}
+
+/**
+ * Stops serving and closes the local frame server
+ */
+void webcam_local_stop(webcam_t *w, webcam_local_t *l)
+{
+    webcam_sink_remove(w, &l->sink);
+    webcam_local_close(l);
+}
+
+/**
+ * Connects to a local frame server, asking for frames in the given
+ * format (V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_RGB24) and region, where a
+ * width or height of 0 stands for the rest of the frame
+ *
+ * The region actually served is in c->welcome.
+ */
+webcam_local_connection_t *webcam_local_connect(const char *path, uint32_t format, uint16_t x, uint16_t y,
+                                                uint16_t width, uint16_t height)
+{
+    webcam_local_connection_t *c;
+    webcam_local_hello_t hello;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char            buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    int fd = -1;
+
+    c = calloc(1, sizeof(webcam_local_connection_t));
+    if (c == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    CLEAR(hello);
+    hello.magic = WEBCAM_LOCAL_MAGIC;
+    hello.format = format;
+    hello.x = x;
+    hello.y = y;
+    hello.width = width;
+    hello.height = height;
+
+    CLEAR(msg);
+    iov.iov_base = &c->welcome;
+    iov.iov_len = sizeof(c->welcome);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (-1 == c->fd ||
+        -1 == connect(c->fd, (struct sockaddr *)&addr, _local_address(path, &addr)) ||
+        sizeof(hello) != send(c->fd, &hello, sizeof(hello), MSG_NOSIGNAL) ||
+        sizeof(c->welcome) != recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC)) {
+        fprintf(stderr, "Cannot connect to '%s': %d, %s\n", path, errno, strerror(errno));
+        webcam_local_disconnect(c);
+        return NULL;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (c->welcome.status != 0 || fd == -1) {
+        fprintf(stderr, "Refused by '%s': %s\n", path, strerror(c->welcome.status ? c->welcome.status : EPROTO));
+        if (fd != -1) close(fd);
+        webcam_local_disconnect(c);
+        return NULL;
+    }
+
+    c->length = c->welcome.data + c->welcome.nslots * c->welcome.slot_size;
+    c->map = mmap(NULL, c->length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c->map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map the frames of '%s': %d, %s\n", path, errno, strerror(errno));
+        c->map = NULL;
+        webcam_local_disconnect(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/**
+ * Waits for the next frame, and returns it in place in the shared
+ * memory; NULL when the server went away
+ *
+ * The frame stays intact until nslots more frames have been written,
+ * which webcam_local_valid() tells after using it.
+ */
+const uint8_t *webcam_local_next(webcam_local_connection_t *c, webcam_local_message_t *m)
+{
+    ssize_t n;
+
+    do {
+        n = recv(c->fd, m, sizeof(*m), 0);
+    } while (n == -1 && EINTR == errno);
+
+    if (n != sizeof(*m) || m->slot >= c->welcome.nslots) return NULL;
+
+    return c->map + m->offset;
+}
+
+/**
+ * Tells whether the frame of a message has not been overwritten yet
+ */
+bool webcam_local_valid(webcam_local_connection_t *c, const webcam_local_message_t *m)
+{
+    const uint64_t *sequences = (const uint64_t *)c->map;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&sequences[m->slot], __ATOMIC_RELAXED) == m->sequence;
+}
+
+/**
+ * Disconnects from the local frame server
+ */
+void webcam_local_disconnect(webcam_local_connection_t *c)
+{
+    if (c->map != NULL) munmap(c->map, c->length);
+    if (c->fd != -1) close(c->fd);
+    free(c);
+}
+
+/**
+ * Private sink function copying a frame into the next slot of the
+ * member's history, the oldest one
+ */
+static void group_push(webcam_sink_t *s, const webcam_frame_t *f)
+{
+    webcam_group_member_t *m = (webcam_group_member_t *)s;
+    webcam_group_slot_t *slot = &m->slots[m->head % WEBCAM_GROUP_HISTORY];
+
+    if (f->rgb.start == NULL || f->rgb.length > m->capacity) {
+        __atomic_fetch_add(&m->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Odd while writing, and the writes stay after that
+    __atomic_store_n(&slot->count, slot->count + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->sequence, f->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->timestamp, f->timestamp, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arrival, _now(), __ATOMIC_RELAXED);
+    memcpy(slot->rgb.start, f->rgb.start, f->rgb.length);
+    slot->rgb.length = f->rgb.length;
+    __atomic_store_n(&slot->count, slot->count + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&m->head, m->head + 1, __ATOMIC_RELEASE);
+    sem_post(&m->group->pushed);
+}
+
+/**
+ * Snapshot of a history slot, taken by the matcher
+ */
+typedef struct _group_view {
+    uint32_t    count;      // Odd when the slot cannot be used
+    uint64_t    timestamp;
+    uint64_t    arrival;
+} _group_view_t;
+
+/**
+ * Private function matching the newest set of frames newer than the
+ * last one, and copying it; false when there is none (yet)
+ *
+ * Every webcam contributes the frame closest in time to one of the
+ * first webcam's. Slots are only read, so when one is overwritten
+ * during the copy the match starts over.
+ */
+static bool _group_match(webcam_group_t *g, buffer_t *frames, uint64_t *timestamps)
+{
+    _group_view_t view[WEBCAM_GROUP_MAX][WEBCAM_GROUP_HISTORY];
+    uint8_t pick[WEBCAM_GROUP_MAX], best[WEBCAM_GROUP_MAX], i, k, n;
+    webcam_group_slot_t *slot;
+    uint64_t lo, hi, skew = 0, arrival, reference;
+    bool found, valid;
+    size_t length;
+    void *start;
+
+    for (;;) {
+        for (i = 0; i < g->count; i++) {
+            for (k = 0; k < WEBCAM_GROUP_HISTORY; k++) {
+                slot = &g->member[i].slots[k];
+                view[i][k].count = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+                view[i][k].timestamp = __atomic_load_n(&slot->timestamp, __ATOMIC_RELAXED);
+                view[i][k].arrival = __atomic_load_n(&slot->arrival, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (view[i][k].count == 0 || __atomic_load_n(&slot->count, __ATOMIC_RELAXED) != view[i][k].count) {
+                    view[i][k].count = 1;
+                }
+            }
+        }
+
+        // Newest matching set, by the timestamp of the first webcam's frame
+        found = false;
+        reference = g->last;
+        for (k = 0; k < WEBCAM_GROUP_HISTORY; k++) {
+            if (view[0][k].count & 1 || view[0][k].timestamp <= reference) continue;
+
+            pick[0] = k;
+            lo = hi = view[0][k].timestamp;
+            for (i = 1; i < g->count; i++) {
+                for (n = 0, pick[i] = WEBCAM_GROUP_HISTORY; n < WEBCAM_GROUP_HISTORY; n++) {
+                    if (view[i][n].count & 1) continue;
+                    if (pick[i] == WEBCAM_GROUP_HISTORY ||
+                        llabs((int64_t)(view[i][n].timestamp - view[0][k].timestamp)) <
+                        llabs((int64_t)(view[i][pick[i]].timestamp - view[0][k].timestamp))) {
+                        pick[i] = n;
+                    }
+                }
+                if (pick[i] == WEBCAM_GROUP_HISTORY) break;
+                if (view[i][pick[i]].timestamp < lo) lo = view[i][pick[i]].timestamp;
+                if (view[i][pick[i]].timestamp > hi) hi = view[i][pick[i]].timestamp;
+            }
+
+            if (i == g->count && hi - lo <= g->tolerance) {
+                found = true;
+                reference = view[0][k].timestamp;
+                skew = hi - lo;
+                memcpy(best, pick, sizeof(best));
+            }
+        }
+        if (!found) return false;
+
+        // Copy, then check that no slot was rewritten meanwhile
+        valid = true;
+        arrival = 0;
+        for (i = 0; i < g->count && valid; i++) {
+            slot = &g->member[i].slots[best[i]];
+            length = slot->rgb.length;
+            if (frames[i].start == NULL || frames[i].length < length) {
+                start = realloc(frames[i].start, length);
+                if (start == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    return false;
+                }
+                frames[i].start = start;
+                frames[i].length = length;
+            }
+            memcpy(frames[i].start, slot->rgb.start, length);
+            if (timestamps != NULL) timestamps[i] = view[i][best[i]].timestamp;
+            if (view[i][best[i]].arrival > arrival) arrival = view[i][best[i]].arrival;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            valid = __atomic_load_n(&slot->count, __ATOMIC_RELAXED) == view[i][best[i]].count;
+        }
+        if (valid) break;
+
+        g->retries++;
+    }
+
+    g->last = reference;
+    g->sets++;
+    _stats_record(&g->latency, _now() - arrival);
+    _stats_record(&g->skew, skew);
+
+    return true;
+}
+
+/**
+ * Opens a group of count streaming webcams, whose frames are matched
+ * when their timestamps are at most tolerance microseconds apart
+ *
+ * The webcams need to be resized first, so the history can be
+ * allocated up front.
+ */
+webcam_group_t *webcam_group_open(webcam_t **webcams, uint8_t count, uint32_t tolerance)
+{
+    webcam_group_t *g;
+    webcam_group_member_t *m;
+    uint8_t i, k;
+
+    if (count == 0 || count > WEBCAM_GROUP_MAX) {
+        fprintf(stderr, "A group has 1 to %d webcams\n", WEBCAM_GROUP_MAX);
+        return NULL;
+    }
+
+    g = calloc(1, sizeof(webcam_group_t));
+    if (g == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    g->count = count;
+    g->tolerance = (uint64_t)tolerance * 1000;
+    sem_init(&g->pushed, 0, 0);
+
+    for (i = 0; i < count; i++) {
+        m = &g->member[i];
+        m->sink.push = group_push;
+        m->group = g;
+        m->webcam = webcams[i];
+        m->capacity = (size_t)webcams[i]->width * webcams[i]->height * 3;
+        for (k = 0; k < WEBCAM_GROUP_HISTORY; k++) {
+            m->slots[k].rgb.start = malloc(m->capacity);
+            if (m->slots[k].rgb.start == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                webcam_group_close(g);
+                return NULL;
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) webcam_sink_add(g->member[i].webcam, &g->member[i].sink);
+
+    return g;
+}
+
+/**
+ * Stops taking frames from the webcams, and frees the group
+ */
+void webcam_group_close(webcam_group_t *g)
+{
+    uint8_t i, k;
+
+    for (i = 0; i < g->count; i++) {
+        webcam_sink_remove(g->member[i].webcam, &g->member[i].sink);
+        for (k = 0; k < WEBCAM_GROUP_HISTORY; k++) free(g->member[i].slots[k].rgb.start);
+    }
+
+    sem_destroy(&g->pushed);
+    free(g);
+}
+
+/**
+ * Waits up to timeout milliseconds for the next matched set of frames,
+ * and copies them into frames, one per webcam in the order they were
+ * given, like webcam_grab() does; timestamps, if not NULL, gets their
+ * driver timestamps. False on timeout.
+ *
+ * Only one thread should grab from a group at a time.
+ */
+bool webcam_group_grab(webcam_group_t *g, buffer_t *frames, uint64_t *timestamps, uint32_t timeout)
+{
+    struct timespec deadline;
+
+    _deadline(&deadline, CLOCK_REALTIME, timeout);
+
+    for (;;) {
+        // Every push posts, so forget the ones this match covers
+        while (0 == sem_trywait(&g->pushed));
+        if (_group_match(g, frames, timestamps)) return true;
+
+        if (-1 == sem_timedwait(&g->pushed, &deadline) && ETIMEDOUT == errno) return false;
+    }
+}
+
+/**
+ * Sets how a webcam opened on an archive replays it: in real time,
+ * keeping the recorded spacing between frames, or as fast as possible,
+ * and whether to start over at the end
+ */
+void webcam_replay(webcam_t *w, bool realtime, bool loop)
+{
+    w->replay.realtime = realtime;
+    w->replay.loop = loop;
+}
+
+/**
+ * Private function returning the payload bytes of a frame in the file,
+ * version 1 archives only stored uncompressed frames
+ */
+static uint64_t _archive_stored(const webcam_archive_frame_t *frame)
+{
+    return frame->stored ? frame->stored : frame->length;
+}
+
+/**
+ * Private function checking that the frame header at offset and its
+ * stored payload lie within the file
+ */
+static bool _archive_fits(const webcam_archive_t *a, uint64_t offset)
+{
+    const webcam_archive_frame_t *frame;
+
+    if (offset < WEBCAM_ARCHIVE_PAGE || offset % WEBCAM_ARCHIVE_PAGE != 0 ||
+        offset > a->length - WEBCAM_ARCHIVE_PAGE) {
+        return false;
+    }
+    frame = (const webcam_archive_frame_t *)(a->map + offset);
+
+    return frame->magic == WEBCAM_ARCHIVE_FRAME &&
+           _archive_stored(frame) <= a->length - offset - WEBCAM_ARCHIVE_PAGE;
+}
+
+/**
+ * Opens an archive for reading
+ *
+ * The file is mapped, and the index is used in place. An archive whose
+ * recorder did not finish (no trailer), or whose index points outside
+ * the file, is scanned once to rebuild the index, up to the last
+ * complete frame.
+ */
+webcam_archive_t *webcam_archive_open(const char *path)
+{
+    struct stat st;
+    webcam_archive_t *a;
+    webcam_archive_header_t *header;
+    webcam_archive_trailer_t *trailer;
+    webcam_archive_frame_t *frame;
+    uint64_t offset, next, n;
+
+    a = calloc(1, sizeof(webcam_archive_t));
+    if (a == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    a->fd = open(path, O_RDONLY);
+    if (-1 == a->fd || -1 == fstat(a->fd, &st)) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+        if (-1 != a->fd) close(a->fd);
+        free(a);
+        return NULL;
+    }
+
+    a->length = st.st_size;
+    a->map = a->length < WEBCAM_ARCHIVE_PAGE ? MAP_FAILED :
+             mmap(NULL, a->length, PROT_READ, MAP_SHARED, a->fd, 0);
+    header = (webcam_archive_header_t *)a->map;
+
+    if (MAP_FAILED == a->map || header->magic != WEBCAM_ARCHIVE_MAGIC ||
+        header->version == 0 || header->version > WEBCAM_ARCHIVE_VERSION || header->page != WEBCAM_ARCHIVE_PAGE) {
+        fprintf(stderr, "%s is no webcam archive\n", path);
+        if (MAP_FAILED != a->map) munmap(a->map, a->length);
+        close(a->fd);
+        free(a);
+        return NULL;
+    }
+
+    // Use the index in place when the archive was finished, and every entry is within the file
+    trailer = (webcam_archive_trailer_t *)(a->map + a->length - sizeof(webcam_archive_trailer_t));
+    if (a->length % WEBCAM_ARCHIVE_PAGE == 0 && trailer->magic == WEBCAM_ARCHIVE_INDEX && trailer->index <= a->length - sizeof(webcam_archive_trailer_t) &&
+        trailer->count <= (a->length - sizeof(webcam_archive_trailer_t) - trailer->index) /
+                          sizeof(webcam_archive_entry_t) &&
+        trailer->index % sizeof(uint64_t) == 0) {
+        a->index = (webcam_archive_entry_t *)(a->map + trailer->index);
+        for (n = 0; n < trailer->count && _archive_fits(a, a->index[n].offset); n++);
+        if (n == trailer->count) {
+            a->count = trailer->count;
+            return a;
+        }
+        a->index = NULL;
+        fprintf(stderr, "%s: frame %llu of the index is outside the file\n", path, (unsigned long long)n);
+    }
+
+    // Otherwise walk the frame headers, never past the end of the file
+    a->recovered = true;
+    for (offset = WEBCAM_ARCHIVE_PAGE; offset + WEBCAM_ARCHIVE_PAGE <= a->length; offset = next) {
+        frame = (webcam_archive_frame_t *)(a->map + offset);
+        if (!_archive_fits(a, offset)) break;
+        next = offset + WEBCAM_ARCHIVE_PAGE + _page_align(_archive_stored(frame));
+        if (next > a->length) break;
+
+        if ((a->count & (a->count - 1)) == 0) {
+            webcam_archive_entry_t *index = realloc(a->index,
+                    (a->count ? a->count * 2 : 256) * sizeof(webcam_archive_entry_t));
+            if (index == NULL) break;
+            a->index = index;
+        }
+
+        a->index[a->count].offset = offset;
+        a->index[a->count].timestamp = frame->timestamp;
+        a->count++;
+    }
+
+    fprintf(stderr, "%s: no index, recovered %llu frames\n", path, (unsigned long long)a->count);
+
+    return a;
+}
+
+/**
+ * Closes the archive
+ */
+void webcam_archive_close(webcam_archive_t *a)
+{
+    if (a->recovered) free(a->index);
+    munmap(a->map, a->length);
+    close(a->fd);
+    free(a);
+}
+
+/**
+ * Returns the header of frame n, and points payload at its stored bytes
+ * within the mapping. Returns NULL when there is no such frame, or
+ * when it does not lie within the file.
+ *
+ * Compressed frames (codec other than WEBCAM_CODEC_NONE) need
+ * webcam_archive_decode to get at the pixels.
+ */
+const webcam_archive_frame_t *webcam_archive_frame(webcam_archive_t *a, uint64_t n, buffer_t *payload)
+{
+    const webcam_archive_frame_t *frame;
+
+    if (n >= a->count || !_archive_fits(a, a->index[n].offset)) return NULL;
+
+    frame = (const webcam_archive_frame_t *)(a->map + a->index[n].offset);
+    if (payload != NULL) {
+        payload->start = a->map + a->index[n].offset + WEBCAM_ARCHIVE_PAGE;
+        payload->length = _archive_stored(frame);
+    }
+
+    return frame;
+}
+
+/**
+ * Decodes the pixels of frame n into out, allocating it when its
+ * start is NULL. Returns 0 on success, -1 when there is no such frame
+ * or it could not be decoded.
+ */
+int webcam_archive_decode(webcam_archive_t *a, uint64_t n, buffer_t *out)
+{
+    const webcam_archive_frame_t *frame;
+    buffer_t payload;
+    uint8_t *scratch;
+    int r = 0;
+
+    frame = webcam_archive_frame(a, n, &payload);
+    if (frame == NULL) return -1;
+
+    // Initialize frame
+    if (out->start == NULL) {
+        out->start = calloc(frame->length, sizeof(char));
+        out->length = frame->length;
+    }
+
+    if (out->start == NULL || out->length < frame->length) return -1;
+
+    switch (frame->codec) {
+        case WEBCAM_CODEC_NONE:
+            if (payload.length < frame->length) return -1;
+            memcpy(out->start, payload.start, frame->length);
+            break;
+
+        case WEBCAM_CODEC_DELTA:
+            scratch = malloc(frame->stride + 16);
+            r = scratch == NULL ? -1 :
+                _delta_decode(payload.start, payload.length, frame->length, frame->stride,
+                              frame->format, out->start, scratch);
+            free(scratch);
+            break;
+
+        default:
+            fprintf(stderr, "Unknown codec %u in frame %llu\n", frame->codec, (unsigned long long)n);
+            return -1;
+    }
+
+    return r;
+}
+
+/**
+ * Returns the number of the last frame recorded at or before the given
+ * timestamp, or -1 when the archive starts after it
+ */
+int64_t webcam_archive_find(webcam_archive_t *a, uint64_t timestamp)
+{
+    int64_t lo = 0, hi = (int64_t)a->count - 1, mid, found = -1;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (a->index[mid].timestamp <= timestamp) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Takes a snapshot of the webcam's stage histograms
+ *
+ * Does not lock, so the capture thread is never held up. Counters are
+ * read one by one, so a snapshot taken while frames are flowing can be
+ * off by the few samples recorded during the copy.
+ * Without -DWEBCAM_STATS the stage histograms stay empty.
+ */
+void webcam_stats(webcam_t *w, webcam_stats_t *stats)
+{
+    size_t i;
+    uint64_t *src = (uint64_t *)&w->stats;
+    uint64_t *dst = (uint64_t *)stats;
+
+    for (i = 0; i < sizeof(webcam_stats_t) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    stats->degradation = __atomic_load_n(&w->degradation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Clears the webcam's statistics, but keeps the set of available counters
+ */
+void webcam_stats_reset(webcam_t *w)
+{
+    size_t i;
+    uint64_t *src = (uint64_t *)&w->stats;
+    uint64_t available = __atomic_load_n(&w->stats.convert.available, __ATOMIC_RELAXED);
+
+    for (i = 0; i < sizeof(webcam_stats_t) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&src[i], 0, __ATOMIC_RELAXED);
+    }
+
+    // Which counters could be opened is not a statistic
+    __atomic_store_n(&w->stats.convert.available, available, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the lowest latency, in nanoseconds, that falls in the given bucket
+ */
+uint64_t webcam_stats_bucket_value(uint16_t bucket)
+{
+    if (bucket < WEBCAM_HIST_SUB) return bucket;
+
+    return (uint64_t)(WEBCAM_HIST_SUB + bucket % WEBCAM_HIST_SUB) << (bucket / WEBCAM_HIST_SUB - 1);
+}
+
+/**
+ * Returns the latency, in nanoseconds, below which the given fraction
+ * (0.0 - 1.0) of the samples in the histogram fall
+ */
+uint64_t webcam_stats_percentile(const webcam_histogram_t *h, double p)
+{
+    uint16_t i;
+    uint64_t seen = 0;
+    uint64_t target = p * h->count;
+
+    if (h->count == 0) return 0;
+
+    for (i = 0; i < WEBCAM_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target) return webcam_stats_bucket_value(i);
+    }
+
+    return h->max;
+}
+
+/**
+ * Returns the name of a pipeline stage
+ */
+const char *webcam_stage_name(webcam_stage_t s)
+{
+    static const char *names[WEBCAM_STAGES] = {
+        "dqbuf", "convert", "lock", "qbuf", "grab", "outputs", "pyramid", "motion", "sharpness"
+    };
+
+    return s < WEBCAM_STAGES ? names[s] : "unknown";
+}
+
+/**
+ * Returns the name of a hardware counter
+ */
+const char *webcam_counter_name(webcam_counter_t c)
+{
+    static const char *names[WEBCAM_COUNTERS] = {
+        "cycles", "instructions", "llc-misses", "branch-misses"
+    };
+
+    return c < WEBCAM_COUNTERS ? names[c] : "unknown";
+}
+
+/**
+ * Writes the contents of all trace rings as Chrome trace JSON, which
+ * can be loaded in chrome://tracing or ui.perfetto.dev
+ *
+ * Every webcam shows up as a process, with a track per thread that
+ * touched it. Rings are read without stopping the writers; events that
+ * were overwritten while being read are left out.
+ * Without -DWEBCAM_TRACE the trace is empty.
+ */
+void webcam_trace_dump(FILE *fp)
+{
+    int i;
+    bool first = true;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+
+    // Name the processes after the devices
+    for (i = 0; i < 16; i++) {
+        if (_w[i] == NULL) continue;
+
+        fprintf(fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", i, _w[i]->name);
+        first = false;
+    }
+
+#ifdef WEBCAM_TRACE
+    trace_ring_t *r;
+    trace_event_t *events = calloc(WEBCAM_TRACE_EVENTS, sizeof(trace_event_t));
+    uint64_t head, tail, n;
+
+    for (r = __atomic_load_n(&_trace_rings, __ATOMIC_ACQUIRE); r != NULL && events != NULL; r = r->next) {
+        // Copy the ring, then drop what the writer may have overwritten meanwhile
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = head > WEBCAM_TRACE_EVENTS ? head - WEBCAM_TRACE_EVENTS : 0;
+        for (n = tail; n < head; n++) {
+            events[n % WEBCAM_TRACE_EVENTS] = r->events[n % WEBCAM_TRACE_EVENTS];
+        }
+
+        n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (n >= WEBCAM_TRACE_EVENTS && n - WEBCAM_TRACE_EVENTS + 1 > tail) {
+            tail = n - WEBCAM_TRACE_EVENTS + 1;
+        }
+
+        for (n = tail; n < head; n++) {
+            trace_event_t *e = &events[n % WEBCAM_TRACE_EVENTS];
+
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"seq\":%u}}",
+                    first ? "" : ",\n", e->name, e->dev, (int)r->tid,
+                    e->ts / 1000.0, e->dur / 1000.0, e->seq);
+            first = false;
+        }
+    }
+
+    free(events);
+#endif
+
+    fprintf(fp, "\n]}\n");
+}
+
+/**
+ * Writes the trace to the file at the given path
+ *
+ * Returns 0 on success, -1 if the file could not be written
+ */
+int webcam_trace_save(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot write trace to '%s': %d, %s\n",
+                path, errno, strerror(errno));
+        return -1;
+    }
+
+    webcam_trace_dump(fp);
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+ * Private handler for the trace signal
+ * Only flags the request, the dump happens on a streaming thread.
+ */
+static void trace_handler(int sig)
+{
+    (void)sig;
+    __atomic_store_n(&_trace_signalled, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Dumps the trace to the given path whenever the process receives
+ * the given signal, e.g. SIGUSR1
+ *
+ * The dump is written by the next streaming thread that finishes
+ * a frame, not from within the signal handler, so a signal received
+ * while no webcam is streaming is only acted upon once one streams
+ * again; call webcam_trace_save() directly otherwise.
+ */
+void webcam_trace_on_signal(int sig, const char *path)
+{
+    struct sigaction action;
+
+    snprintf(_trace_path, sizeof(_trace_path), "%s", path);
+
+    CLEAR(action);
+    action.sa_handler = trace_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, NULL);
+}
+
+/**
+ * Main code
+ */
+#ifdef WEBCAM_TEST
+int main(int argc, char **argv)
+{
+#if defined(WEBCAM_STATS) || defined(WEBCAM_PERF)
+    int i;
+#endif
+    webcam_t *w = webcam_open("/dev/video0");
+    webcam_recorder_t *r;
+
+    // Prepare frame
+    buffer_t frame;
+    frame.start = NULL;
+    frame.length = 0;
+
+    webcam_resize(w, 640, 480);
+    webcam_stream(w, true);
+
+    // Record a few seconds, the recorder writes from its own thread
+    r = webcam_record(w, "frames.wca", WEBCAM_RECORD_RGB, WEBCAM_CODEC_NONE);
+    sleep(3);
+    webcam_grab(w, &frame);
+    if (r != NULL) {
+        // Every frame accepted before the sink is removed gets written
+        webcam_sink_remove(w, &r->sink);
+        printf("Recorded %llu frames, dropped %llu\n",
+               (unsigned long long)r->head, (unsigned long long)r->dropped);
+        webcam_recorder_close(r);
+    }
+
+    webcam_stream(w, false);
+
+#ifdef WEBCAM_STATS
+    // Print the latency distribution of every stage
+    webcam_stats_t stats;
+    webcam_stats(w, &stats);
+    for (i = 0; i < WEBCAM_STAGES; i++) {
+        printf("%-8s n=%-6llu p50=%-10llu p99=%-10llu max=%llu ns\n", webcam_stage_name(i),
+               (unsigned long long)stats.stage[i].count,
+               (unsigned long long)webcam_stats_percentile(&stats.stage[i], 0.50),
+               (unsigned long long)webcam_stats_percentile(&stats.stage[i], 0.99),
+               (unsigned long long)stats.stage[i].max);
+    }
+#endif
+
+#ifdef WEBCAM_PERF
+    // Print the hardware counters per converted frame
+    webcam_stats_t counters;
+    webcam_stats(w, &counters);
+    for (i = 0; i < WEBCAM_COUNTERS && counters.convert.frames > 0; i++) {
+        if (!(counters.convert.available & (1 << i))) continue;
+
+        printf("%-14s %llu per frame\n", webcam_counter_name(i),
+               (unsigned long long)(counters.convert.value[i] / counters.convert.frames));
+    }
+    if (counters.convert.value[WEBCAM_COUNTER_CYCLES] > 0) {
+        printf("%-14s %.2f\n", "ipc", 1.0 * counters.convert.value[WEBCAM_COUNTER_INSTRUCTIONS] /
+                                        counters.convert.value[WEBCAM_COUNTER_CYCLES]);
+    }
+#endif
+    webcam_close(w);
+
+    if (frame.start != NULL) free(frame.start);
+
+    return 0;
+}
+#endif
+
+/**
+ * Kernel microbenchmark
+ *
+ * Runs the pixel kernels on in-memory buffers, so no device is needed.
+ * Every kernel is measured for a number of resolutions and buffer
+ * alignments, after a fixed number of warmup runs and with the process
+ * pinned to a single CPU. The median of the timed runs is reported as
+ * cycles/pixel, GB/s of source data, and as a percentage of the memcpy
+ * bandwidth for the same amount of bytes.
+ *
+ * To compile:
+ *   gcc -O2 -DWEBCAM_BENCH -o bench webcam.c -lpthread
+ *
+ * Usage: ./bench [kernels] [cpu]
+ *        ./bench record <dir>...
+ *        ./bench replay <archive>...
+ *        ./bench codec [archive...]
+ *        ./bench pipe
+ *        ./bench http [clients]
+ *        ./bench rtp
+ *        ./bench local
+ *        ./bench outputs
+ *        ./bench pyramid
+ *        ./bench integral
+ *        ./bench motion
+ *        ./bench trigger [dir]
+ *        ./bench dedup
+ *        ./bench sharpness
+ *        ./bench group
+ *        ./bench mosaic
+ *        ./bench schedule
+ *        ./bench degrade
+ *        ./bench standby
+ */
+#ifdef WEBCAM_BENCH
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_WARMUP 3
+#define BENCH_RUNS   15
+
+/**
+ * A kernel under test. Kernels get a YUYV source buffer and an
+ * (already allocated) destination buffer. New conversion kernels
+ * should be added to the kernels table below.
+ */
+typedef struct bench_kernel {
+    const char *name;
+    const char *isa;
+    void (*run)(struct buffer src, struct buffer *dst);
+} bench_kernel_t;
+
+static void bench_convertToRGB(struct buffer src, struct buffer *dst)
+{
+    convertToRGB(src, dst);
+}
+
+// Equalizes a fresh copy, as equalize() works in place; includes the copy
+static void bench_equalize(struct buffer src, struct buffer *dst)
+{
+    struct buffer copy = { dst->start, src.length };
+
+    memcpy(copy.start, src.start, src.length);
+    equalize(&copy);
+}
+
+static void bench_memcpy(struct buffer src, struct buffer *dst)
+{
+    memcpy(dst->start, src.start, src.length);
+}
+
+static const bench_kernel_t kernels[] = {
+    { "convertToRGB", "scalar", bench_convertToRGB },
+    { "equalize",     "scalar", bench_equalize },
+};
+
+static const struct { uint16_t width, height; } resolutions[] = {
+    {  320,  240 },
+    {  640,  480 },
+    { 1280,  720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+static const size_t alignments[] = { 0, 1, 4, 16 };
+
+static uint64_t bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Evicts a buffer from the caches, the way a frame the device has just
+ * written by DMA is not in them
+ */
+static void bench_flush(const uint8_t *start, size_t length)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    size_t i;
+
+    for (i = 0; i < length; i += 64) _mm_clflush(start + i);
+    _mm_mfence();
+#endif
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs the kernel BENCH_WARMUP + BENCH_RUNS times and stores the
+ * median nanoseconds and cycles of the timed runs
+ */
+static void bench_run(void (*run)(struct buffer, struct buffer *),
+                      struct buffer src, struct buffer *dst,
+                      uint64_t *ns, uint64_t *cycles)
+{
+    int i;
+    uint64_t t[BENCH_RUNS], c[BENCH_RUNS];
+    uint64_t t0, c0;
+
+    for (i = 0; i < BENCH_WARMUP; i++) run(src, dst);
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        t0 = bench_ns();
+        c0 = bench_cycles();
+        run(src, dst);
+        c[i] = bench_cycles() - c0;
+        t[i] = bench_ns() - t0;
+    }
+
+    qsort(t, BENCH_RUNS, sizeof(uint64_t), bench_compare);
+    qsort(c, BENCH_RUNS, sizeof(uint64_t), bench_compare);
+    *ns = t[BENCH_RUNS / 2];
+    *cycles = c[BENCH_RUNS / 2];
+}
+
+/**
+ * Runs every kernel over every resolution and alignment
+ */
+static int bench_kernels(int cpu)
+{
+    size_t r, a, k, i;
+    cpu_set_t set;
+
+    uint8_t *src_mem, *dst_mem;
+    struct buffer src, dst;
+
+    uint64_t ns, cycles, memcpy_ns, memcpy_cycles;
+    size_t pixels;
+
+    // Pin to a single CPU so the numbers are comparable between runs
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (-1 == sched_setaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "Could not pin to cpu %d: %s\n", cpu, strerror(errno));
+    }
+
+    printf("%-14s %-8s %10s %5s %12s %10s %8s %8s\n",
+           "kernel", "isa", "resolution", "align", "ns", "cyc/px", "GB/s", "memcpy%");
+
+    for (r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+        pixels = (size_t)resolutions[r].width * resolutions[r].height;
+
+        for (a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+            // Page-aligned allocations, shifted by the alignment under test
+            if (0 != posix_memalign((void **)&src_mem, 4096, pixels * 2 + 64) ||
+                0 != posix_memalign((void **)&dst_mem, 4096, pixels * 3 + 64)) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+            }
+
+            src.start = src_mem + alignments[a];
+            src.length = pixels * 2;
+            dst.start = dst_mem + alignments[a];
+            dst.length = pixels * 3;
+
+            // Deterministic, non-trivial YUYV content
+            for (i = 0; i < src.length; i++) src.start[i] = (i * 7 + (i >> 11)) & 0xff;
+            memset(dst.start, 0, dst.length);
+
+            bench_run(bench_memcpy, src, &dst, &memcpy_ns, &memcpy_cycles);
+
+            for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                bench_run(kernels[k].run, src, &dst, &ns, &cycles);
+
+                printf("%-14s %-8s %5ux%-4u %5zu %12llu %10.2f %8.2f %8.1f\n",
+                       kernels[k].name, kernels[k].isa,
+                       resolutions[r].width, resolutions[r].height, alignments[a],
+                       (unsigned long long)ns,
+                       1.0 * cycles / pixels,
+                       1.0 * src.length / (ns ? ns : 1),
+                       100.0 * memcpy_ns / (ns ? ns : 1));
+            }
+
+            free(src_mem);
+            free(dst_mem);
+        }
+    }
+
+    return 0;
+}
+/**
+ * Fills a YUYV buffer with a synthetic scene: smooth gradients, flat
+ * blocks with sharp edges, and uniform sensor noise of +-noise
+ */
+static void bench_scene(uint8_t *yuyv, uint16_t width, uint16_t height, int noise)
+{
+    uint16_t x, y;
+    uint8_t *p;
+    int base;
+
+    srand(1);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x += 2) {
+            p = yuyv + ((size_t)y * width + x) * 2;
+            base = 60 + x * 100 / width + y * 80 / height + ((x / 200 + y / 150) % 2) * 40;
+
+            p[0] = base + (noise ? rand() % (2 * noise + 1) - noise : 0);
+            p[2] = base + (noise ? rand() % (2 * noise + 1) - noise : 0);
+            p[1] = 128 + x * 30 / width + (noise ? rand() % 3 - 1 : 0);
+            p[3] = 120 + y * 30 / height + (noise ? rand() % 3 - 1 : 0);
+        }
+    }
+}
+
+/**
+ * Encodes and decodes one frame BENCH_RUNS times on the current core,
+ * and reports the ratio and the throughput of both directions
+ */
+static int bench_codec_frame(const char *name, const uint8_t *src, size_t length,
+                             uint32_t stride, uint32_t format)
+{
+    uint8_t *encoded = malloc(_delta_bound(length, stride));
+    uint8_t *decoded = malloc(length);
+    uint8_t *scratch = malloc(stride + 16);
+    uint64_t t, enc = UINT64_MAX, dec = UINT64_MAX;
+    size_t stored = 0;
+    int i, ok = 0;
+
+    if (encoded == NULL || decoded == NULL || scratch == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        ok = -1;
+    }
+
+    for (i = 0; ok == 0 && i < BENCH_RUNS; i++) {
+        t = bench_ns();
+        stored = _delta_encode(src, length, stride, format, encoded, scratch);
+        t = bench_ns() - t;
+        if (t < enc) enc = t;
+
+        t = bench_ns();
+        ok = _delta_decode(encoded, stored, length, stride, format, decoded, scratch);
+        t = bench_ns() - t;
+        if (t < dec) dec = t;
+    }
+
+    if (ok == 0 && 0 != memcmp(src, decoded, length)) ok = -1;
+
+    if (ok == 0) {
+        printf("%-32s %6.2fx %8.1f MB/s encode %8.1f MB/s decode\n", name,
+               1.0 * length / stored, 1000.0 * length / enc, 1000.0 * length / dec);
+    } else {
+        printf("%-32s failed to round-trip\n", name);
+    }
+
+    free(encoded);
+    free(decoded);
+    free(scratch);
+
+    return ok == 0 ? 0 : EXIT_FAILURE;
+}
+
+/**
+ * Runs the delta codec on synthetic 1080p YUYV frames with increasing
+ * noise, and on the first frames of the given archives
+ */
+static int bench_codec(int argc, char **argv)
+{
+    uint8_t *yuyv = malloc(1920 * 1080 * 2);
+    webcam_archive_t *a;
+    const webcam_archive_frame_t *h;
+    buffer_t frame;
+    char name[64];
+    int noise, i, r = 0;
+    uint64_t n;
+
+    if (yuyv == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (noise = 0; noise <= 4; noise += 2) {
+        snprintf(name, sizeof(name), "synthetic 1920x1080 noise %d", noise);
+        bench_scene(yuyv, 1920, 1080, noise);
+        r |= bench_codec_frame(name, yuyv, 1920 * 1080 * 2, 1920 * 2, V4L2_PIX_FMT_YUYV);
+    }
+    free(yuyv);
+
+    for (i = 0; i < argc; i++) {
+        a = webcam_archive_open(argv[i]);
+        if (a == NULL) {
+            r = EXIT_FAILURE;
+            continue;
+        }
+
+        for (n = 0; n < a->count && n < 3; n++) {
+            CLEAR(frame);
+            h = webcam_archive_frame(a, n, NULL);
+            if (-1 == webcam_archive_decode(a, n, &frame)) continue;
+
+            snprintf(name, sizeof(name), "%.20s #%llu", argv[i], (unsigned long long)n);
+            r |= bench_codec_frame(name, frame.start, h->length, h->stride, h->format);
+            free(frame.start);
+        }
+
+        webcam_archive_close(a);
+    }
+
+    return r;
+}
+
+/**
+ * Records synthetic 1080p YUYV frames, paced at BENCH_RECORD_FPS,
+ * into a file in the given directory for BENCH_RECORD_SECONDS and
+ * reports the sustained write throughput and the fraction of frames
+ * the recorder had to drop
+ */
+#define BENCH_RECORD_FPS     60
+#define BENCH_RECORD_SECONDS 5
+
+static int bench_record(const char *dir, webcam_codec_t codec)
+{
+    char path[4096];
+    webcam_recorder_t *rec;
+    webcam_frame_t f;
+    uint64_t start, next, elapsed, pushed = 0;
+
+    CLEAR(f);
+    f.width = 1920;
+    f.height = 1080;
+    f.raw.length = (size_t)f.width * f.height * 2;
+    f.raw.start = malloc(f.raw.length);
+    if (f.raw.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(f.raw.start, f.width, f.height, 2);
+
+    snprintf(path, sizeof(path), "%s/webcam-bench.wca", dir);
+    rec = webcam_recorder_open(path, WEBCAM_RECORD_RAW, codec, f.raw.length, 8);
+    if (rec == NULL) {
+        free(f.raw.start);
+        return EXIT_FAILURE;
+    }
+
+    start = next = bench_ns();
+    while (next - start < BENCH_RECORD_SECONDS * 1000000000ull) {
+        while (bench_ns() < next) usleep(100);
+
+        f.sequence = pushed++;
+        f.timestamp = bench_ns();
+        rec->sink.push(&rec->sink, &f);
+        next += 1000000000ull / BENCH_RECORD_FPS;
+    }
+
+    // Include draining the queue in the measured time
+    while (__atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE) != rec->head) usleep(100);
+    elapsed = bench_ns() - start;
+
+    printf("%-24s %-6s %-5s %8.1f MB/s %6.2f%% dropped (%llu of %llu frames)\n",
+           dir, rec->direct ? "direct" : "cached", codec == WEBCAM_CODEC_NONE ? "none" : "delta",
+           1000.0 * rec->bytes / elapsed, 100.0 * rec->dropped / pushed,
+           (unsigned long long)rec->dropped, (unsigned long long)pushed);
+
+    webcam_recorder_close(rec);
+    unlink(path);
+    free(f.raw.start);
+
+    return 0;
+}
+
+/**
+ * Streams synthetic 4K YUYV frames, paced at BENCH_PIPE_FPS, into a
+ * pipe drained by a reader thread the way ffmpeg reads its input, for
+ * BENCH_PIPE_SECONDS. Compares the pipe output against copying every
+ * frame out as webcam_grab does and writing the copy, and reports the
+ * CPU spent on the producing side, i.e. without the reader.
+ */
+#define BENCH_PIPE_FPS     60
+#define BENCH_PIPE_SECONDS 3
+
+typedef struct bench_reader {
+    int         fd;
+    uint64_t    bytes;
+    uint64_t    cpu;
+} bench_reader_t;
+
+static uint64_t bench_cpu(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *bench_pipe_reading(void *ptr)
+{
+    bench_reader_t *r = (bench_reader_t *)ptr;
+    uint8_t *buffer = malloc(1 << 20);
+    ssize_t n;
+
+    while (buffer != NULL && (n = read(r->fd, buffer, 1 << 20)) != 0) {
+        if (n > 0) r->bytes += n;
+        else if (errno != EINTR) break;
+    }
+    r->cpu = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+    free(buffer);
+
+    return NULL;
+}
+
+static int bench_pipe(webcam_pipe_format_t format, bool splice)
+{
+    bench_reader_t reader;
+    pthread_t thread;
+    webcam_pipe_t *p = NULL;
+    webcam_frame_t f;
+    uint8_t *copy = NULL;
+    uint64_t start, next, elapsed, cpu, pushed = 0, delivered, dropped = 0;
+    size_t length;
+    int fds[2];
+
+    CLEAR(f);
+    f.width = 3840;
+    f.height = 2160;
+    f.raw.length = length = (size_t)f.width * f.height * 2;
+    f.raw.start = malloc(f.raw.length);
+    if (f.raw.start == NULL || -1 == pipe(fds)) {
+        fprintf(stderr, "Cannot set up the pipe benchmark\n");
+        free(f.raw.start);
+        return EXIT_FAILURE;
+    }
+    bench_scene(f.raw.start, f.width, f.height, 2);
+
+    CLEAR(reader);
+    reader.fd = fds[0];
+    pthread_create(&thread, NULL, bench_pipe_reading, &reader);
+
+    if (splice) {
+        p = webcam_pipe_open(fds[1], format, f.width, f.height, BENCH_PIPE_FPS, 4);
+    } else {
+        copy = malloc(6 + length);
+        if (copy != NULL) memcpy(copy, "FRAME\n", 6);
+    }
+
+    cpu = bench_cpu(CLOCK_PROCESS_CPUTIME_ID);
+    start = next = bench_ns();
+    while ((p != NULL || copy != NULL) && next - start < BENCH_PIPE_SECONDS * 1000000000ull) {
+        while (bench_ns() < next) usleep(100);
+
+        f.sequence = pushed++;
+        f.timestamp = bench_ns();
+        if (p != NULL) {
+            p->sink.push(&p->sink, &f);
+        } else if (format == WEBCAM_PIPE_Y4M) {
+            _yuyv_planar(f.raw.start, f.width, f.height, copy + 6);
+            _write_all(fds[1], copy, 6 + length);
+        } else {
+            memcpy(copy + 6, f.raw.start, length);
+            _write_all(fds[1], copy + 6, length);
+        }
+        next += 1000000000ull / BENCH_PIPE_FPS;
+    }
+
+    delivered = pushed;
+    if (p != NULL) {
+        while (__atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) != p->head) usleep(100);
+        delivered = p->frames;
+        dropped = p->dropped;
+        webcam_pipe_close(p);
+    }
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    elapsed = bench_ns() - start;
+    cpu = bench_cpu(CLOCK_PROCESS_CPUTIME_ID) - cpu - reader.cpu;
+
+    printf("%-4s %-8s %6.1f fps %7.2f ms CPU per frame %6.1f%% of a core, %llu dropped\n",
+           format == WEBCAM_PIPE_Y4M ? "y4m" : "yuyv", splice ? "vmsplice" : "write",
+           1e9 * delivered / elapsed, delivered ? cpu / 1e6 / delivered : 0.0,
+           100.0 * cpu / elapsed, (unsigned long long)dropped);
+
+    close(fds[0]);
+    free(copy);
+    free(f.raw.start);
+
+    return 0;
+}
+
+/**
+ * Serves synthetic 1080p YUYV frames, paced at BENCH_HTTP_FPS, to the
+ * given number of local clients reading as fast as they can, plus one
+ * that reads BENCH_HTTP_SLOW bytes per millisecond, for
+ * BENCH_HTTP_SECONDS. Reports the encoding cost, which is paid once
+ * per frame however many clients there are, and what every client got.
+ * One more client hangs up after BENCH_HTTP_QUIT bytes, in the middle
+ * of a frame, which the server must survive.
+ */
+#define BENCH_HTTP_FPS     30
+#define BENCH_HTTP_SECONDS 3
+#define BENCH_HTTP_SLOW    256
+#define BENCH_HTTP_QUIT    65536
+
+typedef struct bench_client {
+    uint16_t    port;
+    bool        slow;
+    bool        quit;
+    bool        done;
+    uint64_t    bytes;
+} bench_client_t;
+
+static void *bench_http_reading(void *ptr)
+{
+    bench_client_t *c = (bench_client_t *)ptr;
+    struct sockaddr_in addr;
+    char request[] = "GET /0 HTTP/1.0\r\n\r\n";
+    uint8_t buffer[65536];
+    ssize_t n;
+    int fd, pending;
+
+    CLEAR(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == fd || -1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == write(fd, request, strlen(request))) {
+        fprintf(stderr, "Cannot connect: %d, %s\n", errno, strerror(errno));
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) {
+        n = read(fd, buffer, c->slow ? BENCH_HTTP_SLOW : sizeof(buffer));
+        if (n <= 0) break;
+        c->bytes += n;
+        if (c->slow) usleep(1000);
+        // Hang up with nothing left unread, so the server writes on rather than getting a reset
+        if (c->quit && c->bytes >= BENCH_HTTP_QUIT && 0 == ioctl(fd, FIONREAD, &pending) && pending == 0) break;
+    }
+    close(fd);
+
+    return NULL;
+}
+
+static int bench_http(int nclients)
+{
+    webcam_http_t *h;
+    webcam_http_stream_t *s;
+    webcam_frame_t f;
+    bench_client_t *clients;
+    pthread_t *threads;
+    uint64_t start, next, pushed = 0;
+    int i;
+
+    h = webcam_http_open("127.0.0.1", 0, 80);
+    if (h == NULL) return EXIT_FAILURE;
+    s = webcam_http_stream_open(h, 0);
+
+    CLEAR(f);
+    f.width = 1920;
+    f.height = 1080;
+    f.raw.length = (size_t)f.width * f.height * 2;
+    f.raw.start = malloc(f.raw.length);
+    clients = calloc(nclients + 2, sizeof(bench_client_t));
+    threads = calloc(nclients + 2, sizeof(pthread_t));
+    if (s == NULL || f.raw.start == NULL || clients == NULL || threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        webcam_http_close(h);
+        return EXIT_FAILURE;
+    }
+    bench_scene(f.raw.start, f.width, f.height, 2);
+
+    for (i = 0; i <= nclients + 1; i++) {
+        clients[i].port = h->port;
+        clients[i].slow = i == nclients;
+        clients[i].quit = i == nclients + 1;
+        pthread_create(&threads[i], NULL, bench_http_reading, &clients[i]);
+    }
+    while (__atomic_load_n(&s->clients, __ATOMIC_ACQUIRE) < (uint32_t)nclients + 2) usleep(1000);
+
+    start = next = bench_ns();
+    while (next - start < BENCH_HTTP_SECONDS * 1000000000ull) {
+        while (bench_ns() < next) usleep(100);
+
+        f.sequence = pushed++;
+        f.timestamp = bench_ns();
+        s->sink.push(&s->sink, &f);
+        next += 1000000000ull / BENCH_HTTP_FPS;
+    }
+
+    printf("%llu frames pushed, %llu encoded once each (%.2f ms per frame, %u workers), %llu skipped\n",
+           (unsigned long long)pushed, (unsigned long long)s->encoded,
+           s->encoded ? s->encode_ns / 1e6 / s->encoded : 0.0, h->nworkers,
+           (unsigned long long)s->skipped);
+    for (i = 0; i < WEBCAM_HTTP_CLIENTS; i++) {
+        if (h->clients[i].fd == -1) continue;
+        printf("client %2d: %4llu frames sent, %4llu skipped\n", i,
+               (unsigned long long)__atomic_load_n(&h->clients[i].frames, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&h->clients[i].skipped, __ATOMIC_RELAXED));
+    }
+
+    printf("client hung up after %llu bytes, %u still streaming\n",
+           (unsigned long long)clients[nclients + 1].bytes, __atomic_load_n(&s->clients, __ATOMIC_ACQUIRE));
+
+    for (i = 0; i <= nclients + 1; i++) __atomic_store_n(&clients[i].done, true, __ATOMIC_RELEASE);
+    webcam_http_close(h);
+    for (i = 0; i <= nclients + 1; i++) pthread_join(threads[i], NULL);
+
+    free(clients);
+    free(threads);
+    free(f.raw.start);
+
+    return 0;
+}
+
+/**
+ * Sends synthetic 1080p YUYV frames, paced at BENCH_RTP_FPS, over RTP
+ * on loopback for BENCH_RTP_SECONDS, and reports the packet and syscall
+ * rates of both ends, the CPU they took together, and how many frames
+ * arrived intact
+ */
+#define BENCH_RTP_FPS     60
+#define BENCH_RTP_SECONDS 3
+
+typedef struct bench_rtp_sink {
+    webcam_sink_t   sink;
+    const uint8_t   *expected;
+    uint64_t        intact;
+} bench_rtp_sink_t;
+
+static void bench_rtp_push(webcam_sink_t *s, const webcam_frame_t *f)
+{
+    bench_rtp_sink_t *b = (bench_rtp_sink_t *)s;
+
+    if (0 == memcmp(f->raw.start, b->expected, f->raw.length)) b->intact++;
+}
+
+static int bench_rtp(void)
+{
+    webcam_rtp_receiver_t *rx;
+    webcam_rtp_t *tx;
+    bench_rtp_sink_t check;
+    webcam_frame_t f;
+    uint64_t start, next, elapsed, cpu, pushed = 0;
+
+    CLEAR(f);
+    f.width = 1920;
+    f.height = 1080;
+    f.raw.length = (size_t)f.width * f.height * 2;
+    f.raw.start = malloc(f.raw.length);
+    if (f.raw.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(f.raw.start, f.width, f.height, 2);
+
+    CLEAR(check);
+    check.sink.push = bench_rtp_push;
+    check.expected = f.raw.start;
+
+    rx = webcam_rtp_receiver_open(0, f.width, f.height, &check.sink);
+    tx = rx != NULL ? webcam_rtp_open("127.0.0.1", rx->port, f.width, f.height, 4) : NULL;
+    if (tx == NULL) {
+        if (rx != NULL) webcam_rtp_receiver_close(rx);
+        free(f.raw.start);
+        return EXIT_FAILURE;
+    }
+
+    cpu = bench_cpu(CLOCK_PROCESS_CPUTIME_ID);
+    start = next = bench_ns();
+    while (next - start < BENCH_RTP_SECONDS * 1000000000ull) {
+        while (bench_ns() < next) usleep(100);
+
+        f.sequence = pushed++;
+        f.timestamp = bench_ns();
+        tx->sink.push(&tx->sink, &f);
+        next += 1000000000ull / BENCH_RTP_FPS;
+    }
+    while (__atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE) != tx->head) usleep(100);
+    usleep(100000);
+    elapsed = bench_ns() - start;
+    cpu = bench_cpu(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+    printf("sender:   %llu of %llu frames, %.2f Gbit/s, %llu packets in %llu syscalls, %s\n",
+           (unsigned long long)tx->frames, (unsigned long long)pushed, 8.0 * tx->bytes / elapsed,
+           (unsigned long long)tx->packets, (unsigned long long)tx->syscalls, tx->gso ? "GSO" : "no GSO");
+    printf("receiver: %llu frames (%llu intact, %llu incomplete), %llu packets in %llu syscalls, "
+           "%llu lost, %s\n", (unsigned long long)rx->frames, (unsigned long long)check.intact,
+           (unsigned long long)rx->incomplete, (unsigned long long)rx->packets,
+           (unsigned long long)rx->syscalls, (unsigned long long)rx->lost, rx->gro ? "GRO" : "no GRO");
+    printf("CPU:      %.1f%% of a core for both ends\n", 100.0 * cpu / elapsed);
+
+    webcam_rtp_close(tx);
+    webcam_rtp_receiver_close(rx);
+
+    free(f.raw.start);
+
+    return 0;
+}
+
+/**
+ * Pushes synthetic 1080p frames, paced at BENCH_LOCAL_FPS, through a
+ * local frame server for BENCH_LOCAL_SECONDS, to one client taking the
+ * whole YUYV frame and one taking an RGB region, and reports the
+ * latency of the per-frame messages and how many frames were read
+ * before being overwritten
+ */
+#define BENCH_LOCAL_FPS     120
+#define BENCH_LOCAL_SECONDS 2
+#define BENCH_LOCAL_PATH    "@webcam-bench"
+
+typedef struct bench_local_client {
+    webcam_local_connection_t   *connection;
+    pthread_t                   thread;
+    uint64_t                    latencies[BENCH_LOCAL_FPS * BENCH_LOCAL_SECONDS + 16];
+    uint64_t                    frames;
+    uint64_t                    valid;
+    uint64_t                    checksum;
+} bench_local_client_t;
+
+static void *bench_local_reading(void *ptr)
+{
+    bench_local_client_t *b = (bench_local_client_t *)ptr;
+    webcam_local_message_t m;
+    const uint8_t *frame;
+    uint64_t now;
+    size_t i;
+
+    while ((frame = webcam_local_next(b->connection, &m)) != NULL) {
+        now = bench_ns();
+        if (b->frames < sizeof(b->latencies) / sizeof(b->latencies[0])) {
+            b->latencies[b->frames] = now - m.timestamp;
+        }
+        b->frames++;
+
+        // Touch every cache line, like a consumer would
+        for (i = 0; i < m.length; i += 64) b->checksum += frame[i];
+        if (webcam_local_valid(b->connection, &m)) b->valid++;
+    }
+
+    return NULL;
+}
+
+static int bench_local(void)
+{
+    static bench_local_client_t clients[2];
+    const char *names[2] = { "YUYV 1920x1080", "RGB 640x360 ROI" };
+    webcam_local_t *l;
+    webcam_frame_t f;
+    uint64_t start, next, pushed = 0, n;
+    int i;
+
+    CLEAR(f);
+    f.width = 1920;
+    f.height = 1080;
+    f.raw.length = (size_t)f.width * f.height * 2;
+    f.rgb.length = (size_t)f.width * f.height * 3;
+    f.raw.start = malloc(f.raw.length);
+    f.rgb.start = calloc(1, f.rgb.length);
+    if (f.raw.start == NULL || f.rgb.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(f.raw.start, f.width, f.height, 2);
+
+    l = webcam_local_open(BENCH_LOCAL_PATH, f.width, f.height, 4);
+    if (l == NULL) return EXIT_FAILURE;
+
+    CLEAR(clients);
+    clients[0].connection = webcam_local_connect(BENCH_LOCAL_PATH, V4L2_PIX_FMT_YUYV, 0, 0, 0, 0);
+    clients[1].connection = webcam_local_connect(BENCH_LOCAL_PATH, V4L2_PIX_FMT_RGB24, 640, 360, 640, 360);
+    if (clients[0].connection == NULL || clients[1].connection == NULL) return EXIT_FAILURE;
+    for (i = 0; i < 2; i++) pthread_create(&clients[i].thread, NULL, bench_local_reading, &clients[i]);
+
+    start = next = bench_ns();
+    while (next - start < BENCH_LOCAL_SECONDS * 1000000000ull) {
+        while (bench_ns() < next) usleep(100);
+
+        f.sequence = pushed++;
+        f.timestamp = bench_ns();
+        l->sink.push(&l->sink, &f);
+        next += 1000000000ull / BENCH_LOCAL_FPS;
+    }
+    usleep(100000);
+
+    for (i = 0; i < 2; i++) {
+        printf("%-16s %llu of %llu frames, %llu skipped, %llu read intact\n", names[i],
+               (unsigned long long)l->clients[i].frames, (unsigned long long)pushed,
+               (unsigned long long)l->clients[i].skipped, (unsigned long long)clients[i].valid);
+    }
+    webcam_local_close(l);
+
+    for (i = 0; i < 2; i++) {
+        pthread_join(clients[i].thread, NULL);
+        webcam_local_disconnect(clients[i].connection);
+
+        n = clients[i].frames < sizeof(clients[i].latencies) / sizeof(uint64_t) ?
+            clients[i].frames : sizeof(clients[i].latencies) / sizeof(uint64_t);
+        if (n == 0) continue;
+        qsort(clients[i].latencies, n, sizeof(uint64_t), bench_compare);
+        printf("%-16s latency p50 %.1f us, p99 %.1f us, max %.1f us (push to receipt, copy included)\n",
+               names[i], clients[i].latencies[n / 2] / 1e3, clients[i].latencies[n * 99 / 100] / 1e3,
+               clients[i].latencies[n - 1] / 1e3);
+    }
+
+    free(f.raw.start);
+    free(f.rgb.start);
+
+    return 0;
+}
+
+/**
+ * Makes a full-size RGB, a 640x360 RGB and a 160x90 RGB output from
+ * synthetic 1080p YUYV frames, once as three separate passes and once
+ * fused. Then times the whole publishing of a frame with these outputs,
+ * once converting the frame and making the outputs in passes of their
+ * own, and once with the frame made along with the outputs. The frame
+ * is flushed from the caches before every pass, like a fresh capture,
+ * and passes are timed in thread CPU time.
+ */
+static uint64_t bench_outputs_run(webcam_t *w, webcam_t *convert, buffer_t *raw, bool publish)
+{
+    struct v4l2_buffer buf;
+    uint64_t times[BENCH_RUNS], start;
+    int i;
+
+    CLEAR(buf);
+    for (i = 0; i < BENCH_WARMUP + BENCH_RUNS; i++) {
+        buf.sequence = i;
+        bench_flush(raw->start, raw->length);
+        start = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        if (!publish) {
+            _outputs_make(w, raw, &buf, false);
+        } else if (convert != NULL) {
+            _publish(convert, &buf);
+            _outputs_make(w, raw, &buf, false);
+        } else {
+            _publish(w, &buf);
+        }
+        if (i >= BENCH_WARMUP) times[i - BENCH_WARMUP] = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - start;
+    }
+    qsort(times, BENCH_RUNS, sizeof(uint64_t), bench_compare);
+
+    return times[BENCH_RUNS / 2];
+}
+
+static int bench_outputs(void)
+{
+    static const uint16_t sizes[3][2] = { { 1920, 1080 }, { 640, 360 }, { 160, 90 } };
+    webcam_t *all, *bare, *single[3];
+    buffer_t raw;
+    uint64_t separate = 0, fused, apart, together, times[1];
+    int i;
+
+    raw.length = 1920 * 1080 * 2;
+    raw.start = malloc(raw.length);
+    if (raw.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(raw.start, 1920, 1080, 2);
+
+    all = _webcam_new("fused", -1);
+    bare = _webcam_new("bare", -1);
+    all->width = bare->width = 1920;
+    all->height = bare->height = 1080;
+    all->pixelformat = bare->pixelformat = V4L2_PIX_FMT_YUYV;
+    all->nbuffers = bare->nbuffers = 1;
+    all->buffers = bare->buffers = &raw;
+    for (i = 0; i < 3; i++) {
+        single[i] = _webcam_new("single", -1);
+        single[i]->width = 1920;
+        single[i]->height = 1080;
+        single[i]->pixelformat = V4L2_PIX_FMT_YUYV;
+        webcam_output_add(single[i], V4L2_PIX_FMT_RGB24, sizes[i][0], sizes[i][1], 0, 0, 0, 0);
+        webcam_output_add(all, V4L2_PIX_FMT_RGB24, sizes[i][0], sizes[i][1], 0, 0, 0, 0);
+
+        times[0] = bench_outputs_run(single[i], NULL, &raw, false);
+        printf("%4ux%-4u alone      %8.3f ms\n", sizes[i][0], sizes[i][1], times[0] / 1e6);
+        separate += times[0];
+    }
+    fused = bench_outputs_run(all, NULL, &raw, false);
+    apart = bench_outputs_run(all, bare, &raw, true);
+    together = bench_outputs_run(all, NULL, &raw, true);
+
+    printf("three separate passes %8.3f ms\n", separate / 1e6);
+    printf("one fused pass        %8.3f ms\n", fused / 1e6);
+    printf("publish, frame apart  %8.3f ms (convertToRGB, then the outputs)\n", apart / 1e6);
+    printf("publish, frame fused  %8.3f ms (copied from the full-size output)\n", together / 1e6);
+
+    all->buffers = bare->buffers = NULL;
+    all->nbuffers = bare->nbuffers = 0;
+    for (i = 0; i < 3; i++) webcam_close(single[i]);
+    webcam_close(all);
+    webcam_close(bare);
+    free(raw.start);
+
+    return 0;
+}
+
+/**
+ * Makes a pyramid of five levels from synthetic 1080p YUYV frames, with
+ * and without RGB, and compares it with building the luma levels one
+ * after the other with plain loops, as a consumer of the frame would
+ */
+static void bench_pyramid_plain(const buffer_t *raw, uint8_t *data, uint16_t width, uint16_t height,
+                                uint8_t levels)
+{
+    uint8_t *above, *level;
+    uint32_t x, y, i;
+
+    for (i = 0; i < (uint32_t)width * height; i++) data[i] = raw->start[2 * i];
+
+    for (above = data, level = data + (size_t)width * height; levels > 1; levels--) {
+        for (y = 0; y < height / 2u; y++) {
+            for (x = 0; x < width / 2u; x++) {
+                level[y * (width / 2) + x] = (above[2 * y * width + 2 * x] + above[2 * y * width + 2 * x + 1] +
+                                              above[(2 * y + 1) * width + 2 * x] +
+                                              above[(2 * y + 1) * width + 2 * x + 1] + 2) >> 2;
+            }
+        }
+        width /= 2;
+        height /= 2;
+        above = level;
+        level += (size_t)width * height;
+    }
+}
+
+static int bench_pyramid(void)
+{
+    webcam_t *w;
+    buffer_t raw;
+    struct v4l2_buffer buf;
+    uint64_t times[BENCH_RUNS], start;
+    uint8_t *plain;
+    int i, rgb;
+
+    raw.length = 1920 * 1080 * 2;
+    raw.start = malloc(raw.length);
+    plain = malloc(raw.length);
+    if (raw.start == NULL || plain == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(raw.start, 1920, 1080, 2);
+
+    w = _webcam_new("pyramid", -1);
+    w->width = 1920;
+    w->height = 1080;
+    w->pixelformat = V4L2_PIX_FMT_YUYV;
+
+    for (rgb = 0; rgb < 2; rgb++) {
+        webcam_pyramid(w, 5, rgb);
+        CLEAR(buf);
+        for (i = 0; i < BENCH_WARMUP + BENCH_RUNS; i++) {
+            bench_flush(raw.start, raw.length);
+            start = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+            _pyramid_make(w, &raw, &buf);
+            if (i >= BENCH_WARMUP) times[i - BENCH_WARMUP] = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - start;
+        }
+        qsort(times, BENCH_RUNS, sizeof(uint64_t), bench_compare);
+        printf("%-24s %8.3f ms, %zu bytes\n", rgb ? "pyramid, luma and RGB" : "pyramid, luma",
+               times[BENCH_RUNS / 2] / 1e6, w->pyramid.data.length);
+    }
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        bench_flush(raw.start, raw.length);
+        start = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        bench_pyramid_plain(&raw, plain, 1920, 1080, 5);
+        times[i] = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - start;
+    }
+    qsort(times, BENCH_RUNS, sizeof(uint64_t), bench_compare);
+    printf("%-24s %8.3f ms\n", "level by level, luma", times[BENCH_RUNS / 2] / 1e6);
+
+    webcam_close(w);
+    free(raw.start);
+    free(plain);
+
+    return 0;
+}
+
+/**
+ * Converts synthetic 1080p YUYV frames to RGB while making the integral
+ * image, on the capture thread and a worker per other CPU, and compares
+ * it with convertToRGB() alone and followed by a separate pass summing
+ * the luma. Times are wall clock, as the workers take part.
+ */
+static int bench_integral(void)
+{
+    struct v4l2_buffer buf;
+    webcam_t *w;
+    buffer_t raw, rgb;
+    uint32_t *table, x, y, sum;
+    uint64_t times[3][BENCH_RUNS], start;
+    int i;
+
+    raw.length = 1920 * 1080 * 2;
+    raw.start = malloc(raw.length);
+    table = malloc(1921 * 1081 * sizeof(uint32_t));
+    rgb.start = NULL;
+    if (raw.start == NULL || table == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(raw.start, 1920, 1080, 2);
+
+    w = _webcam_new("integral", -1);
+    w->width = 1920;
+    w->height = 1080;
+    w->pixelformat = V4L2_PIX_FMT_YUYV;
+    w->nbuffers = 1;
+    w->buffers = &raw;
+    webcam_integral(w, true);
+
+    CLEAR(buf);
+    for (i = 0; i < BENCH_RUNS; i++) {
+        bench_flush(raw.start, raw.length);
+        start = bench_ns();
+        convertToRGB(raw, &rgb);
+        times[0][i] = bench_ns() - start;
+
+        bench_flush(raw.start, raw.length);
+        start = bench_ns();
+        convertToRGB(raw, &rgb);
+        memset(table, 0, 1921 * sizeof(uint32_t));
+        for (y = 0; y < 1080; y++) {
+            table[(y + 1) * 1921] = 0;
+            for (x = 0, sum = 0; x < 1920; x++) {
+                sum += raw.start[(y * 1920 + x) * 2];
+                table[(y + 1) * 1921 + x + 1] = table[y * 1921 + x + 1] + sum;
+            }
+        }
+        times[1][i] = bench_ns() - start;
+
+        bench_flush(raw.start, raw.length);
+        start = bench_ns();
+        pthread_mutex_lock(&w->mtx_frame);
+        _convert_integral(w, &raw);
+        pthread_mutex_unlock(&w->mtx_frame);
+        times[2][i] = bench_ns() - start;
+    }
+
+    for (i = 0; i < 3; i++) qsort(times[i], BENCH_RUNS, sizeof(uint64_t), bench_compare);
+    printf("convertToRGB alone               %8.3f ms\n", times[0][BENCH_RUNS / 2] / 1e6);
+    printf("convertToRGB, then integral      %8.3f ms\n", times[1][BENCH_RUNS / 2] / 1e6);
+    printf("fused in %2u blocks on %u threads %8.3f ms\n", w->job.blocks, w->nworkers + 1,
+           times[2][BENCH_RUNS / 2] / 1e6);
+    if (0 != memcmp(table, w->integral.table.start, 1921 * 1081 * sizeof(uint32_t))) {
+        printf("integral images differ\n");
+    }
+
+    w->buffers = NULL;
+    w->nbuffers = 0;
+    webcam_close(w);
+    free(raw.start);
+    free(rgb.start);
+    free(table);
+
+    return 0;
+}
+
+/**
+ * Records 100 seconds of synthetic 30 fps VGA frames with a triggered
+ * recorder, triggered once by call and once by motion, and reports how
+ * much was written compared to recording everything
+ */
+static int bench_trigger(const char *dir)
+{
+    char path[4096];
+    webcam_recorder_t *rec;
+    webcam_motion_t motion;
+    webcam_frame_t f;
+    uint64_t cpu, continuous;
+    uint32_t i, frames = 3000;
+
+    CLEAR(f);
+    CLEAR(motion);
+    f.width = 640;
+    f.height = 480;
+    f.raw.length = (size_t)f.width * f.height * 2;
+    f.raw.start = malloc(f.raw.length);
+    if (f.raw.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(f.raw.start, f.width, f.height, 2);
+
+    // Two seconds of pre-roll, three of post-roll
+    snprintf(path, sizeof(path), "%s/webcam-trigger.wca", dir);
+    rec = webcam_recorder_open(path, WEBCAM_RECORD_RAW, WEBCAM_CODEC_NONE, f.raw.length, 8);
+    if (rec == NULL || -1 == webcam_recorder_trigger_setup(rec, 2000, 3000, 10, 30)) {
+        if (rec != NULL) webcam_recorder_close(rec);
+        free(f.raw.start);
+        return EXIT_FAILURE;
+    }
+
+    cpu = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+    for (i = 0; i < frames; i++) {
+        if (i == 1000) webcam_recorder_trigger(rec);
+        motion.moving = i == 2000 ? 40 : 0;
+        f.motion = &motion;
+        f.sequence = i;
+        f.timestamp = 1000000000ull + i * 1000000000ull / 30;
+        rec->sink.push(&rec->sink, &f);
+
+        // Let the writer keep up, as it would at 30 fps
+        while (rec->head - __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE) == rec->nslots) usleep(100);
+    }
+    cpu = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    continuous = (uint64_t)frames * (WEBCAM_ARCHIVE_PAGE + _page_align(f.raw.length));
+
+    printf("triggers %llu, frames written %llu of %u, idle %llu, dropped %llu\n",
+           (unsigned long long)rec->triggers, (unsigned long long)rec->frames, frames,
+           (unsigned long long)rec->idle, (unsigned long long)rec->dropped);
+    printf("%.1f MB written instead of %.1f MB, %.1f%% less disk I/O\n",
+           rec->bytes / 1e6, continuous / 1e6, 100.0 - 100.0 * rec->bytes / continuous);
+    printf("capture thread per frame         %8.3f ms\n", cpu / 1e6 / frames);
+
+    webcam_recorder_close(rec);
+    unlink(path);
+    free(f.raw.start);
+
+    return 0;
+}
+
+/**
+ * Publishes 1080p frames of a mostly static noisy scene, in which a
+ * square moves every tenth frame, with and without duplicate
+ * suppression, and reports the frames skipped and the CPU saved
+ */
+static int bench_dedup(void)
+{
+    struct v4l2_buffer buf;
+    webcam_stats_t stats;
+    webcam_t *w;
+    buffer_t raw, noisy[4];
+    uint64_t cpu[2], saved;
+    uint16_t x, y, left = 0;
+    int i, j, pass;
+
+    raw.length = 1920 * 1080 * 2;
+    raw.start = malloc(raw.length);
+    for (i = 0; i < 4; i++) {
+        noisy[i].length = raw.length;
+        noisy[i].start = malloc(raw.length);
+        if (raw.start == NULL || noisy[i].start == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The same scene with different sensor noise
+    bench_scene(raw.start, 1920, 1080, 0);
+    for (i = 0; i < 4; i++) {
+        memcpy(noisy[i].start, raw.start, raw.length);
+        for (j = 0; j < 1920 * 1080; j++) noisy[i].start[j * 2] = _clamp8(raw.start[j * 2] + rand() % 5 - 2);
+    }
+
+    w = _webcam_new("dedup", -1);
+    w->width = 1920;
+    w->height = 1080;
+    w->pixelformat = V4L2_PIX_FMT_YUYV;
+    w->nbuffers = 1;
+    w->buffers = &raw;
+
+    CLEAR(buf);
+    for (pass = 0; pass < 2; pass++) {
+        webcam_dedup(w, pass == 1, 3);
+        webcam_stats_reset(w);
+        cpu[pass] = 0;
+        for (i = 0; i < 10 * BENCH_RUNS; i++) {
+            memcpy(raw.start, noisy[i % 4].start, raw.length);
+            if (i % 10 == 0) left = 100 + 8 * i;
+            for (y = 500; y < 564; y++) {
+                for (x = left; x < left + 64; x++) raw.start[((size_t)y * 1920 + x) * 2] = 235;
+            }
+
+            buf.sequence = i;
+            bench_flush(raw.start, raw.length);
+            cpu[pass] -= bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+            _publish(w, &buf);
+            cpu[pass] += bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        }
+    }
+
+    webcam_stats(w, &stats);
+    saved = stats.duplicates * (stats.convert_ns / (stats.checked - stats.duplicates)) - stats.check_ns;
+    printf("frames %llu, duplicates %llu (%.1f%%)\n", (unsigned long long)stats.checked,
+           (unsigned long long)stats.duplicates, 100.0 * stats.duplicates / stats.checked);
+    printf("check per frame                  %8.3f ms\n", stats.check_ns / 1e6 / stats.checked);
+    printf("convert per changed frame        %8.3f ms\n",
+           stats.convert_ns / 1e6 / (stats.checked - stats.duplicates));
+    printf("CPU without suppression          %8.3f ms/frame\n", cpu[0] / 1e6 / (10 * BENCH_RUNS));
+    printf("CPU with suppression             %8.3f ms/frame\n", cpu[1] / 1e6 / (10 * BENCH_RUNS));
+    printf("saved, from the stats            %8.1f%%\n", 100.0 * saved / cpu[0]);
+
+    w->buffers = NULL;
+    w->nbuffers = 0;
+    webcam_close(w);
+    free(raw.start);
+    for (i = 0; i < 4; i++) free(noisy[i].start);
+
+    return 0;
+}
+
+/**
+ * Measures the sharpness of a sharp and of a blurred 1080p scene, and
+ * compares its cost with that of the RGB conversion
+ */
+static int bench_sharpness(void)
+{
+    struct v4l2_buffer buf;
+    webcam_t *w;
+    buffer_t raw, blurred, swap, rgb;
+    uint64_t times[2][BENCH_RUNS], start;
+    float sharp, blurry;
+    uint32_t x, y, k, sum;
+    int i;
+
+    raw.length = blurred.length = 1920 * 1080 * 2;
+    raw.start = malloc(raw.length);
+    blurred.start = malloc(blurred.length);
+    rgb.start = NULL;
+    if (raw.start == NULL || blurred.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(raw.start, 1920, 1080, 2);
+
+    // Box blur of the luma over 9 pixels, horizontally into blurred, then vertically back
+    memcpy(blurred.start, raw.start, raw.length);
+    for (y = 0; y < 1080; y++) {
+        for (x = 4; x + 4 < 1920; x++) {
+            for (k = 0, sum = 0; k < 9; k++) sum += raw.start[(y * 1920 + x + k - 4) * 2];
+            blurred.start[(y * 1920 + x) * 2] = sum / 9;
+        }
+    }
+    memcpy(raw.start, blurred.start, raw.length);
+    for (y = 4; y + 4 < 1080; y++) {
+        for (x = 0; x < 1920; x++) {
+            for (k = 0, sum = 0; k < 9; k++) sum += blurred.start[((y + k - 4) * 1920 + x) * 2];
+            raw.start[(y * 1920 + x) * 2] = sum / 9;
+        }
+    }
+    swap = raw;
+    raw = blurred;
+    blurred = swap;
+    bench_scene(raw.start, 1920, 1080, 2);
+
+    w = _webcam_new("sharpness", -1);
+    w->width = 1920;
+    w->height = 1080;
+    w->pixelformat = V4L2_PIX_FMT_YUYV;
+
+    CLEAR(buf);
+    for (i = 0; i < BENCH_WARMUP + BENCH_RUNS; i++) {
+        bench_flush(raw.start, raw.length);
+        start = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        convertToRGB(raw, &rgb);
+        if (i >= BENCH_WARMUP) times[0][i - BENCH_WARMUP] = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - start;
+
+        bench_flush(raw.start, raw.length);
+        start = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        sharp = _sharpness_measure(w, &raw, &buf);
+        if (i >= BENCH_WARMUP) times[1][i - BENCH_WARMUP] = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - start;
+    }
+    blurry = _sharpness_measure(w, &blurred, &buf);
+
+    for (i = 0; i < 2; i++) qsort(times[i], BENCH_RUNS, sizeof(uint64_t), bench_compare);
+    printf("sharpness, sharp scene           %8.1f\n", sharp);
+    printf("sharpness, blurred scene         %8.1f\n", blurry);
+    printf("convertToRGB                     %8.3f ms\n", times[0][BENCH_RUNS / 2] / 1e6);
+    printf("sharpness                        %8.3f ms, %.2f%% of the conversion\n",
+           times[1][BENCH_RUNS / 2] / 1e6, 100.0 * times[1][BENCH_RUNS / 2] / times[0][BENCH_RUNS / 2]);
+
+    webcam_close(w);
+    free(raw.start);
+    free(blurred.start);
+    free(rgb.start);
+
+    return 0;
+}
+
+/**
+ * Feeds a group of three synthetic VGA webcams, triggered together at
+ * 30 fps but delivering every frame after a random delay of up to
+ * 20 ms. Reports the latency and skew of the sets matched during
+ * BENCH_GROUP_SECONDS, then the skew of taking every webcam's latest
+ * frame in turn at random times during as many seconds
+ */
+#define BENCH_GROUP_SECONDS 3
+
+typedef struct bench_group_camera {
+    webcam_group_member_t   *member;
+    uint64_t                start;
+    unsigned int            seed;
+    bool                    running;
+} bench_group_camera_t;
+
+static void *bench_group_pushing(void *ptr)
+{
+    bench_group_camera_t *c = (bench_group_camera_t *)ptr;
+    struct timespec ts;
+    webcam_frame_t f;
+    uint64_t due;
+    uint32_t n;
+
+    CLEAR(f);
+    f.width = 640;
+    f.height = 480;
+    f.rgb.length = 640 * 480 * 3;
+    f.rgb.start = calloc(1, f.rgb.length);
+
+    for (n = 0; __atomic_load_n(&c->running, __ATOMIC_ACQUIRE); n++) {
+        f.sequence = n;
+        f.timestamp = c->start + n * 1000000000ull / 30 + rand_r(&c->seed) % 2000000;
+
+        due = c->start + n * 1000000000ull / 30 + rand_r(&c->seed) % 20000000;
+        ts.tv_sec = due / 1000000000ull;
+        ts.tv_nsec = due % 1000000000ull;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+
+        c->member->sink.push(&c->member->sink, &f);
+    }
+    free(f.rgb.start);
+
+    return NULL;
+}
+
+static int bench_group(void)
+{
+    bench_group_camera_t cameras[3];
+    pthread_t threads[3];
+    webcam_t *webcams[3];
+    webcam_group_t *g;
+    webcam_group_slot_t *slot;
+    webcam_histogram_t naive;
+    buffer_t frames[3];
+    uint64_t timestamps[3], start, lo, hi;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        webcams[i] = _webcam_new("group", -1);
+        webcams[i]->width = 640;
+        webcams[i]->height = 480;
+        frames[i].start = NULL;
+        frames[i].length = 0;
+    }
+
+    g = webcam_group_open(webcams, 3, 5000);
+    if (g == NULL) return EXIT_FAILURE;
+
+    start = _now() + 10000000;
+    for (i = 0; i < 3; i++) {
+        cameras[i].member = &g->member[i];
+        cameras[i].start = start;
+        cameras[i].seed = i + 1;
+        cameras[i].running = true;
+        pthread_create(&threads[i], NULL, bench_group_pushing, &cameras[i]);
+    }
+
+    CLEAR(naive);
+    while (_now() < start + BENCH_GROUP_SECONDS * 1000000000ull) webcam_group_grab(g, frames, timestamps, 100);
+
+    // What grabbing every webcam's latest frame in turn gives, at random times
+    while (_now() < start + 2 * BENCH_GROUP_SECONDS * 1000000000ull) {
+        usleep(rand() % 33000);
+        lo = UINT64_MAX;
+        hi = 0;
+        for (i = 0; i < 3; i++) {
+            slot = &g->member[i].slots[(__atomic_load_n(&g->member[i].head, __ATOMIC_ACQUIRE) - 1) %
+                                       WEBCAM_GROUP_HISTORY];
+            timestamps[i] = __atomic_load_n(&slot->timestamp, __ATOMIC_RELAXED);
+            if (timestamps[i] < lo) lo = timestamps[i];
+            if (timestamps[i] > hi) hi = timestamps[i];
+        }
+        _stats_record(&naive, hi - lo);
+    }
+
+    for (i = 0; i < 3; i++) __atomic_store_n(&cameras[i].running, false, __ATOMIC_RELEASE);
+    for (i = 0; i < 3; i++) pthread_join(threads[i], NULL);
+
+    printf("sets %llu in %d s, copies started over %llu\n", (unsigned long long)g->sets,
+           BENCH_GROUP_SECONDS, (unsigned long long)g->retries);
+    printf("match latency  p50 %8.3f ms  p99 %8.3f ms\n",
+           webcam_stats_percentile(&g->latency, 0.50) / 1e6, webcam_stats_percentile(&g->latency, 0.99) / 1e6);
+    printf("matched skew   p50 %8.3f ms  max %8.3f ms\n",
+           webcam_stats_percentile(&g->skew, 0.50) / 1e6, g->skew.max / 1e6);
+    printf("latest skew    p50 %8.3f ms  max %8.3f ms\n",
+           webcam_stats_percentile(&naive, 0.50) / 1e6, naive.max / 1e6);
+
+    webcam_group_close(g);
+    for (i = 0; i < 3; i++) {
+        webcam_close(webcams[i]);
+        free(frames[i].start);
+    }
+
+    return 0;
+}
+
+/**
+ * Composites sixteen synthetic 1080p webcams into a 4x4 mosaic of
+ * 480x270 tiles, written by the fused kernel, and compares it with
+ * grabbing every converted frame and box-scaling it into its tile.
+ * Then two webcams capture BENCH_MOSAIC_FRAMES frames each into tiles
+ * of two mosaics swapped 1000 times a second, in opposite orders, and
+ * one of them into two tiles of the same mosaic, which must not hang.
+ */
+#define BENCH_MOSAIC_FRAMES 20000
+
+typedef struct bench_mosaic_camera {
+    webcam_t    *webcam;
+    buffer_t    raw;
+    uint32_t    frames;     // Made so far
+} bench_mosaic_camera_t;
+
+static void *bench_mosaic_capturing(void *ptr)
+{
+    bench_mosaic_camera_t *c = (bench_mosaic_camera_t *)ptr;
+    struct v4l2_buffer buf;
+    uint32_t n;
+
+    CLEAR(buf);
+    for (n = 0; n < BENCH_MOSAIC_FRAMES; n++) {
+        buf.sequence = n;
+        _outputs_make(c->webcam, &c->raw, &buf, false);
+        __atomic_store_n(&c->frames, n + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static int bench_mosaic(void)
+{
+    bench_mosaic_camera_t cameras[2];
+    pthread_t threads[2];
+    webcam_mosaic_t *crossed[2];
+    uint32_t made, last;
+    webcam_t *webcams[16];
+    webcam_mosaic_t *m;
+    webcam_mosaic_tile_t tiles[16];
+    webcam_output_t *check;
+    struct v4l2_buffer buf;
+    buffer_t raw, rgb, copy, mosaic, tile;
+    uint64_t times[2][BENCH_RUNS], start, oldest;
+    uint32_t x, y, k, r, g, b;
+    uint8_t *src, *dst;
+    int i, n;
+
+    raw.length = 1920 * 1080 * 2;
+    raw.start = malloc(raw.length);
+    copy.length = 1920 * 1080 * 3;
+    copy.start = malloc(copy.length);
+    mosaic.length = copy.length;
+    mosaic.start = malloc(mosaic.length);
+    rgb.start = tile.start = NULL;
+    if (raw.start == NULL || copy.start == NULL || mosaic.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(raw.start, 1920, 1080, 2);
+    convertToRGB(raw, &rgb);
+
+    m = webcam_mosaic_open(4, 4, 480, 270, 30);
+    if (m == NULL) return EXIT_FAILURE;
+    for (n = 0; n < 16; n++) {
+        webcams[n] = _webcam_new("mosaic", -1);
+        webcams[n]->width = 1920;
+        webcams[n]->height = 1080;
+        webcams[n]->pixelformat = V4L2_PIX_FMT_YUYV;
+        webcam_mosaic_add(m, webcams[n], n % 4, n / 4);
+    }
+
+    CLEAR(buf);
+    for (i = 0; i < BENCH_WARMUP + BENCH_RUNS; i++) {
+        buf.sequence = i;
+        start = 0;
+        for (n = 0; n < 16; n++) {
+            bench_flush(raw.start, raw.length);
+            start -= bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+            _outputs_make(webcams[n], &raw, &buf, false);
+            start += bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        }
+        if (i >= BENCH_WARMUP) times[0][i - BENCH_WARMUP] = start;
+
+        // The grab-and-blit loop, from frames converted by the capture threads
+        start = 0;
+        for (n = 0; n < 16; n++) {
+            bench_flush(rgb.start, rgb.length);
+            start -= bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+            memcpy(copy.start, rgb.start, rgb.length);
+            for (y = 0; y < 270; y++) {
+                dst = mosaic.start + (((size_t)(n / 4) * 270 + y) * 1920 + (n % 4) * 480) * 3;
+                for (x = 0; x < 480; x++, dst += 3) {
+                    for (k = r = g = b = 0; k < 16; k++) {
+                        src = copy.start + (((size_t)y * 4 + k / 4) * 1920 + x * 4 + k % 4) * 3;
+                        r += src[0];
+                        g += src[1];
+                        b += src[2];
+                    }
+                    dst[0] = (r + 8) / 16;
+                    dst[1] = (g + 8) / 16;
+                    dst[2] = (b + 8) / 16;
+                }
             }
+            start += bench_cpu(CLOCK_THREAD_CPUTIME_ID);
         }
+        if (i >= BENCH_WARMUP) times[1][i - BENCH_WARMUP] = start;
+    }
+    for (i = 0; i < 2; i++) qsort(times[i], BENCH_RUNS, sizeof(uint64_t), bench_compare);
 
-        // Turn on streaming
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (-1 == _ioctl(w->fd, VIDIOC_STREAMON, &type)) {
-            fprintf(stderr, "Could not turn on streaming on %s\n", w->name);
-            return;
+    // A tile matches the same output made on its own
+    check = webcam_output_add(webcams[0], V4L2_PIX_FMT_RGB24, 480, 270, 0, 0, 0, 0);
+    _outputs_make(webcams[0], &raw, &buf, false);
+    usleep(100000);
+    webcam_mosaic_grab(m, &mosaic, tiles);
+    webcam_output_grab(check, &tile);
+    for (y = 0, k = 0; y < 270; y++) k |= memcmp(mosaic.start + (size_t)y * 1920 * 3, tile.start + y * 480 * 3, 480 * 3);
+    for (n = 0, oldest = 0; n < 16; n++) if (tiles[n].age > oldest) oldest = tiles[n].age;
+
+    printf("mosaic 4x4 of 1080p, %llu ticks, tile ages %.0f to %.0f ms, tile %s\n",
+           (unsigned long long)m->published, tiles[0].age / 1e6, oldest / 1e6, k ? "differs" : "matches");
+    printf("grab and blit, 16 cameras        %8.3f ms, %.2f cores at 30 fps\n",
+           times[1][BENCH_RUNS / 2] / 1e6, times[1][BENCH_RUNS / 2] * 30 / 1e9);
+    printf("written in place, 16 cameras     %8.3f ms, %.2f cores at 30 fps\n",
+           times[0][BENCH_RUNS / 2] / 1e6, times[0][BENCH_RUNS / 2] * 30 / 1e9);
+
+    // Webcam 0 goes into mosaic 0 then 1, webcam 1 into 1 then 0, and webcam 0 twice into mosaic 0
+    crossed[0] = webcam_mosaic_open(3, 1, 64, 36, 1000);
+    crossed[1] = webcam_mosaic_open(2, 1, 64, 36, 1000);
+    if (crossed[0] == NULL || crossed[1] == NULL) return EXIT_FAILURE;
+    for (n = 0; n < 2; n++) {
+        cameras[n].webcam = _webcam_new("crossed", -1);
+        cameras[n].webcam->width = 256;
+        cameras[n].webcam->height = 144;
+        cameras[n].webcam->pixelformat = V4L2_PIX_FMT_YUYV;
+        cameras[n].raw.length = 256 * 144 * 2;
+        cameras[n].raw.start = malloc(cameras[n].raw.length);
+        if (cameras[n].raw.start == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
         }
+        bench_scene(cameras[n].raw.start, 256, 144, n);
+        cameras[n].frames = 0;
+    }
+    webcam_mosaic_add(crossed[0], cameras[0].webcam, 0, 0);
+    webcam_mosaic_add(crossed[1], cameras[0].webcam, 0, 0);
+    webcam_mosaic_add(crossed[0], cameras[0].webcam, 2, 0);
+    webcam_mosaic_add(crossed[1], cameras[1].webcam, 1, 0);
+    webcam_mosaic_add(crossed[0], cameras[1].webcam, 1, 0);
 
-        // Set streaming to true and start thread
-        w->streaming = true;
-        pthread_create(&w->thread, NULL, webcam_streaming, (void *)w);
-    } else {
-        // Set streaming to false and wait for thread to finish
-        w->streaming = false;
-        pthread_join(w->thread, NULL);
+    for (n = 0; n < 2; n++) pthread_create(&threads[n], NULL, bench_mosaic_capturing, &cameras[n]);
+    for (made = 0, last = UINT32_MAX; made < 2 * BENCH_MOSAIC_FRAMES; ) {
+        usleep(1000000);
+        made = __atomic_load_n(&cameras[0].frames, __ATOMIC_ACQUIRE) +
+               __atomic_load_n(&cameras[1].frames, __ATOMIC_ACQUIRE);
+        if (made == last) {
+            // Nothing to clean up, as the capture threads are stuck
+            printf("crossed tiles deadlocked after %u of %u frames\n", made, 2 * BENCH_MOSAIC_FRAMES);
+            return EXIT_FAILURE;
+        }
+        last = made;
+    }
+    for (n = 0; n < 2; n++) pthread_join(threads[n], NULL);
+    printf("crossed tiles, 2 webcams in 2 mosaics, %u frames, %llu and %llu ticks\n",
+           made, (unsigned long long)crossed[0]->published, (unsigned long long)crossed[1]->published);
 
-        // Turn off streaming
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (-1 == _ioctl(w->fd, VIDIOC_STREAMOFF, &type)) {
-            fprintf(stderr, "Could not turn streaming off on %s\n", w->name);
-            return;
+    for (n = 0; n < 2; n++) {
+        webcam_mosaic_close(crossed[n]);
+        webcam_close(cameras[n].webcam);
+        free(cameras[n].raw.start);
+    }
+    webcam_mosaic_close(m);
+    for (n = 0; n < 16; n++) webcam_close(webcams[n]);
+    free(raw.start);
+    free(rgb.start);
+    free(copy.start);
+    free(mosaic.start);
+    free(tile.start);
+
+    return 0;
+}
+
+/**
+ * Converts rounds of frames of one 4K and three 720p webcams, every
+ * webcam on a thread of its own as if capturing, all starting a round
+ * together. Compares the round time and the latency per webcam with
+ * every webcam converting on its own thread, and with the webcams
+ * sharing a scheduler with a worker per CPU.
+ */
+#define BENCH_SCHEDULE_ROUNDS   5
+#define BENCH_SCHEDULE_WEBCAMS  4
+
+typedef struct bench_schedule_camera {
+    webcam_t            *webcam;
+    buffer_t            raw;
+    pthread_barrier_t   *round;
+    uint64_t            latency[BENCH_SCHEDULE_ROUNDS];
+} bench_schedule_camera_t;
+
+static void *bench_schedule_converting(void *ptr)
+{
+    bench_schedule_camera_t *c = (bench_schedule_camera_t *)ptr;
+    struct v4l2_buffer buf;
+    uint64_t start;
+    int i;
+
+    CLEAR(buf);
+    for (i = 0; i < BENCH_SCHEDULE_ROUNDS; i++) {
+        pthread_barrier_wait(c->round);
+        buf.sequence = i;
+        start = bench_ns();
+        _publish(c->webcam, &buf);
+        c->latency[i] = bench_ns() - start;
+    }
+
+    return NULL;
+}
+
+static int bench_schedule(void)
+{
+    static const uint16_t sizes[BENCH_SCHEDULE_WEBCAMS][2] = {{3840, 2160}, {1280, 720}, {1280, 720}, {1280, 720}};
+    bench_schedule_camera_t cameras[BENCH_SCHEDULE_WEBCAMS];
+    pthread_t threads[BENCH_SCHEDULE_WEBCAMS];
+    pthread_barrier_t round;
+    webcam_scheduler_t *s = NULL;
+    webcam_stats_t stats;
+    buffer_t rgb = {NULL, 0};
+    uint64_t start, wall, cpu, stolen = 0, late = 0;
+    int i, pass;
+
+    for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) {
+        cameras[i].raw.length = (size_t)sizes[i][0] * sizes[i][1] * 2;
+        cameras[i].raw.start = malloc(cameras[i].raw.length);
+        if (cameras[i].raw.start == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        bench_scene(cameras[i].raw.start, sizes[i][0], sizes[i][1], 2);
+
+        cameras[i].webcam = _webcam_new("schedule", -1);
+        cameras[i].webcam->width = sizes[i][0];
+        cameras[i].webcam->height = sizes[i][1];
+        cameras[i].webcam->pixelformat = V4L2_PIX_FMT_YUYV;
+        cameras[i].webcam->nbuffers = 1;
+        cameras[i].webcam->buffers = &cameras[i].raw;
+        cameras[i].round = &round;
+    }
+
+    printf("1 x 3840x2160 and %d x 1280x720 webcams, %ld CPUs, %d rounds\n", BENCH_SCHEDULE_WEBCAMS - 1,
+           sysconf(_SC_NPROCESSORS_ONLN), BENCH_SCHEDULE_ROUNDS);
+    printf("                          round   3840x2160    1280x720         CPU\n");
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            s = webcam_scheduler_open(0);
+            if (s == NULL) return EXIT_FAILURE;
+            for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) webcam_scheduler_add(s, cameras[i].webcam, 33000);
+        }
+
+        pthread_barrier_init(&round, NULL, BENCH_SCHEDULE_WEBCAMS);
+        cpu = bench_cpu(CLOCK_PROCESS_CPUTIME_ID);
+        start = bench_ns();
+        for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) {
+            pthread_create(&threads[i], NULL, bench_schedule_converting, &cameras[i]);
         }
+        for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) pthread_join(threads[i], NULL);
+        wall = bench_ns() - start;
+        cpu = bench_cpu(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        pthread_barrier_destroy(&round);
+
+        for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) {
+            qsort(cameras[i].latency, BENCH_SCHEDULE_ROUNDS, sizeof(uint64_t), bench_compare);
+        }
+        if (pass == 0) printf("per-webcam threads   ");
+        else printf("scheduler, %2u workers", s->nworkers);
+        printf("%8.1f ms %8.1f ms %8.1f ms %8.1f ms\n", wall / 1e6 / BENCH_SCHEDULE_ROUNDS,
+               cameras[0].latency[BENCH_SCHEDULE_ROUNDS / 2] / 1e6,
+               cameras[1].latency[BENCH_SCHEDULE_ROUNDS / 2] / 1e6, cpu / 1e6 / BENCH_SCHEDULE_ROUNDS);
+    }
+
+    for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) {
+        webcam_stats(cameras[i].webcam, &stats);
+        stolen += stats.stolen;
+        late += stats.late;
     }
+    printf("strips converted by the workers %llu, frames late %llu\n", (unsigned long long)stolen,
+           (unsigned long long)late);
+
+    convertToRGB(cameras[0].raw, &rgb);
+    if (0 != memcmp(rgb.start, cameras[0].webcam->frame.start, rgb.length)) printf("frames differ\n");
+
+    webcam_scheduler_close(s);
+    for (i = 0; i < BENCH_SCHEDULE_WEBCAMS; i++) {
+        cameras[i].webcam->buffers = NULL;
+        cameras[i].webcam->nbuffers = 0;
+        webcam_close(cameras[i].webcam);
+        free(cameras[i].raw.start);
+    }
+    free(rgb.start);
+
+    return 0;
 }
 
-void webcam_grab(webcam_t *w, buffer_t *frame)
+/**
+ * Overloads the host with BENCH_DEGRADE_WEBCAMS synthetic 720p webcams
+ * at 30 fps, each on a thread of its own that is handed the frames the
+ * way a driver with four buffers would: a frame is dropped when all
+ * four are waiting. The first one has a 50 ms budget. Compares its
+ * latency when it is as important as the others, so nothing can be
+ * shed, and when it is more important, over the second half of
+ * BENCH_DEGRADE_SECONDS, once the degradation has settled.
+ */
+#define BENCH_DEGRADE_WEBCAMS   8
+#define BENCH_DEGRADE_SECONDS   6
+
+typedef struct bench_degrade_camera {
+    webcam_t        *webcam;
+    buffer_t        raw;
+    uint64_t        start;
+    uint64_t        frames;     // Published
+} bench_degrade_camera_t;
+
+static void *bench_degrade_capturing(void *ptr)
 {
-    // Locks the frame mutex so the grabber can copy
-    // the frame in its own return buffer.
-    pthread_mutex_lock(&w->mtx_frame);
+    bench_degrade_camera_t *c = (bench_degrade_camera_t *)ptr;
+    const uint64_t period = 1000000000ull / 30;
+    struct v4l2_buffer buf;
+    struct timespec ts;
+    uint64_t n = 0, newest, due;
 
-    // Only copy frame if there is something in the webcam's frame buffer
-    if (w->frame.length > 0) {
-        // Initialize frame
-        if ((*frame).start == NULL) {
-            (*frame).start = calloc(w->frame.length, sizeof(char));
-            (*frame).length = w->frame.length;
+    CLEAR(buf);
+    buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    while (_now() < c->start + BENCH_DEGRADE_SECONDS * 1000000000ull) {
+        newest = _now() > c->start ? (_now() - c->start) / period : 0;
+        if (newest >= n + 4) n = newest - 3;
+
+        due = c->start + n * period;
+        ts.tv_sec = due / 1000000000ull;
+        ts.tv_nsec = due % 1000000000ull;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+
+        buf.sequence = n++;
+        buf.timestamp.tv_sec = due / 1000000000ull;
+        buf.timestamp.tv_usec = due % 1000000000ull / 1000;
+        _publish(c->webcam, &buf);
+        c->frames++;
+    }
+
+    return NULL;
+}
+
+static int bench_degrade(void)
+{
+    static const char *levels[] = {"none", "half", "quarter", "outputs", "skip"};
+    bench_degrade_camera_t cameras[BENCH_DEGRADE_WEBCAMS];
+    pthread_t threads[BENCH_DEGRADE_WEBCAMS];
+    webcam_stats_t stats;
+    uint64_t start, frames[BENCH_DEGRADE_WEBCAMS], others = 0, shed;
+    uint8_t counts[WEBCAM_DEGRADE_SKIP + 1];
+    int i, pass;
+
+    for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) {
+        cameras[i].raw.length = 1280 * 720 * 2;
+        cameras[i].raw.start = malloc(cameras[i].raw.length);
+        if (cameras[i].raw.start == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
         }
+        bench_scene(cameras[i].raw.start, 1280, 720, 2);
 
-        memcpy((*frame).start, w->frame.start, w->frame.length);
+        cameras[i].webcam = _webcam_new("degrade", -1);
+        cameras[i].webcam->width = 1280;
+        cameras[i].webcam->height = 720;
+        cameras[i].webcam->pixelformat = V4L2_PIX_FMT_YUYV;
+        cameras[i].webcam->nbuffers = 1;
+        cameras[i].webcam->buffers = &cameras[i].raw;
     }
 
-    pthread_mutex_unlock(&w->mtx_frame);
+    printf("%d x 1280x720 at 30 fps, %ld CPUs, first webcam important\n", BENCH_DEGRADE_WEBCAMS,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) {
+            webcam_budget(cameras[i].webcam, i == 0 && pass == 1, i == 0 ? 50000 : 0);
+        }
+
+        start = _now() + 10000000;
+        for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) {
+            cameras[i].start = start;
+            cameras[i].frames = 0;
+            pthread_create(&threads[i], NULL, bench_degrade_capturing, &cameras[i]);
+        }
+
+        usleep((BENCH_DEGRADE_SECONDS / 2) * 1000000 + 10000);
+        for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) {
+            webcam_stats_reset(cameras[i].webcam);
+            frames[i] = cameras[i].frames;
+        }
+
+        for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) pthread_join(threads[i], NULL);
+        for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) frames[i] = cameras[i].frames - frames[i];
+
+        webcam_stats(cameras[0].webcam, &stats);
+        printf("%s\n", pass == 0 ? "all equally important" : "first one more important");
+        printf("  first:  %5.1f fps, latency p50 %6.1f ms, p99 %6.1f ms, %5.1f%% over budget\n",
+               frames[0] / (BENCH_DEGRADE_SECONDS / 2.0), webcam_stats_percentile(&stats.latency, 0.50) / 1e6,
+               webcam_stats_percentile(&stats.latency, 0.99) / 1e6,
+               100.0 * stats.missed / (stats.latency.count ? stats.latency.count : 1));
+
+        CLEAR(counts);
+        for (i = 1, others = 0, shed = 0; i < BENCH_DEGRADE_WEBCAMS; i++) {
+            webcam_stats(cameras[i].webcam, &stats);
+            counts[stats.degradation]++;
+            others += frames[i];
+            shed += stats.shed;
+        }
+        printf("  others: %5.1f fps each, %5.1f%% shed, degraded to", others / (BENCH_DEGRADE_SECONDS / 2.0) /
+               (BENCH_DEGRADE_WEBCAMS - 1), 100.0 * shed / (others ? others : 1));
+        for (i = 0; i <= WEBCAM_DEGRADE_SKIP; i++) {
+            if (counts[i]) printf(" %s x%u", levels[i], counts[i]);
+        }
+        printf("\n");
+    }
+
+    for (i = 0; i < BENCH_DEGRADE_WEBCAMS; i++) {
+        cameras[i].webcam->buffers = NULL;
+        cameras[i].webcam->nbuffers = 0;
+        webcam_close(cameras[i].webcam);
+        free(cameras[i].raw.start);
+    }
+
+    return 0;
 }
 
 /**
- * Main code
+ * Streams a synthetic 720p webcam at 30 fps that nobody grabs from:
+ * without standby, on standby after half a second, and on standby
+ * converting a frame a second. Reports the CPU time of its capture
+ * thread over BENCH_STANDBY_SECONDS after the first second, and how
+ * long a grab then takes to wake it up, also when the scene did not
+ * change and the webcam skips unchanged frames.
  */
-#ifdef WEBCAM_TEST
-int main(int argc, char **argv)
+#define BENCH_STANDBY_SECONDS   3
+
+typedef struct bench_standby_camera {
+    webcam_t        *webcam;
+    uint64_t        start;
+    uint64_t        cpu;        // Of the capture thread, from the first second on
+    uint64_t        frames;     // Streamed, from the first second on
+    uint64_t        converted;
+} bench_standby_camera_t;
+
+static void *bench_standby_capturing(void *ptr)
 {
-    int i = 0;
-    webcam_t *w = webcam_open("/dev/video0");
+    bench_standby_camera_t *c = (bench_standby_camera_t *)ptr;
+    struct v4l2_buffer buf;
+    struct timespec ts;
+    uint64_t due;
 
-    // Prepare frame, and filename, and file to store frame in
-    buffer_t frame;
-    frame.start = NULL;
-    frame.length = 0;
+    CLEAR(buf);
+    while (c->webcam->streaming) {
+        due = c->start + buf.sequence * 1000000000ull / 30;
+        ts.tv_sec = due / 1000000000ull;
+        ts.tv_nsec = due % 1000000000ull;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
 
-    char *fn = calloc(16, sizeof(char));
-    FILE *fp;
+        if (buf.sequence == 30) {
+            c->cpu = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+            c->converted = c->webcam->published;
+        }
+        _keep(c->webcam, &buf, !_publish(c->webcam, &buf));
+        buf.sequence++;
+    }
+    c->cpu = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - c->cpu;
+    c->frames = buf.sequence - 30;
+    c->converted = c->webcam->published - c->converted;
 
-    webcam_resize(w, 640, 480);
-    webcam_stream(w, true);
-    while(true) {
-        webcam_grab(w, &frame);
+    return NULL;
+}
+
+static int bench_standby(void)
+{
+    static const char *names[] = {"always converting", "standby", "standby, 1 fps"};
+    bench_standby_camera_t camera;
+    pthread_t thread;
+    buffer_t raw, frame = {NULL, 0};
+    uint64_t cpu[3], start, woken[2] = { 0, 0 };
+    int pass, i;
+
+    raw.length = 1280 * 720 * 2;
+    raw.start = malloc(raw.length);
+    if (raw.start == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(raw.start, 1280, 720, 2);
+
+    camera.webcam = _webcam_new("standby", -1);
+    camera.webcam->width = 1280;
+    camera.webcam->height = 720;
+    camera.webcam->pixelformat = V4L2_PIX_FMT_YUYV;
+    camera.webcam->nbuffers = 1;
+    camera.webcam->buffers = &raw;
+
+    for (pass = 0; pass < 3; pass++) {
+        webcam_standby(camera.webcam, pass == 0 ? 0 : 500, pass == 2 ? 30 : 0);
+        camera.start = _now();
+        camera.webcam->streaming = true;
+        pthread_create(&thread, NULL, bench_standby_capturing, &camera);
+
+        usleep((1 + BENCH_STANDBY_SECONDS) * 1000000);
+        camera.webcam->streaming = false;
+        pthread_join(thread, NULL);
+        cpu[pass] = camera.cpu;
+        printf("%-20s %8.2f ms CPU per second, %3llu of %llu frames converted\n", names[pass],
+               cpu[pass] / 1e6 / BENCH_STANDBY_SECONDS, (unsigned long long)camera.converted,
+               (unsigned long long)camera.frames);
+
+        // Woken up from standby by a grab, then again with the frame found unchanged
+        if (pass == 1) {
+            camera.webcam->streaming = true;
+            camera.start = _now();
+            pthread_create(&thread, NULL, bench_standby_capturing, &camera);
+            for (i = 0; i < 2; i++) {
+                webcam_dedup(camera.webcam, i == 1, 3);
+                usleep(i == 0 ? 200000 : 700000);
+                start = _now();
+                webcam_grab(camera.webcam, &frame);
+                woken[i] = _now() - start;
+            }
+            camera.webcam->streaming = false;
+            pthread_join(thread, NULL);
+            webcam_dedup(camera.webcam, false, 3);
+        }
+    }
+
+    // The frame skipped last, converted at once
+    printf("a grab on standby returned a new frame after %.1f ms, frames are 33.3 ms apart\n", woken[0] / 1e6);
+    printf("an unchanged frame after %.1f ms\n", woken[1] / 1e6);
+    printf("standby saved %.1f%% of the CPU, %.2f cores for 16 idle webcams\n", 100.0 - 100.0 * cpu[1] / cpu[0],
+           16.0 * (cpu[0] - cpu[1]) / 1e9 / BENCH_STANDBY_SECONDS);
+
+    camera.webcam->buffers = NULL;
+    camera.webcam->nbuffers = 0;
+    webcam_close(camera.webcam);
+    free(raw.start);
+    free(frame.start);
+
+    return 0;
+}
+
+/**
+ * Runs motion detection on 720p frames in which a square moves over a
+ * noisy scene, and reports the cost per frame, the cores needed for
+ * sixteen cameras at 30 fps, and whether the square was found
+ */
+static int bench_motion(void)
+{
+    struct v4l2_buffer buf;
+    webcam_t *w;
+    webcam_motion_t m;
+    buffer_t raw;
+    uint8_t *scene;
+    uint64_t times[BENCH_RUNS], start;
+    uint32_t found, stray, bit;
+    uint16_t x, y, left = 0, col, row;
+    int i, j;
+
+    raw.length = 1280 * 720 * 2;
+    raw.start = malloc(raw.length);
+    scene = malloc(raw.length);
+    if (raw.start == NULL || scene == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    bench_scene(scene, 1280, 720, 0);
 
-        if (frame.length > 0) {
-            printf("Storing frame %d\n", i);
-            sprintf(fn, "frame_%d.rgb", i);
-            fp = fopen(fn, "w+");
-            fwrite(frame.start, frame.length, 1, fp);
-            fclose(fp);
-            i++;
+    w = _webcam_new("motion", -1);
+    w->width = 1280;
+    w->height = 720;
+    w->pixelformat = V4L2_PIX_FMT_YUYV;
+    w->nbuffers = 1;
+    w->buffers = &raw;
+    webcam_motion(w, 12);
+
+    // A bright 96x96 square moving 16 pixels a frame, with fresh noise every frame
+    CLEAR(buf);
+    for (i = 0; i < BENCH_WARMUP + BENCH_RUNS; i++) {
+        memcpy(raw.start, scene, raw.length);
+        for (j = 0; j < 1280 * 720; j++) raw.start[j * 2] = _clamp8(raw.start[j * 2] + rand() % 7 - 3);
+        left = 160 + 16 * i;
+        for (y = 300; y < 396; y++) {
+            for (x = left; x < left + 96; x++) raw.start[((size_t)y * 1280 + x) * 2] = 235;
         }
 
-        if (i > 10) break;
+        buf.sequence = i;
+        start = bench_cpu(CLOCK_THREAD_CPUTIME_ID);
+        _motion_detect(w, &raw, &buf);
+        if (i >= BENCH_WARMUP) times[i - BENCH_WARMUP] = bench_cpu(CLOCK_THREAD_CPUTIME_ID) - start;
     }
-    webcam_stream(w, false);
+    qsort(times, BENCH_RUNS, sizeof(uint64_t), bench_compare);
+
+    // Blocks covering the square must move, and none away from its path
+    webcam_grab_motion(w, &m);
+    found = stray = 0;
+    for (row = 0; row < m.rows; row++) {
+        for (col = 0; col < m.columns; col++) {
+            bit = (uint32_t)row * m.columns + col;
+            if (!(m.mask[bit / 64] & (1ull << (bit % 64)))) continue;
+            if ((row + 1) * m.block <= 300 || row * m.block >= 396) stray++;
+            else if ((col + 1) * m.block > left && col * m.block < left + 96u) found++;
+        }
+    }
+
+    printf("motion, 1280x720 in %ux%u blocks of %u pixels\n", m.columns, m.rows, m.block);
+    printf("per frame                        %8.3f ms\n", times[BENCH_RUNS / 2] / 1e6);
+    printf("cores for 16 cameras at 30 fps   %8.3f\n", times[BENCH_RUNS / 2] * 16 * 30 / 1e9);
+    printf("blocks moving %u, on the square %u, away from its path %u\n", m.moving, found, stray);
+
+    w->buffers = NULL;
+    w->nbuffers = 0;
     webcam_close(w);
+    free(raw.start);
+    free(scene);
 
-    if (frame.start != NULL) free(frame.start);
-    free(fn);
+    return 0;
+}
+
+/**
+ * Replays the given archive as fast as possible through the whole
+ * pipeline, and reports the frame rate and conversion throughput
+ */
+static int bench_replay(const char *path)
+{
+    webcam_t *w = webcam_open(path);
+    uint64_t start, elapsed, frames;
+
+    if (w == NULL) return EXIT_FAILURE;
+
+    webcam_resize(w, 0, 0);
+    webcam_replay(w, false, false);
+
+    start = bench_ns();
+    webcam_stream(w, true);
+    while (__atomic_load_n(&w->replay.next, __ATOMIC_ACQUIRE) < w->replay.archive->count) usleep(1000);
+    elapsed = bench_ns() - start;
+    webcam_stream(w, false);
+
+    frames = w->replay.archive->count;
+    printf("%s: %llu frames of %ux%u in %.3f s, %.1f fps, %.1f MB/s\n",
+           path, (unsigned long long)frames, w->width, w->height, elapsed / 1e9,
+           1e9 * frames / elapsed, 1000.0 * frames * w->buffers[0].length / elapsed);
+
+    webcam_close(w);
 
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    int i, r = 0;
+
+    if (argc > 2 && 0 == strcmp(argv[1], "replay")) {
+        for (i = 2; i < argc; i++) r |= bench_replay(argv[i]);
+        return r;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "record")) {
+        printf("Recording 1920x1080 YUYV at %d fps (%.1f MB/s)\n",
+               BENCH_RECORD_FPS, 1920.0 * 1080 * 2 * BENCH_RECORD_FPS / 1000000);
+        for (i = 2; i < argc; i++) {
+            r |= bench_record(argv[i], WEBCAM_CODEC_NONE);
+            r |= bench_record(argv[i], WEBCAM_CODEC_DELTA);
+        }
+        return r;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "pipe")) {
+        printf("Piping 3840x2160 YUYV at %d fps\n", BENCH_PIPE_FPS);
+        r |= bench_pipe(WEBCAM_PIPE_YUYV, false);
+        r |= bench_pipe(WEBCAM_PIPE_YUYV, true);
+        r |= bench_pipe(WEBCAM_PIPE_Y4M, false);
+        r |= bench_pipe(WEBCAM_PIPE_Y4M, true);
+        return r;
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "http")) {
+        return bench_http(argc > 2 ? atoi(argv[2]) : 4);
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "rtp")) {
+        return bench_rtp();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "local")) {
+        return bench_local();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "outputs")) {
+        return bench_outputs();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "pyramid")) {
+        return bench_pyramid();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "integral")) {
+        return bench_integral();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "motion")) {
+        return bench_motion();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "trigger")) {
+        return bench_trigger(argc > 2 ? argv[2] : "/tmp");
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "dedup")) {
+        return bench_dedup();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "sharpness")) {
+        return bench_sharpness();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "group")) {
+        return bench_group();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "mosaic")) {
+        return bench_mosaic();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "schedule")) {
+        return bench_schedule();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "degrade")) {
+        return bench_degrade();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "standby")) {
+        return bench_standby();
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "codec")) {
+        return bench_codec(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && 0 == strcmp(argv[1], "kernels")) {
+        return bench_kernels(argc > 2 ? atoi(argv[2]) : 0);
+    }
+
+    return bench_kernels(argc > 1 ? atoi(argv[1]) : 0);
+}
 #endif
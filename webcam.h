@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -25,25 +26,1033 @@ typedef struct buffer {
     size_t  length;
 } buffer_t;
 
+/**
+ * Image pyramid
+ *
+ * Level 0 is the full-size luma plane, and every next level halves the
+ * one before it with 2x2 averages, down to WEBCAM_PYRAMID_LEVELS levels
+ * or a level of 1 pixel. All levels live in one contiguous allocation,
+ * rows packed. With rgb set, levels from 1 on also have an RGB image
+ * there; the full-size RGB image is the frame itself.
+ */
+#define WEBCAM_PYRAMID_LEVELS   12
+
+typedef struct webcam_pyramid_level {
+    uint16_t    width;
+    uint16_t    height;
+    size_t      luma;       // Offset of the luma plane in data
+    size_t      rgb;        // Offset of the RGB image in data, from level 1 on
+} webcam_pyramid_level_t;
+
+typedef struct webcam_pyramid {
+    uint8_t                 levels;
+    bool                    rgb;
+    webcam_pyramid_level_t  level[WEBCAM_PYRAMID_LEVELS];
+    buffer_t                data;
+    uint32_t                sequence;
+} webcam_pyramid_t;
+
+/**
+ * Integral image
+ *
+ * The summed-area table of the luma plane, (width + 1) x (height + 1)
+ * 32-bit sums with a zero first row and column, so the luma in the box
+ * [x0, x1) x [y0, y1) sums to t[y1][x1] - t[y0][x1] - t[y1][x0] + t[y0][x0].
+ */
+typedef struct webcam_integral {
+    uint16_t    width;      // Of the frame
+    uint16_t    height;
+    buffer_t    table;
+    uint32_t    sequence;
+} webcam_integral_t;
+
+/**
+ * Motion detection
+ *
+ * The luma is averaged over WEBCAM_MOTION_SCALE x WEBCAM_MOTION_SCALE
+ * pixels and compared with a running average of earlier frames, the
+ * background. Blocks whose mean absolute difference exceeds the
+ * threshold are moving; the mask has a bit per block, row by row.
+ * Blocks are 8 averaged pixels wide, or larger for frames that would
+ * have more than WEBCAM_MOTION_BLOCKS of them.
+ */
+#define WEBCAM_MOTION_SCALE     4
+#define WEBCAM_MOTION_BLOCKS    8192
+
+typedef struct webcam_motion {
+    uint32_t    sequence;
+    uint64_t    timestamp;
+    uint16_t    block;      // Block size in frame pixels
+    uint16_t    columns;
+    uint16_t    rows;
+    uint32_t    moving;     // Blocks over the threshold
+    float       score;      // Fraction of blocks moving
+    uint64_t    mask[WEBCAM_MOTION_BLOCKS / 64];
+} webcam_motion_t;
+
+/**
+ * A captured frame, as handed to the sinks of a webcam
+ */
+typedef struct webcam_frame {
+    buffer_t    raw;        // YUYV as dequeued from the device
+    buffer_t    rgb;        // Converted frame
+    uint32_t    sequence;
+    uint64_t    timestamp;  // Driver timestamp in nanoseconds
+    uint16_t    width;
+    uint16_t    height;
+    const webcam_pyramid_t  *pyramid;   // NULL unless the webcam makes one
+    const webcam_integral_t *integral;  // NULL unless the webcam makes one
+    const webcam_motion_t   *motion;    // NULL unless the webcam detects motion, or for a duplicate
+    bool        duplicate;  // Unchanged, so rgb is still the previous frame
+    bool        shed;       // Not converted under overload, so rgb is empty and the pointers NULL
+    float       sharpness;  // Negative unless the webcam measures it
+} webcam_frame_t;
+
+/**
+ * Sharpness
+ *
+ * The variance of the Laplacian of a decimated luma grid: every grid
+ * point is the sum of the two luma values of a YUYV word, on every
+ * other row. Only every WEBCAM_SHARPNESS_STEP-th grid row is measured,
+ * so about 3/16 of the rows of the frame are read. The variance is in
+ * luma units; blurred frames score low, and noise scores high.
+ */
+#define WEBCAM_SHARPNESS_STEP   8
+
+/**
+ * Duplicate frame suppression
+ *
+ * Every frame is sampled at WEBCAM_DEDUP_POINTS points spread over a
+ * grid, each the sum of 16 consecutive luma values, before it is
+ * converted. A frame whose sums all differ from those of the last
+ * converted frame by no more than the tolerance per pixel is a
+ * duplicate: it is not converted, and waiters are not woken.
+ */
+#define WEBCAM_DEDUP_GRID       64
+#define WEBCAM_DEDUP_POINTS     (WEBCAM_DEDUP_GRID * WEBCAM_DEDUP_GRID)
+
+/**
+ * Sink structure
+ *
+ * Sinks are called from the capture thread for every new frame, after
+ * it has been published and before the raw buffer goes back to the
+ * device. They must not block; anything slow belongs on a thread of
+ * the sink's own.
+ */
+typedef struct webcam_sink {
+    void                (*push)(struct webcam_sink *s, const webcam_frame_t *f);
+    struct webcam_sink  *next;
+} webcam_sink_t;
+
+/**
+ * Frame archive
+ *
+ * Recorders write an archive file laid out as:
+ *
+ *   file header                 one page
+ *   frame header + payload      one page for the header, then the payload
+ *   ...                         padded to whole pages
+ *   index + trailer             one entry per frame, trailer in the last bytes
+ *
+ * Every payload starts on a page boundary, so the file can be mmap-ed
+ * and frames used in place. The index holds frame offsets in order of
+ * recording, so frame N is found in O(1) and a timestamp in O(log n).
+ */
+#define WEBCAM_ARCHIVE_PAGE     4096
+#define WEBCAM_ARCHIVE_VERSION  2
+#define WEBCAM_ARCHIVE_MAGIC    0x52414357  // "WCAR"
+#define WEBCAM_ARCHIVE_FRAME    0x52464357  // "WCFR"
+#define WEBCAM_ARCHIVE_INDEX    0x58494357  // "WCIX"
+
+typedef struct webcam_archive_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    page;
+    uint32_t    reserved;
+} webcam_archive_header_t;
+
+typedef struct webcam_archive_frame {
+    uint32_t    magic;
+    uint32_t    format;     // V4L2 fourcc of the payload
+    uint64_t    sequence;
+    uint64_t    timestamp;  // Driver timestamp in nanoseconds
+    uint64_t    length;     // Payload bytes, without padding
+    uint16_t    width;
+    uint16_t    height;
+    uint32_t    stride;
+    uint32_t    codec;      // Since version 2, webcam_codec_t of the payload
+    uint32_t    reserved;
+    uint64_t    stored;     // Since version 2, payload bytes in the file
+} webcam_archive_frame_t;
+
+typedef struct webcam_archive_entry {
+    uint64_t    offset;     // Offset of the frame header
+    uint64_t    timestamp;
+} webcam_archive_entry_t;
+
+typedef struct webcam_archive_trailer {
+    uint32_t    magic;
+    uint32_t    reserved;
+    uint64_t    count;
+    uint64_t    index;      // Offset of the first index entry
+} webcam_archive_trailer_t;
+
+/**
+ * Archive reader structure
+ */
+typedef struct webcam_archive {
+    int                     fd;
+    uint8_t                 *map;
+    size_t                  length;
+
+    webcam_archive_entry_t  *index;
+    uint64_t                count;
+    bool                    recovered;
+} webcam_archive_t;
+
+/**
+ * Recorder structure
+ *
+ * Frames are copied into a bounded ring of page-aligned slots by the
+ * capture thread and written to disk by the recorder's own thread.
+ * When all slots are in flight, new frames are dropped and counted.
+ *
+ * A triggered recorder first copies every frame into a preallocated
+ * pre-roll ring instead, and hands frames over to the writer (by
+ * swapping buffers) only from preroll milliseconds before a trigger
+ * until postroll after the last one. Triggers are webcam_recorder_trigger(),
+ * a signal, or a frame with enough moving blocks.
+ */
+typedef enum webcam_record_source {
+    WEBCAM_RECORD_RAW,
+    WEBCAM_RECORD_RGB
+} webcam_record_source_t;
+
+/**
+ * Lossless codecs for recording
+ *
+ * WEBCAM_CODEC_DELTA predicts every byte from the same component to its
+ * left and above, and bit-packs the residuals in groups of eight.
+ */
+typedef enum webcam_codec {
+    WEBCAM_CODEC_NONE,
+    WEBCAM_CODEC_DELTA
+} webcam_codec_t;
+
+typedef struct webcam_recorder {
+    webcam_sink_t           sink;
+    webcam_record_source_t  source;
+    webcam_codec_t          codec;
+    int                     fd;
+    bool                    direct;
+
+    buffer_t                *slots;
+    buffer_t                *encoded;
+    uint8_t                 *ready;
+    uint8_t                 nslots;
+    size_t                  capacity;
+    size_t                  encoded_capacity;
+    uint64_t                head;
+    uint64_t                claimed;
+    uint64_t                tail;
+    sem_t                   pending;
+    sem_t                   done;
+
+    pthread_t               thread;
+    pthread_t               *workers;
+    uint8_t                 nworkers;
+    bool                    running;
+
+    uint64_t                offset;
+    webcam_archive_entry_t  *index;
+    uint64_t                count;
+
+    uint64_t                frames;
+    uint64_t                dropped;
+    uint64_t                bytes;
+
+    // Triggered recording, see webcam_recorder_trigger_setup()
+    bool                    triggered;
+    buffer_t                *held;      // Pre-roll ring of the last frames
+    uint16_t                nheld;
+    uint16_t                held_first;
+    uint16_t                held_count;
+    uint64_t                postroll;   // Nanoseconds recorded after a trigger
+    uint64_t                until;      // Timestamp of the last frame to record
+    uint32_t                motion;     // Moving blocks that trigger, 0 for none
+    uint32_t                requests;   // By webcam_recorder_trigger()
+    uint32_t                handled;
+    uint32_t                signals;
+    uint64_t                triggers;
+    uint64_t                idle;       // Frames that were never to be written
+} webcam_recorder_t;
+
+/**
+ * Pipe output structure
+ *
+ * Frames are streamed to a pipe as YUV4MPEG2 (planar 4:2:2), or as bare
+ * YUYV or RGB24 frames, e.g. for ffmpeg. The capture thread fills a ring
+ * of page-aligned slots, and the pipe's own thread hands them to the
+ * pipe with vmsplice, so the kernel references the pages instead of
+ * copying them. A slot is only refilled once the reader has consumed
+ * all of it; until then new frames are dropped and counted.
+ */
+typedef enum webcam_pipe_format {
+    WEBCAM_PIPE_Y4M,
+    WEBCAM_PIPE_YUYV,
+    WEBCAM_PIPE_RGB
+} webcam_pipe_format_t;
+
+typedef struct webcam_pipe {
+    webcam_sink_t           sink;
+    webcam_pipe_format_t    format;
+    int                     fd;
+    bool                    splice;     // False when fd is not a pipe
+    size_t                  pipe_size;  // Capacity of the pipe in bytes
+
+    buffer_t                *slots;
+    uint64_t                *ends;      // Stream offset just past every slot
+    uint8_t                 nslots;
+    size_t                  capacity;
+    uint64_t                head;
+    uint64_t                tail;
+    sem_t                   pending;
+
+    pthread_t               thread;
+    bool                    running;
+
+    uint16_t                width;
+    uint16_t                height;
+    uint32_t                fps;
+    uint64_t                written;    // Bytes handed to the pipe
+
+    uint64_t                frames;
+    uint64_t                dropped;
+    uint64_t                bytes;
+} webcam_pipe_t;
+
+/**
+ * JPEG frame shared by all clients of an HTTP stream
+ *
+ * Every frame is encoded once and reference counted: the stream holds
+ * its latest frame, and every client the frame it is sending.
+ */
+typedef struct webcam_jpeg {
+    uint32_t    refs;
+    uint32_t    sequence;   // Frames encoded by the stream before this one
+    size_t      length;
+    uint8_t     data[];
+} webcam_jpeg_t;
+
+/**
+ * Parallel JPEG encoding job
+ *
+ * Frames are cut into strips of whole MCU rows separated by restart
+ * markers, so the strips are entropy coded independently by the
+ * server's workers and only concatenated afterwards.
+ */
+typedef struct webcam_jpeg_job {
+    const uint8_t           *yuyv;
+    uint16_t                width;
+    uint16_t                height;
+    uint16_t                rows;       // MCU rows per strip
+    uint16_t                strips;
+    uint16_t                next;       // Next strip to claim
+    uint16_t                finished;
+    buffer_t                *out;       // Entropy coded data of every strip
+    size_t                  *capacity;
+    sem_t                   done;
+    struct webcam_jpeg_job  *next_job;
+} webcam_jpeg_job_t;
+
+/**
+ * MJPEG stream of one webcam, served at /<index>
+ *
+ * The capture thread copies frames into the staging buffer whenever
+ * the previous one has been encoded and someone is watching; other
+ * frames are skipped.
+ */
+typedef struct webcam_http_stream {
+    webcam_sink_t               sink;
+    struct webcam_http          *server;
+    struct webcam               *webcam;
+    uint8_t                     index;
+
+    buffer_t                    staging;
+    uint16_t                    width;
+    uint16_t                    height;
+    bool                        busy;
+    sem_t                       pending;
+    pthread_t                   thread;
+
+    webcam_jpeg_job_t           job;
+    uint16_t                    nstrips;
+    webcam_jpeg_t               *current;
+    pthread_mutex_t             mtx_current;
+
+    uint32_t                    clients;
+    uint64_t                    encoded;
+    uint64_t                    skipped;
+    uint64_t                    encode_ns;
+
+    struct webcam_http_stream   *next;
+} webcam_http_stream_t;
+
+/**
+ * HTTP client connection, sending at most one frame at a time
+ */
+typedef struct webcam_http_client {
+    int                     fd;
+    webcam_http_stream_t    *stream;    // NULL until the request is read
+    char                    request[1024];
+    size_t                  received;
+
+    webcam_jpeg_t           *jpeg;      // Frame being sent
+    char                    part[256];  // Response and part headers before it
+    size_t                  part_length;
+    size_t                  sent;
+    uint32_t                last;       // Sequence of the last frame sent
+
+    uint64_t                frames;
+    uint64_t                skipped;
+} webcam_http_client_t;
+
+/**
+ * Embedded MJPEG-over-HTTP server
+ *
+ * One thread accepts clients and sends frames to all of them with
+ * non-blocking writev from the shared JPEG buffers. A client that is
+ * still sending when a new frame is encoded gets whatever frame is
+ * latest once it is done, so slow clients skip frames instead of
+ * queueing them.
+ */
+#define WEBCAM_HTTP_CLIENTS 64
+#define WEBCAM_HTTP_SNDBUF  (128 * 1024)
+
+typedef struct webcam_http {
+    int                     fd;
+    int                     wake[2];    // Pipe waking the server thread
+    uint16_t                port;
+    uint8_t                 quality;
+    uint8_t                 qtable[2][64];
+    float                   divisors[2][64];
+
+    webcam_http_stream_t    *streams;
+    pthread_mutex_t         mtx_streams;
+    webcam_http_client_t    clients[WEBCAM_HTTP_CLIENTS];
+
+    pthread_t               thread;
+    pthread_t               *workers;
+    uint8_t                 nworkers;
+    bool                    running;
+
+    webcam_jpeg_job_t       *jobs;
+    pthread_mutex_t         mtx_jobs;
+    sem_t                   work;
+} webcam_http_t;
+
+/**
+ * RTP raw video sender (RFC 4175, YCbCr 4:2:2, 8 bit)
+ *
+ * The capture thread packetizes every frame straight into a slot of
+ * ready-made datagrams, and the sender's own thread sends a whole slot
+ * with a single sendmmsg, using UDP GSO to hand the kernel runs of
+ * equally sized datagrams as one message. Frames arriving while all
+ * slots are in flight are dropped and counted.
+ */
+#define WEBCAM_RTP_DATAGRAM 1472    // Largest UDP payload in a 1500 byte MTU
+#define WEBCAM_RTP_HEADER   20      // RTP header, extended sequence number, one row header
+#define WEBCAM_RTP_SEGMENTS 64      // Datagrams per GSO message
+#define WEBCAM_RTP_BATCH    64      // Messages per recvmmsg
+
+typedef struct webcam_rtp_slot {
+    uint8_t         *packets;
+    struct mmsghdr  *messages;
+    struct iovec    *iov;
+    uint8_t         *control;
+    uint32_t        nmessages;
+} webcam_rtp_slot_t;
+
+typedef struct webcam_rtp {
+    webcam_sink_t       sink;
+    int                 fd;
+    bool                gso;
+    uint32_t            ssrc;
+    uint32_t            sequence;   // Extended sequence number of the next packet
+
+    uint16_t            width;
+    uint16_t            height;
+    uint16_t            chunk;      // Pixel bytes per packet, the last of a line may be shorter
+    uint16_t            per_line;   // Packets per line
+    uint32_t            npackets;   // Packets per frame
+
+    webcam_rtp_slot_t   *slots;
+    uint8_t             nslots;
+    uint64_t            head;
+    uint64_t            tail;
+    sem_t               pending;
+
+    pthread_t           thread;
+    bool                running;
+
+    uint64_t            frames;
+    uint64_t            dropped;
+    uint64_t            packets;
+    uint64_t            syscalls;
+    uint64_t            bytes;
+} webcam_rtp_t;
+
+/**
+ * RTP raw video receiver, reassembling the frames of a webcam_rtp_t
+ * and pushing every completed frame to a sink
+ */
+typedef struct webcam_rtp_receiver {
+    int             fd;
+    uint16_t        port;
+    bool            gro;
+    webcam_sink_t   *sink;
+
+    uint16_t        width;
+    uint16_t        height;
+    buffer_t        frame;
+    uint32_t        timestamp;  // RTP timestamp of the frame being assembled
+    size_t          received;   // Pixel bytes of it received so far
+    uint32_t        expected;   // Next extended sequence number
+    bool            started;
+
+    uint8_t         *buffers;
+    struct mmsghdr  *messages;
+    struct iovec    *iov;
+    uint8_t         *control;
+
+    pthread_t       thread;
+    bool            running;
+
+    uint64_t        frames;
+    uint64_t        incomplete;
+    uint64_t        packets;
+    uint64_t        lost;
+    uint64_t        syscalls;
+} webcam_rtp_receiver_t;
+
+/**
+ * Local frame server
+ *
+ * Local processes connect to a SOCK_SEQPACKET Unix socket and send a
+ * hello asking for a format and a region of interest. The server
+ * answers with a welcome and a read-only memfd holding a ring of frame
+ * slots, once, and from then on one small message per frame naming the
+ * slot it was written to. Clients asking for the same format and region
+ * share a view, so every frame is copied once per view.
+ *
+ * The memfd starts with the sequence number of the frame in every slot;
+ * a slot being rewritten reads WEBCAM_LOCAL_WRITING. A client is done
+ * with a frame safely if the slot still holds its sequence afterwards.
+ */
+#define WEBCAM_LOCAL_MAGIC      0x4c434357  // "WCCL"
+#define WEBCAM_LOCAL_CLIENTS    32
+#define WEBCAM_LOCAL_WRITING    UINT64_MAX
+
+typedef struct webcam_local_hello {
+    uint32_t    magic;
+    uint32_t    format;     // V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_RGB24
+    uint16_t    x;
+    uint16_t    y;
+    uint16_t    width;      // 0 for the rest of the frame
+    uint16_t    height;
+} webcam_local_hello_t;
+
+typedef struct webcam_local_welcome {
+    uint32_t    magic;
+    int32_t     status;     // 0, or the errno the hello was refused with
+    uint32_t    format;
+    uint16_t    x;
+    uint16_t    y;
+    uint16_t    width;
+    uint16_t    height;
+    uint32_t    stride;
+    uint32_t    nslots;
+    uint32_t    reserved;
+    uint64_t    data;       // Offset of the first slot in the memfd
+    uint64_t    slot_size;
+} webcam_local_welcome_t;
+
+typedef struct webcam_local_message {
+    uint64_t    sequence;
+    uint64_t    timestamp;  // Capture timestamp in nanoseconds
+    uint32_t    slot;
+    uint32_t    reserved;
+    uint64_t    offset;     // Of the frame in the memfd
+    uint64_t    length;
+} webcam_local_message_t;
+
+typedef struct webcam_local_view {
+    uint32_t    format;
+    uint16_t    x;
+    uint16_t    y;
+    uint16_t    width;
+    uint16_t    height;
+    uint32_t    stride;
+
+    int         fd;
+    uint8_t     *map;
+    size_t      length;
+    size_t      data;
+    size_t      slot_size;
+    uint64_t    next;       // Frames written to the view
+    uint32_t    clients;
+} webcam_local_view_t;
+
+typedef struct webcam_local_client {
+    int                     fd;
+    webcam_local_view_t     *view;  // NULL until the hello is answered
+    uint64_t                frames;
+    uint64_t                skipped;
+} webcam_local_client_t;
+
+typedef struct webcam_local {
+    webcam_sink_t           sink;
+    char                    path[108];
+    int                     fd;
+    int                     wake[2];
+    uint16_t                width;
+    uint16_t                height;
+    uint8_t                 nslots;
+
+    webcam_local_view_t     views[WEBCAM_LOCAL_CLIENTS];
+    webcam_local_client_t   clients[WEBCAM_LOCAL_CLIENTS];
+    pthread_mutex_t         mtx_clients;
+
+    pthread_t               thread;
+    bool                    running;
+    uint64_t                frames;
+} webcam_local_t;
+
+/**
+ * Client side of the local frame server
+ */
+typedef struct webcam_local_connection {
+    int                     fd;
+    webcam_local_welcome_t  welcome;
+    uint8_t                 *map;
+    size_t                  length;
+} webcam_local_connection_t;
+
+/**
+ * Replay state, for webcams opened on a recorded archive
+ */
+typedef struct webcam_replay {
+    webcam_archive_t    *archive;
+    uint64_t            next;       // Next frame in the archive
+    uint64_t            start;      // Monotonic time the replay (re)started
+    uint64_t            base;       // Timestamp of the frame at start
+    uint64_t            offset;     // Added to timestamps after looping
+    uint32_t            frames;     // Frames replayed, used as sequence
+    buffer_t            decoded;    // Payload of a compressed frame
+    bool                realtime;
+    bool                loop;
+} webcam_replay_t;
+
+/**
+ * Pipeline stages that are timed when compiled with -DWEBCAM_STATS
+ * or -DWEBCAM_TRACE
+ */
+typedef enum webcam_stage {
+    WEBCAM_STAGE_DQBUF,     // Waiting for the driver to hand out a filled buffer
+    WEBCAM_STAGE_CONVERT,   // Converting the buffer to RGB
+    WEBCAM_STAGE_LOCK,      // Waiting for mtx_frame in the capture thread
+    WEBCAM_STAGE_QBUF,      // Handing the buffer back to the driver
+    WEBCAM_STAGE_GRAB,      // Copying the frame in webcam_grab
+    WEBCAM_STAGE_OUTPUTS,   // Making all outputs in one pass over the buffer
+    WEBCAM_STAGE_PYRAMID,   // Making the image pyramid
+    WEBCAM_STAGE_MOTION,    // Detecting motion
+    WEBCAM_STAGE_SHARPNESS, // Measuring the sharpness
+    WEBCAM_STAGES
+} webcam_stage_t;
+
+/**
+ * Log-bucketed latency histogram, in nanoseconds
+ *
+ * Every power of two is split into WEBCAM_HIST_SUB linear sub-buckets,
+ * so the relative error of a bucket is at most 1 / WEBCAM_HIST_SUB.
+ */
+#define WEBCAM_HIST_SUB     4
+#define WEBCAM_HIST_BUCKETS (40 * WEBCAM_HIST_SUB)
+
+typedef struct webcam_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[WEBCAM_HIST_BUCKETS];
+} webcam_histogram_t;
+
+/**
+ * Hardware counters sampled around the RGB conversion when compiled
+ * with -DWEBCAM_PERF
+ */
+typedef enum webcam_counter {
+    WEBCAM_COUNTER_CYCLES,
+    WEBCAM_COUNTER_INSTRUCTIONS,
+    WEBCAM_COUNTER_LLC_MISSES,
+    WEBCAM_COUNTER_BRANCH_MISSES,
+    WEBCAM_COUNTERS
+} webcam_counter_t;
+
+typedef struct webcam_counters {
+    uint64_t frames;                    // Conversions that were counted
+    uint64_t available;                 // Bitmask of counters that could be opened
+    uint64_t value[WEBCAM_COUNTERS];    // Totals over all counted conversions
+} webcam_counters_t;
+
+typedef struct webcam_stats {
+    webcam_histogram_t stage[WEBCAM_STAGES];
+    webcam_counters_t  convert;
+
+    // With duplicate suppression, also without -DWEBCAM_STATS
+    uint64_t           checked;     // Frames checked for changes
+    uint64_t           duplicates;  // Of those, the ones not converted
+    uint64_t           check_ns;    // Spent checking
+    uint64_t           convert_ns;  // Spent converting the changed ones
+
+    // With a scheduler, also without -DWEBCAM_STATS
+    uint64_t           scheduled;   // Frames converted in strips
+    uint64_t           stolen;      // Strips converted by the scheduler's workers
+    uint64_t           late;        // Frames converted after their deadline
+
+    // With a latency budget, also without -DWEBCAM_STATS
+    webcam_histogram_t latency;     // From capture until published
+    uint64_t           missed;      // Frames over budget
+    uint64_t           shed;        // Frames not converted to shed load
+    uint64_t           degradation; // Current webcam_degradation_t
+
+    // With standby, also without -DWEBCAM_STATS
+    uint64_t           idle;        // Frames not converted on standby
+    uint64_t           resumed;     // Grabs that woke the webcam
+} webcam_stats_t;
+
+/**
+ * Output structure
+ *
+ * Besides its RGB frame, a webcam can make any number of outputs, each
+ * with its own size and format, from its own region of the frame. One
+ * fused kernel makes all of them from a single read of the captured
+ * buffer: it goes through the buffer in bands of WEBCAM_OUTPUT_BAND
+ * rows, and scales each band into every output while it is in cache.
+ * Outputs are box-filtered down from their region, so they are never
+ * larger than it, and at most 256 times smaller along either axis.
+ *
+ * Every output is double buffered: webcam_output_grab() copies the last
+ * completed frame while the next one is being made, and the output's
+ * sinks get every frame as it is completed. Outputs are made from YUYV
+ * captures only.
+ *
+ * The webcam's RGB frame is made in the same pass. With a full-size RGB
+ * output of the whole frame, it is a copy of that output, converted in
+ * fixed point with the chroma of each pixel's own pair. Its pixels then
+ * differ slightly from those of convertToRGB(), which otherwise makes
+ * the frame.
+ */
+#define WEBCAM_OUTPUT_BAND  16
+
+typedef struct webcam_output {
+    struct webcam           *webcam;
+    uint32_t                format;     // V4L2_PIX_FMT_RGB24 or V4L2_PIX_FMT_YUYV
+    uint16_t                width;
+    uint16_t                height;
+    uint16_t                x;          // Region of the frame, 0 for the rest of it
+    uint16_t                y;
+    uint16_t                roi_width;
+    uint16_t                roi_height;
+
+    uint16_t                source_width;   // Frame size the maps were made for
+    uint16_t                source_height;
+    bool                    ready;
+    uint16_t                left;           // Region as clamped to the frame
+    uint16_t                top;
+    uint16_t                *xmap;          // First region column per output column, and one past the end
+    uint16_t                *ymap;          // First region row per output row, and one past the end
+    uint32_t                *xscale;        // 2^16 / columns per output column
+    uint32_t                *cscale;        // 2^16 / chroma pairs per output column
+    uint16_t                *sums;          // Column sums of the rows of one output row
+    uint16_t                row;            // Next output row to make
+
+    buffer_t                frames[2];
+    uint8_t                 front;
+    uint32_t                sequence;
+    uint64_t                timestamp;
+    pthread_mutex_t         mtx_frame;
+
+    webcam_sink_t           *sinks;
+    struct webcam_output    *next;
+
+    struct webcam_mosaic    *mosaic;        // NULL unless a tile, see below
+    uint8_t                 tile;
+    uint8_t                 *target;        // Where a tile's rows go this frame
+    size_t                  stride;
+} webcam_output_t;
+
+/**
+ * Mosaic structure
+ *
+ * A mosaic composites webcams into a grid of tiles, e.g. for a wall of
+ * monitors. Every tile is an RGB output of its webcam whose rows the
+ * fused kernel writes straight into the mosaic, so a frame is scaled
+ * and converted into place once and never copied afterwards.
+ *
+ * The mosaic is double buffered and published at a fixed rate by its
+ * own thread: tiles are written into the back buffer, which becomes
+ * the front one at every tick, once the tiles being written are done.
+ * Only a tile whose webcam delivered nothing since the previous tick is
+ * copied over from the front buffer. The published tiles tell how
+ * fresh they are; sinks of the mosaic are called from its thread, and
+ * find the tiles in the mosaic's tiles until the next tick.
+ */
+#define WEBCAM_MOSAIC_TILES 64
+
+typedef struct webcam_mosaic_tile {
+    bool        live;       // Has a webcam
+    bool        fresh;      // Arrived since the previous tick
+    uint32_t    sequence;   // Of the webcam's frame in the tile
+    uint64_t    timestamp;
+    uint64_t    arrival;    // Monotonic time it was written
+    uint64_t    age;        // Nanoseconds since then, when published
+} webcam_mosaic_tile_t;
+
+typedef struct webcam_mosaic {
+    uint8_t                 columns;
+    uint8_t                 rows;
+    uint16_t                tile_width;
+    uint16_t                tile_height;
+    uint16_t                width;
+    uint16_t                height;
+    uint32_t                fps;
+
+    buffer_t                buffers[2];
+    uint8_t                 front;
+    webcam_output_t         *outputs[WEBCAM_MOSAIC_TILES];
+    webcam_mosaic_tile_t    written[2][WEBCAM_MOSAIC_TILES];    // Of the tiles in either buffer
+    uint16_t                writing;    // Tiles being written into the back buffer
+    bool                    swapping;   // No new tiles until the buffers are swapped
+    pthread_mutex_t         mtx;
+    pthread_cond_t          idle;
+
+    webcam_mosaic_tile_t    tiles[WEBCAM_MOSAIC_TILES];         // As published, under mtx_front
+    uint64_t                published;
+    pthread_mutex_t         mtx_front;
+
+    webcam_sink_t           *sinks;
+    pthread_mutex_t         mtx_sinks;
+    pthread_t               thread;
+    bool                    running;
+} webcam_mosaic_t;
+
+/**
+ * Conversion in blocks of rows
+ *
+ * While the webcam makes an integral image, the RGB conversion is split
+ * into blocks of rows, shared by the capture thread and the webcam's
+ * conversion workers. Every block converts its rows and sums their luma
+ * into a table of its own; the bottom rows are then carried down block
+ * by block, and a second, fix-up pass adds to every block the sums of
+ * all rows above it.
+ */
+typedef struct webcam_convert_job {
+    buffer_t            raw;
+    uint16_t            rows;       // Rows per block
+    uint16_t            blocks;
+    uint16_t            next;       // Next block to claim
+    uint16_t            finished;
+    uint8_t             pass;       // 0 converts and sums, 1 fixes up, 2 only converts
+    uint64_t            deadline;   // Monotonic, for the scheduler
+    sem_t               done;
+} webcam_convert_job_t;
+
+/**
+ * Conversion scheduler
+ *
+ * A scheduler lends one pool of workers to the conversions of all its
+ * webcams, so a 4K webcam's frames are converted on every core while
+ * the threads of its 720p neighbours are idle. Frames are cut into
+ * strips of WEBCAM_STRIP_ROWS rows. The capture thread converts strips
+ * of its own frame, and idle workers steal strips from the frame with
+ * the earliest deadline: the start of its conversion plus the webcam's
+ * deadline hint. As a capture thread only ever waits for its own frame,
+ * no webcam is held up behind the strips of another.
+ */
+#define WEBCAM_STRIP_ROWS       32
+#define WEBCAM_SCHEDULER_MAX    16
+
+typedef struct webcam_scheduler {
+    struct webcam       *members[WEBCAM_SCHEDULER_MAX];
+    uint8_t             count;
+    uint8_t             next;       // Member preferred on equal deadlines
+    uint64_t            posted;     // Passes posted, under mtx
+    uint64_t            strips;     // Converted by the workers
+    pthread_mutex_t     mtx;
+    pthread_cond_t      work;
+    pthread_t           *workers;
+    uint8_t             nworkers;
+    bool                running;
+} webcam_scheduler_t;
+
+/**
+ * Camera group structure
+ *
+ * A group takes the RGB frames of up to WEBCAM_GROUP_MAX streaming
+ * webcams through a sink on each, into a short history per webcam.
+ * Every history slot is a seqlock: its capture thread makes the count
+ * odd while it writes, so webcam_group_grab() matches and copies
+ * without a lock, and starts over when a slot changed underneath.
+ * A set matches when its driver timestamps are within the tolerance.
+ * Latency runs from the arrival of the last frame of a set until it is
+ * returned, skew from its earliest to its latest timestamp.
+ */
+#define WEBCAM_GROUP_MAX        8
+#define WEBCAM_GROUP_HISTORY    4
+
+typedef struct webcam_group_slot {
+    uint32_t    count;      // Seqlock, odd while being written
+    uint32_t    sequence;
+    uint64_t    timestamp;
+    uint64_t    arrival;    // Monotonic time it was pushed
+    buffer_t    rgb;
+} webcam_group_slot_t;
+
+typedef struct webcam_group_member {
+    webcam_sink_t           sink;
+    struct webcam_group     *group;
+    struct webcam           *webcam;
+    size_t                  capacity;
+    webcam_group_slot_t     slots[WEBCAM_GROUP_HISTORY];
+    uint64_t                head;       // Frames pushed
+    uint64_t                dropped;    // Larger than the slots
+} webcam_group_member_t;
+
+typedef struct webcam_group {
+    webcam_group_member_t   member[WEBCAM_GROUP_MAX];
+    uint8_t                 count;
+    uint64_t                tolerance;  // Nanoseconds
+    uint64_t                last;       // Timestamp of the first webcam in the last set
+    sem_t                   pushed;
+
+    uint64_t                sets;
+    uint64_t                retries;    // Copies started over
+    webcam_histogram_t      latency;
+    webcam_histogram_t      skew;
+} webcam_group_t;
+
+/**
+ * Degradation under overload
+ *
+ * A webcam given a latency budget checks every frame's latency, from
+ * its driver timestamp, or from its dequeue when the timestamps are not
+ * monotonic, until it has been published. On a miss, one webcam of a
+ * lower priority is degraded by a level, at most every
+ * WEBCAM_DEGRADE_SETTLE_MS: the least important one, and of equally
+ * important ones the least degraded. Once no budgeted webcam has come
+ * within a quarter of its budget for WEBCAM_DEGRADE_RECOVER_MS, the most
+ * important degraded webcam gets a level back. The levels shed work in
+ * this order:
+ */
+#define WEBCAM_DEGRADE_SETTLE_MS    200
+#define WEBCAM_DEGRADE_RECOVER_MS   2000
+
+typedef enum webcam_degradation {
+    WEBCAM_DEGRADE_NONE,
+    WEBCAM_DEGRADE_HALF,        // Converts every other frame
+    WEBCAM_DEGRADE_QUARTER,     // Converts every fourth frame
+    WEBCAM_DEGRADE_OUTPUTS,     // Of every fourth frame, makes only outputs of at most a quarter of the frame
+    WEBCAM_DEGRADE_SKIP         // Converts nothing, sinks still get every raw frame
+} webcam_degradation_t;
+
 /**
  * Webcam structure
  */
 typedef struct webcam {
     char            *name;
     int             fd;
+    uint8_t         index;
     buffer_t        *buffers;
     uint8_t         nbuffers;
 
     buffer_t        frame;
+    uint32_t        sequence;
+    uint64_t        published;      // Frames converted, under mtx_frame
     pthread_t       thread;
     pthread_mutex_t mtx_frame;
+    pthread_cond_t  fresh;          // Signalled with every converted frame
+
+    bool            dedup;          // Suppress duplicate frames
+    uint8_t         dedup_tolerance;
+    uint16_t        dedup_width;    // Of the frame the samples are from
+    uint16_t        dedup_height;
+    uint16_t        dedup_samples[WEBCAM_DEDUP_POINTS];
+
+    bool            sharpness_on;
+    float           sharpness;          // Of the frame being published
+    float           frame_sharpness;    // Of frame, under mtx_frame
+
+    webcam_sink_t   *sinks;
+    pthread_mutex_t mtx_sinks;
+
+    webcam_output_t *outputs;
+    pthread_mutex_t mtx_outputs;
+
+    webcam_pyramid_t pyramid;       // Last completed pyramid, under mtx_frame
+    buffer_t        pyramid_next;   // Pyramid being made
+    uint8_t         pyramid_levels; // As requested, 0 for none
+    bool            pyramid_rgb;
+
+    webcam_integral_t integral;     // Under mtx_frame, like frame
+    bool            integral_on;
+    pthread_t       *workers;
+    uint8_t         nworkers;
+    bool            working;
+    sem_t           work;
+    webcam_convert_job_t job;
+    pthread_mutex_t mtx_job;
+    webcam_scheduler_t *scheduler;  // Under mtx_frame, NULL for none
+    uint64_t        deadline;       // Hint for the scheduler, nanoseconds
+
+    uint8_t         priority;       // Higher sheds work later
+    uint64_t        budget;         // Latency budget in nanoseconds, 0 for none
+    uint8_t         degradation;    // webcam_degradation_t, set by the budgeted webcams
+    uint32_t        degrade_frames; // Frames seen while degraded
+
+    uint64_t        standby_idle;   // Nanoseconds without demand until standby, 0 for never
+    uint8_t         standby_every;  // Converts every n-th frame on standby, 0 for none
+    uint64_t        demanded;       // Last grab, monotonic
+    bool            standby;
+    uint32_t        standby_frames; // Frames seen on standby
+    uint32_t        resuming;       // Grabs waiting for a frame after standby, under mtx_frame
+    uint64_t        processed;      // Frames converted, shed or found duplicate, under mtx_frame
+    bool            kept;           // The last frame skipped on standby is still dequeued, under mtx_frame
+    struct v4l2_buffer kept_buf;    // That frame, for a resuming grab to convert at once
+
+    webcam_motion_t motion;         // Of the last frame, under mtx_motion
+    uint8_t         motion_threshold;   // 0 for no motion detection
+    uint16_t        *background;    // Averaged luma, 12.4 fixed point
+    uint8_t         *averaged;      // Of the current frame
+    uint32_t        *motion_sums;   // Per block column of the current block row
+    uint16_t        motion_width;   // Of the averaged planes
+    uint16_t        motion_height;
+    uint64_t        motion_frames;  // Frames compared with the background
+    uint64_t        motion_events;  // Frames in which something moved
+    pthread_mutex_t mtx_motion;
+    pthread_cond_t  moved;
 
     uint16_t        width;
     uint16_t        height;
     uint8_t         colorspace;
+    uint32_t        pixelformat;
 
     char            formats[16][5];
     bool            streaming;
+
+    webcam_stats_t  stats;
+    int             perf_fd[WEBCAM_COUNTERS];
+
+    webcam_replay_t replay;
 } webcam_t;
 
 webcam_t *webcam_open(const char *dev);
@@ -51,3 +1060,111 @@ void webcam_close(webcam_t *w);
 void webcam_resize(webcam_t *w, uint16_t width, uint16_t height);
 void webcam_stream(webcam_t *w, bool flag);
 void webcam_grab(webcam_t *w, buffer_t *frame);
+bool webcam_wait_frame(webcam_t *w, buffer_t *frame, uint64_t *published, uint32_t timeout);
+void webcam_dedup(webcam_t *w, bool on, uint8_t tolerance);
+void webcam_sharpness(webcam_t *w, bool on);
+void webcam_budget(webcam_t *w, uint8_t priority, uint32_t budget);
+void webcam_standby(webcam_t *w, uint32_t idle, uint8_t every);
+float webcam_grab_sharpness(webcam_t *w);
+
+void webcam_sink_add(webcam_t *w, webcam_sink_t *s);
+void webcam_sink_remove(webcam_t *w, webcam_sink_t *s);
+
+webcam_output_t *webcam_output_add(webcam_t *w, uint32_t format, uint16_t width, uint16_t height,
+                                   uint16_t x, uint16_t y, uint16_t roi_width, uint16_t roi_height);
+void webcam_output_remove(webcam_t *w, webcam_output_t *o);
+void webcam_output_grab(webcam_output_t *o, buffer_t *frame);
+void webcam_output_sink_add(webcam_output_t *o, webcam_sink_t *s);
+void webcam_output_sink_remove(webcam_output_t *o, webcam_sink_t *s);
+
+webcam_mosaic_t *webcam_mosaic_open(uint8_t columns, uint8_t rows, uint16_t tile_width, uint16_t tile_height,
+                                    uint32_t fps);
+void webcam_mosaic_close(webcam_mosaic_t *m);
+webcam_output_t *webcam_mosaic_add(webcam_mosaic_t *m, webcam_t *w, uint8_t column, uint8_t row);
+bool webcam_mosaic_grab(webcam_mosaic_t *m, buffer_t *frame, webcam_mosaic_tile_t *tiles);
+void webcam_mosaic_sink_add(webcam_mosaic_t *m, webcam_sink_t *s);
+void webcam_mosaic_sink_remove(webcam_mosaic_t *m, webcam_sink_t *s);
+
+webcam_scheduler_t *webcam_scheduler_open(uint8_t workers);
+void webcam_scheduler_close(webcam_scheduler_t *s);
+bool webcam_scheduler_add(webcam_scheduler_t *s, webcam_t *w, uint32_t deadline);
+void webcam_scheduler_remove(webcam_scheduler_t *s, webcam_t *w);
+
+void webcam_pyramid(webcam_t *w, uint8_t levels, bool rgb);
+bool webcam_grab_pyramid(webcam_t *w, webcam_pyramid_t *pyramid);
+
+void webcam_integral(webcam_t *w, bool on);
+bool webcam_grab_integral(webcam_t *w, webcam_integral_t *integral);
+
+void webcam_motion(webcam_t *w, uint8_t threshold);
+bool webcam_grab_motion(webcam_t *w, webcam_motion_t *motion);
+bool webcam_wait_motion(webcam_t *w, webcam_motion_t *motion, uint32_t timeout);
+
+webcam_recorder_t *webcam_recorder_open(const char *path, webcam_record_source_t source,
+                                        webcam_codec_t codec, size_t length, uint8_t nslots);
+void webcam_recorder_close(webcam_recorder_t *r);
+webcam_recorder_t *webcam_record(webcam_t *w, const char *path, webcam_record_source_t source,
+                                 webcam_codec_t codec);
+void webcam_record_stop(webcam_t *w, webcam_recorder_t *r);
+int webcam_recorder_trigger_setup(webcam_recorder_t *r, uint32_t preroll, uint32_t postroll, uint32_t motion,
+                                  uint32_t fps);
+void webcam_recorder_trigger(webcam_recorder_t *r);
+void webcam_recorder_trigger_on_signal(int sig);
+webcam_recorder_t *webcam_record_triggered(webcam_t *w, const char *path, webcam_record_source_t source,
+                                           webcam_codec_t codec, uint32_t preroll, uint32_t postroll,
+                                           uint32_t motion);
+
+webcam_pipe_t *webcam_pipe_open(int fd, webcam_pipe_format_t format, uint16_t width, uint16_t height,
+                                uint32_t fps, uint8_t nslots);
+void webcam_pipe_close(webcam_pipe_t *p);
+webcam_pipe_t *webcam_pipe(webcam_t *w, int fd, webcam_pipe_format_t format);
+void webcam_pipe_stop(webcam_t *w, webcam_pipe_t *p);
+
+webcam_http_t *webcam_http_open(const char *address, uint16_t port, uint8_t quality);
+void webcam_http_close(webcam_http_t *h);
+webcam_http_stream_t *webcam_http_stream_open(webcam_http_t *h, uint8_t index);
+webcam_http_stream_t *webcam_http_serve(webcam_http_t *h, webcam_t *w);
+webcam_jpeg_t *webcam_jpeg_ref(webcam_jpeg_t *j);
+void webcam_jpeg_release(webcam_jpeg_t *j);
+
+webcam_rtp_t *webcam_rtp_open(const char *address, uint16_t port, uint16_t width, uint16_t height,
+                              uint8_t nslots);
+void webcam_rtp_close(webcam_rtp_t *r);
+webcam_rtp_t *webcam_rtp(webcam_t *w, const char *address, uint16_t port);
+void webcam_rtp_stop(webcam_t *w, webcam_rtp_t *r);
+webcam_rtp_receiver_t *webcam_rtp_receiver_open(uint16_t port, uint16_t width, uint16_t height,
+                                                webcam_sink_t *sink);
+void webcam_rtp_receiver_close(webcam_rtp_receiver_t *r);
+
+webcam_local_t *webcam_local_open(const char *path, uint16_t width, uint16_t height, uint8_t nslots);
+void webcam_local_close(webcam_local_t *l);
+webcam_local_t *webcam_local(webcam_t *w, const char *path);
+void webcam_local_stop(webcam_t *w, webcam_local_t *l);
+webcam_local_connection_t *webcam_local_connect(const char *path, uint32_t format, uint16_t x, uint16_t y,
+                                                uint16_t width, uint16_t height);
+const uint8_t *webcam_local_next(webcam_local_connection_t *c, webcam_local_message_t *m);
+bool webcam_local_valid(webcam_local_connection_t *c, const webcam_local_message_t *m);
+void webcam_local_disconnect(webcam_local_connection_t *c);
+
+webcam_group_t *webcam_group_open(webcam_t **webcams, uint8_t count, uint32_t tolerance);
+void webcam_group_close(webcam_group_t *g);
+bool webcam_group_grab(webcam_group_t *g, buffer_t *frames, uint64_t *timestamps, uint32_t timeout);
+
+void webcam_replay(webcam_t *w, bool realtime, bool loop);
+
+webcam_archive_t *webcam_archive_open(const char *path);
+void webcam_archive_close(webcam_archive_t *a);
+const webcam_archive_frame_t *webcam_archive_frame(webcam_archive_t *a, uint64_t n, buffer_t *payload);
+int64_t webcam_archive_find(webcam_archive_t *a, uint64_t timestamp);
+int webcam_archive_decode(webcam_archive_t *a, uint64_t n, buffer_t *out);
+
+void webcam_stats(webcam_t *w, webcam_stats_t *stats);
+void webcam_stats_reset(webcam_t *w);
+uint64_t webcam_stats_percentile(const webcam_histogram_t *h, double p);
+uint64_t webcam_stats_bucket_value(uint16_t bucket);
+const char *webcam_stage_name(webcam_stage_t s);
+const char *webcam_counter_name(webcam_counter_t c);
+
+void webcam_trace_dump(FILE *fp);
+int webcam_trace_save(const char *path);
+void webcam_trace_on_signal(int sig, const char *path);